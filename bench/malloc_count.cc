@@ -0,0 +1,41 @@
+// See the file "COPYING" for copyright.
+//
+// Heap allocation counter, preloaded into zeek by run.sh
+//
+// Counts calls to malloc, calloc and realloc (which operator new goes
+// through) and prints "mallocs <count>" to stderr at exit.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" {
+
+void * __libc_malloc(size_t size);
+void * __libc_calloc(size_t count, size_t size);
+void * __libc_realloc(void * ptr, size_t size);
+
+static std::atomic<unsigned long long> mallocs(0);
+
+void * malloc(size_t size) {
+    mallocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size) {
+    mallocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void * realloc(void * ptr, size_t size) {
+    mallocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+}
+
+static struct Report {
+    ~Report() {
+        fprintf(stderr, "mallocs %llu\n", mallocs.load());
+    }
+} report;
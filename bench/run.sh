@@ -0,0 +1,60 @@
+#! /usr/bin/env bash
+#
+# Run the TCP writer benchmark in every mode, over plain TCP and TLS.
+#
+#   run.sh <sink> [records] [sink delay usec]
+#
+# The sink prints a line per stream with what it received, followed by
+# the CPU time Zeek used per record written and, when the malloc counter
+# was built next to the sink, the heap allocations per record.
+
+set -e
+
+sink=$1
+records=${2:-100000}
+delay=${3:-0}
+port=19990
+
+base=`cd \`dirname $0\` && pwd`
+tmp=`mktemp -d`
+trap 'kill $sink_pid 2>/dev/null; rm -rf $tmp' EXIT
+
+# run against the plugin in this tree, as the tests do
+PATH=`$base/../tests/Scripts/get-zeek-env path`
+ZEEKPATH=`$base/../tests/Scripts/get-zeek-env zeekpath`
+ZEEK_PLUGIN_PATH=`$base/../tests/Scripts/get-zeek-env zeek_plugin_path`
+export PATH ZEEKPATH ZEEK_PLUGIN_PATH
+
+malloc_count=`dirname $sink`/libtcpwriter-malloc-count.so
+
+openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=127.0.0.1 -addext subjectAltName=IP:127.0.0.1 -keyout $tmp/key.pem -out $tmp/cert.pem -days 1 2>/dev/null
+
+for transport in tcp tls; do
+    if [ $transport = tls ]; then
+        $sink -p $port -d $delay -c $tmp/cert.pem -k $tmp/key.pem &
+    else
+        $sink -p $port -d $delay &
+    fi
+
+    sink_pid=$!
+    sleep 1
+
+    for mode in per_record batched compressed binary coded threaded; do
+        echo "== $transport $mode"
+
+        preload=
+        [ -e $malloc_count ] && preload=$malloc_count
+
+        ( cd $tmp && time -p env LD_PRELOAD=$preload zeek -b $base/bench.zeek Bench::mode=$mode Bench::records=$records Bench::tcpport=$port Bench::tls=`[ $transport = tls ] && echo T || echo F` Bench::cert=$tmp/cert.pem ) 2>$tmp/time
+        sleep 1
+
+        cpu=`awk '/^user|^sys/ { cpu += $2 } END { print cpu }' $tmp/time`
+        echo "cpu=${cpu}s cpu/record=`echo "$cpu $records" | awk '{ printf "%.2f", $1 / ($2 * 3) * 1e6 }'`us"
+
+        mallocs=`awk '/^mallocs / { n = $2 } END { print n }' $tmp/time`
+        [ -n "$mallocs" ] && echo "mallocs=$mallocs mallocs/record=`echo "$mallocs $records" | awk '{ printf "%.2f", $1 / ($2 * 3) }'`"
+    done
+
+    kill $sink_pid
+    wait $sink_pid 2>/dev/null || true
+done
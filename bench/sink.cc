@@ -0,0 +1,371 @@
+// See the file "COPYING" for copyright.
+//
+// Collector for benchmarking the TCP writer, measuring what arrives
+//
+// Every connection is expected to start with a key line naming the
+// stream and its format, as in "conn json", which bench.zeek sends. A
+// summary of records, bytes, rates and end-to-end latency from the
+// records' ts field is printed when the connection closes.
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <zlib.h>
+
+static std::mutex output_lock;
+
+static double Now() {
+    // wall clock time, to compare with the ts of records
+    return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+class Session {
+
+public:
+    Session(int sock, SSL * ssl, int delay) : sock(sock), ssl(ssl), delay(delay), header(true), gzip(false), binary(false), last_ts(0), records(0), bytes(0), start(0), end(0) {}
+
+    ~Session() {
+        if (gzip)
+            inflateEnd(&stream);
+
+        if (ssl != nullptr) {
+            SSL_shutdown(ssl);
+            SSL_free(ssl);
+        }
+
+        close(sock);
+    }
+
+    void Run() {
+        if (ssl != nullptr && SSL_accept(ssl) <= 0) {
+            Report("TLS handshake failed");
+            return;
+        }
+
+        char buf[65536];
+
+        for (;;) {
+            ssize_t ret = ssl != nullptr ? SSL_read(ssl, buf, sizeof(buf)) : recv(sock, buf, sizeof(buf), 0);
+            if (ret <= 0)
+                break;
+
+            if (start == 0)
+                start = Now();
+
+            end = Now();
+            bytes += ret;
+
+            if (!Received(buf, ret)) {
+                Report("Error decoding stream");
+                return;
+            }
+
+            // play a slow collector
+            if (delay > 0)
+                usleep(delay);
+        }
+
+        Report(nullptr);
+    }
+
+private:
+    bool Received(const char * data, size_t len) {
+        if (!header)
+            return Decode(data, len);
+
+        // the key line and an optional compression line come before the
+        // records
+        raw.append(data, len);
+
+        for (;;) {
+            // records of the binary format are not lines
+            if (!name.empty() && !raw.empty() && raw[0] != '#')
+                break;
+
+            size_t eol = raw.find('\n');
+            if (eol == std::string::npos)
+                return true;
+
+            std::string line = raw.substr(0, eol);
+
+            if (name.empty()) {
+                name = line;
+                binary = line.find(" binary") != std::string::npos;
+            }
+            else if (line.compare(0, 13, "#compression ") == 0) {
+                if (line != "#compression gzip")
+                    return false;
+
+                gzip = true;
+                memset(&stream, 0, sizeof(stream));
+
+                if (inflateInit2(&stream, 15 + 16) != Z_OK)
+                    return false;
+            }
+            else {
+                break;
+            }
+
+            raw.erase(0, eol + 1);
+
+            // the compressor may take over right after its line
+            if (gzip)
+                break;
+        }
+
+        header = false;
+
+        std::string rest;
+        rest.swap(raw);
+
+        return Decode(rest.data(), rest.size());
+    }
+
+    bool Decode(const char * data, size_t len) {
+        if (!gzip) {
+            pending.append(data, len);
+            return Parse();
+        }
+
+        char out[65536];
+
+        stream.next_in = (Bytef *)data;
+        stream.avail_in = len;
+
+        do {
+            stream.next_out = (Bytef *)out;
+            stream.avail_out = sizeof(out);
+
+            int ret = inflate(&stream, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                return false;
+
+            pending.append(out, sizeof(out) - stream.avail_out);
+        } while (stream.avail_out == 0);
+
+        return Parse();
+    }
+
+    bool Parse() {
+        size_t offset = 0;
+        double now = Now();
+
+        if (binary) {
+            // length prefixed messages, records carrying ts first
+            while (pending.size() - offset >= 4) {
+                uint32_t len;
+                memcpy(&len, pending.data() + offset, 4);
+                len = ntohl(len);
+
+                if (pending.size() - offset - 4 < len)
+                    break;
+
+                const char * msg = pending.data() + offset + 4;
+
+                if (len >= 14 && msg[0] == 'R') {
+                    records++;
+
+                    if (msg[5]) {
+                        uint64_t bits = 0;
+                        for (int i = 0; i < 8; i++)
+                            bits = bits << 8 | (uint8_t)msg[6 + i];
+
+                        double ts;
+                        memcpy(&ts, &bits, sizeof(ts));
+                        latencies.push_back(now - ts);
+                    }
+                }
+                else if (len >= 7 && msg[0] == 'E') {
+                    records++;
+
+                    // ts as a delta since the record before, unless the
+                    // batch starts over
+                    if (msg[5] & 1)
+                        last_ts = 0;
+
+                    if (msg[6]) {
+                        uint64_t zigzag = 0;
+                        for (size_t i = 7, shift = 0; i < len; i++, shift += 7) {
+                            zigzag |= (uint64_t)(msg[i] & 0x7f) << shift;
+                            if (!(msg[i] & 0x80))
+                                break;
+                        }
+
+                        last_ts += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+                        latencies.push_back(now - last_ts / 1e6);
+                    }
+                }
+
+                offset += 4 + len;
+            }
+        }
+        else {
+            // a record per line, with ts first in tsv lines
+            for (;;) {
+                size_t eol = pending.find('\n', offset);
+                if (eol == std::string::npos)
+                    break;
+
+                const char * line = pending.data() + offset;
+
+                if (line[0] != '#') {
+                    records++;
+
+                    const char * ts = line[0] == '{' ? strstr(line, "\"ts\":") : line;
+                    if (ts != nullptr && ts < pending.data() + eol)
+                        latencies.push_back(now - strtod(ts[0] == '"' ? ts + 5 : ts, nullptr));
+                }
+
+                offset = eol + 1;
+            }
+        }
+
+        pending.erase(0, offset);
+
+        return true;
+    }
+
+    void Report(const char * failure) {
+        std::lock_guard<std::mutex> guard(output_lock);
+
+        if (failure != nullptr) {
+            fprintf(stderr, "%s: %s\n", name.empty() ? "unknown" : name.c_str(), failure);
+            return;
+        }
+
+        double secs = end - start;
+        double p50 = 0;
+        double p99 = 0;
+
+        if (!latencies.empty()) {
+            std::sort(latencies.begin(), latencies.end());
+            p50 = latencies[latencies.size() / 2];
+            p99 = latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+        }
+
+        printf("%-16s records=%" PRIu64 " bytes=%" PRIu64 " secs=%.3f records/s=%.0f MB/s=%.2f p50=%.3fms p99=%.3fms\n", name.c_str(), records, bytes, secs, secs > 0 ? records / secs : 0, secs > 0 ? bytes / secs / 1e6 : 0, p50 * 1e3, p99 * 1e3);
+        fflush(stdout);
+    }
+
+    int sock;
+    SSL * ssl;
+    int delay;
+
+    bool header;
+    bool gzip;
+    bool binary;
+    int64_t last_ts;
+    z_stream stream;
+
+    std::string name;
+    std::string raw;
+    std::string pending;
+
+    uint64_t records;
+    uint64_t bytes;
+    double start;
+    double end;
+    std::vector<double> latencies;
+};
+
+static void Usage() {
+    fprintf(stderr, "usage: tcpwriter-sink [-p port] [-c cert -k key] [-d usec]\n");
+    fprintf(stderr, "  -p  port to listen on, 1337 by default\n");
+    fprintf(stderr, "  -c  certificate, enabling tls with the key given by -k\n");
+    fprintf(stderr, "  -d  microseconds to sleep after every read\n");
+    exit(1);
+}
+
+int main(int argc, char ** argv) {
+    int port = 1337;
+    const char * cert = nullptr;
+    const char * key = nullptr;
+    int delay = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:c:k:d:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            cert = optarg;
+            break;
+        case 'k':
+            key = optarg;
+            break;
+        case 'd':
+            delay = atoi(optarg);
+            break;
+        default:
+            Usage();
+        }
+    }
+
+    if ((cert == nullptr) != (key == nullptr))
+        Usage();
+
+    // writers going away mid tls shutdown are not fatal
+    signal(SIGPIPE, SIG_IGN);
+
+    SSL_CTX * ctx = nullptr;
+
+    if (cert != nullptr) {
+        ctx = SSL_CTX_new(TLS_server_method());
+
+        if (ctx == nullptr || SSL_CTX_use_certificate_chain_file(ctx, cert) <= 0 || SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) <= 0) {
+            ERR_print_errors_fp(stderr);
+            return 1;
+        }
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+        perror("Error listening");
+        return 1;
+    }
+
+    for (;;) {
+        int sock = accept(listener, nullptr, nullptr);
+        if (sock < 0)
+            continue;
+
+        SSL * ssl = nullptr;
+
+        if (ctx != nullptr) {
+            ssl = SSL_new(ctx);
+            SSL_set_fd(ssl, sock);
+        }
+
+        std::thread([sock, ssl, delay]() {
+            Session session(sock, ssl, delay);
+            session.Run();
+        }).detach();
+    }
+}
@@ -0,0 +1,56 @@
+// See the file "COPYING" for copyright.
+//
+// Growable byte buffer that data is read into and consumed from the front
+
+#include <cstring>
+
+#include "Buffer.h"
+
+using namespace receiver;
+
+Buffer::Buffer() : data(nullptr), capacity(0), start(0), end(0) {}
+
+Buffer::~Buffer() {
+    delete [] data;
+}
+
+char * Buffer::Space(size_t len) {
+    if (capacity - end >= len)
+        return data + end;
+
+    // move what is left to the front before growing
+    if (start > 0) {
+        memmove(data, data + start, end - start);
+        end -= start;
+        start = 0;
+
+        if (capacity - end >= len)
+            return data + end;
+    }
+
+    size_t size = capacity > 0 ? capacity : 65536;
+    while (size - end < len)
+        size *= 2;
+
+    char * grown = new char[size];
+    if (end > 0)
+        memcpy(grown, data, end);
+
+    delete [] data;
+    data = grown;
+    capacity = size;
+
+    return data + end;
+}
+
+void Buffer::Append(const char * bytes, size_t len) {
+    memcpy(Space(len), bytes, len);
+    Grow(len);
+}
+
+void Buffer::Consume(size_t n) {
+    start += n;
+
+    if (start == end)
+        start = end = 0;
+}
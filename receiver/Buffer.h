@@ -0,0 +1,41 @@
+// See the file "COPYING" for copyright.
+//
+// Growable byte buffer that data is read into and consumed from the front
+
+#pragma once
+
+#include <cstddef>
+
+namespace receiver {
+
+class Buffer {
+
+public:
+    Buffer();
+    ~Buffer();
+
+    // room for at least len more bytes at the end, compacting or growing
+    char * Space(size_t len);
+
+    // count n bytes written into the room as data
+    void Grow(size_t n) { end += n; }
+
+    void Append(const char * bytes, size_t len);
+
+    const char * Data() const { return data + start; }
+    size_t Size() const { return end - start; }
+
+    void Consume(size_t n);
+    void Clear() { start = end = 0; }
+
+private:
+    Buffer(const Buffer &) = delete;
+    Buffer & operator=(const Buffer &) = delete;
+
+    char * data;
+    size_t capacity;
+    size_t start;
+    size_t end;
+};
+
+}
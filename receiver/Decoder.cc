@@ -0,0 +1,615 @@
+// See the file "COPYING" for copyright.
+//
+// Decoder for the stream a TCP writer sends over one connection
+
+#include <algorithm>
+#include <cstring>
+
+#include "Decoder.h"
+
+using namespace receiver;
+
+// longest header or frame line taken before giving up on the peer
+static const size_t MAX_LINE = 4096;
+
+// largest binary message taken
+static const uint32_t MAX_MESSAGE = 1 << 28;
+
+// most slots of a dictionary coded field taken
+static const uint64_t MAX_SLOTS = 1 << 16;
+
+// binary value types and codings, as in src/Binary.h
+enum Type : uint8_t {
+    BOOL = 1,
+    INT = 2,
+    COUNT = 3,
+    DOUBLE = 4,
+    TIME = 5,
+    INTERVAL = 6,
+    PORT = 7,
+    ADDR = 8,
+    SUBNET = 9,
+    SET = 13,
+    VECTOR = 14,
+};
+
+enum Coding : uint8_t {
+    PLAIN = 0,
+    DICTIONARY = 1,
+    DELTA = 2,
+};
+
+static const uint8_t RESET = 1;
+
+static uint16_t Read16(const char * data) {
+    const unsigned char * bytes = (const unsigned char *)data;
+    return (uint16_t)(bytes[0] << 8 | bytes[1]);
+}
+
+static uint32_t Read32(const char * data) {
+    const unsigned char * bytes = (const unsigned char *)data;
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+static void Append32(std::string & out, uint32_t val) {
+    char bytes[4] = {(char)(val >> 24), (char)(val >> 16), (char)(val >> 8), (char)val};
+    out.append(bytes, sizeof(bytes));
+}
+
+static bool ReadVarint(const char * data, size_t size, size_t & pos, uint64_t & val) {
+    val = 0;
+
+    for (int shift = 0; shift < 64 && pos < size; shift += 7) {
+        uint8_t byte = data[pos++];
+        val |= (uint64_t)(byte & 0x7f) << shift;
+
+        if (!(byte & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+static bool SkipValue(uint8_t type, uint8_t subtype, const char * data, size_t size, size_t & pos) {
+    // move pos past a plain value of the type
+    size_t len;
+
+    switch (type) {
+    case BOOL:
+        len = 1;
+        break;
+
+    case INT:
+    case COUNT:
+    case DOUBLE:
+    case TIME:
+    case INTERVAL:
+        len = 8;
+        break;
+
+    case PORT:
+        len = 9;
+        break;
+
+    case ADDR:
+    case SUBNET:
+        if (pos >= size)
+            return false;
+
+        len = 1 + (data[pos] == 4 ? 4 : 16) + (type == SUBNET);
+        break;
+
+    case SET:
+    case VECTOR: {
+        if (size - pos < 4)
+            return false;
+
+        uint32_t elements = Read32(data + pos);
+        pos += 4;
+
+        for (uint32_t i = 0; i < elements; i++) {
+            if (pos >= size)
+                return false;
+
+            if (data[pos++] && !SkipValue(subtype, 0, data, size, pos))
+                return false;
+        }
+
+        return true;
+    }
+
+    default:
+        // strings and everything sent like them
+        if (size - pos < 4)
+            return false;
+
+        len = 4 + (size_t)Read32(data + pos);
+        break;
+    }
+
+    if (size - pos < len)
+        return false;
+
+    pos += len;
+
+    return true;
+}
+
+bool Sessions::Seen(const std::string & session, uint64_t sequence) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    uint64_t & last = received[session];
+    if (sequence <= last)
+        return true;
+
+    last = sequence;
+    return false;
+}
+
+Decoder::Decoder(const std::string & peer, const std::string & key, Sessions * sessions) : peer(peer), key(key), sessions(sessions), state(key.empty() ? HEADERS : KEY), acks(false), decompressor(nullptr), format(UNKNOWN) {}
+
+Decoder::~Decoder() {
+    delete decompressor;
+}
+
+bool Decoder::Fail(const std::string & msg) {
+    error = msg;
+    return false;
+}
+
+char * Decoder::Prepare(size_t len) {
+    // compressed data is read aside and decompressed into the buffer
+    return decompressor != nullptr ? raw.Space(len) : buffer.Space(len);
+}
+
+bool Decoder::Commit(size_t n, const Handler & handler) {
+    if (decompressor != nullptr) {
+        raw.Grow(n);
+
+        if (!decompressor->Decompress(raw.Data(), raw.Size(), buffer))
+            return Fail(decompressor->LastError());
+
+        raw.Clear();
+    }
+    else {
+        buffer.Grow(n);
+    }
+
+    if (state != BODY && !Headers())
+        return false;
+
+    if (state != BODY)
+        return true;
+
+    return Body(handler);
+}
+
+bool Decoder::Headers() {
+    while (state != BODY) {
+        const char * data = buffer.Data();
+        size_t size = buffer.Size();
+
+        // lines of the records start right after the headers
+        if (state == HEADERS && size > 0 && data[0] != '#') {
+            state = BODY;
+            break;
+        }
+
+        const char * eol = (const char *)memchr(data, '\n', size);
+        if (eol == nullptr) {
+            if (size > MAX_LINE)
+                return Fail("Header line too long");
+
+            return true;
+        }
+
+        std::string line(data, eol - data);
+
+        if (state == KEY) {
+            if (line != key)
+                return Fail("Wrong key");
+
+            state = HEADERS;
+        }
+        else if (line.compare(0, 6, "#acks ") == 0) {
+            acks = true;
+            session = line.substr(6);
+        }
+        else if (line.compare(0, 13, "#compression ") == 0) {
+            decompressor = Decompressor::Create(line.substr(13));
+            if (decompressor == nullptr)
+                return Fail("Unsupported compression: " + line.substr(13));
+
+            // what came after the line is already compressed
+            buffer.Consume(eol + 1 - data);
+            raw.Append(buffer.Data(), buffer.Size());
+            buffer.Clear();
+
+            if (!decompressor->Decompress(raw.Data(), raw.Size(), buffer))
+                return Fail(decompressor->LastError());
+
+            raw.Clear();
+            state = BODY;
+            break;
+        }
+        else {
+            // tsv headers and batch frames are part of the body
+            state = BODY;
+            break;
+        }
+
+        buffer.Consume(eol + 1 - data);
+    }
+
+    return true;
+}
+
+bool Decoder::Body(const Handler & handler) {
+    for (;;) {
+        const char * data = buffer.Data();
+        size_t size = buffer.Size();
+        size_t used;
+
+        if (!acks) {
+            // records end wherever, so keep what is cut for the next read
+            if (!Records(data, size, used, handler))
+                return false;
+
+            buffer.Consume(used);
+            return true;
+        }
+
+        const char * eol = (const char *)memchr(data, '\n', std::min(size, MAX_LINE));
+        if (eol == nullptr) {
+            if (size >= MAX_LINE)
+                return Fail("Invalid batch frame");
+
+            return true;
+        }
+
+        std::string line(data, eol - data);
+        unsigned long long sequence;
+        unsigned long long records;
+        unsigned long long len;
+
+        if (sscanf(line.c_str(), "#batch %llu %llu %llu", &sequence, &records, &len) != 3)
+            return Fail("Invalid batch frame: " + line);
+
+        size_t header = eol + 1 - data;
+        if (size - header < len)
+            return true;
+
+        // batch 0 describes the records of this connection, the others
+        // may have been received before a reconnect
+        if (sequence == 0 || !sessions->Seen(session, sequence)) {
+            if (!Records(data + header, len, used, handler))
+                return false;
+
+            if (used != len)
+                return Fail("Batch ends within a record");
+        }
+
+        if (sequence > 0)
+            replies += "#ack " + std::to_string(sequence) + "\n";
+
+        buffer.Consume(header + len);
+    }
+}
+
+bool Decoder::Records(const char * data, size_t len, size_t & used, const Handler & handler) {
+    used = 0;
+
+    // the first record tells the format
+    if (format == UNKNOWN) {
+        if (len == 0)
+            return true;
+
+        format = data[0] == '{' ? JSON : data[0] == '#' ? TSV : BINARY;
+    }
+
+    if (format == BINARY)
+        return Messages(data, len, used, handler);
+
+    return Lines(data, len, used, handler);
+}
+
+bool Decoder::Lines(const char * data, size_t len, size_t & used, const Handler & handler) {
+    const char * start = data;
+    const char * end = data + len;
+
+    while (start < end) {
+        const char * eol = (const char *)memchr(start, '\n', end - start);
+        if (eol == nullptr)
+            break;
+
+        std::string_view line(start, eol - start);
+        Record record{peer, path, format, line, false};
+
+        if (format == TSV && !line.empty() && line[0] == '#') {
+            record.header = true;
+
+            if (line.substr(0, 6) == "#path\t") {
+                path = line.substr(6);
+                record.path = path;
+
+                // the separator lines come before the path
+                for (const std::string & held_line : held)
+                    handler(Record{peer, path, format, held_line, true});
+
+                held.clear();
+            }
+            else if (path.empty()) {
+                held.emplace_back(line);
+
+                start = eol + 1;
+                continue;
+            }
+        }
+        else if (format == JSON && line.substr(0, 10) == "{\"_path\":\"") {
+            // writers sharing a connection tag their records
+            size_t quote = line.find('"', 10);
+            if (quote != std::string_view::npos)
+                record.path = line.substr(10, quote - 10);
+        }
+
+        if (!held.empty()) {
+            for (const std::string & held_line : held)
+                handler(Record{peer, path, format, held_line, true});
+
+            held.clear();
+        }
+
+        handler(record);
+
+        start = eol + 1;
+    }
+
+    used = start - data;
+
+    return true;
+}
+
+bool Decoder::Messages(const char * data, size_t len, size_t & used, const Handler & handler) {
+    size_t offset = 0;
+
+    while (len - offset >= 4) {
+        uint32_t size = Read32(data + offset);
+        if (size == 0 || size > MAX_MESSAGE)
+            return Fail("Invalid binary message");
+
+        if (len - offset - 4 < size)
+            break;
+
+        const char * msg = data + offset + 4;
+        Record record{peer, std::string_view(), BINARY, std::string_view(msg, size), false};
+
+        if (msg[0] == 'S') {
+            if (!Schema(msg, size))
+                return Fail("Invalid binary schema");
+
+            record.path = streams[Read32(msg + 2)].path;
+            record.header = true;
+        }
+        else if (msg[0] == 'C') {
+            // codings only tell how to expand the records that follow
+            if (!Codings(msg, size))
+                return Fail("Invalid binary codings");
+
+            offset += 4 + size;
+            continue;
+        }
+        else if (msg[0] == 'D') {
+            // as are the slots and deltas records sent again start from
+            if (!Resync(msg, size))
+                return Fail("Invalid binary state");
+
+            offset += 4 + size;
+            continue;
+        }
+        else if ((msg[0] == 'R' || msg[0] == 'E') && size >= 5) {
+            std::unordered_map<uint32_t, Stream>::iterator it = streams.find(Read32(msg + 1));
+            if (it != streams.end())
+                record.path = it->second.path;
+
+            if (msg[0] == 'E') {
+                if (it == streams.end() || !Expand(it->second, msg, size))
+                    return Fail("Invalid encoded binary record");
+
+                record.data = expanded;
+            }
+        }
+
+        handler(record);
+
+        offset += 4 + size;
+    }
+
+    used = offset;
+
+    return true;
+}
+
+bool Decoder::Schema(const char * msg, size_t size) {
+    // type, version, stream and the length of the path
+    if (size < 10 || 10 + (uint64_t)Read32(msg + 6) + 2 > size)
+        return false;
+
+    Stream & stream = streams[Read32(msg + 2)];
+    size_t pos = 10 + Read32(msg + 6);
+
+    stream.path.assign(msg + 10, pos - 10);
+
+    // codings of an earlier schema are gone with it
+    stream.types.clear();
+    stream.subtypes.clear();
+    stream.codings.clear();
+
+    uint16_t fields = Read16(msg + pos);
+    pos += 2;
+
+    for (uint16_t i = 0; i < fields; i++) {
+        // name, type, subtype and whether the field is optional
+        if (size - pos < 4 || size - pos - 4 < (uint64_t)Read32(msg + pos) + 3)
+            return false;
+
+        pos += 4 + Read32(msg + pos);
+
+        stream.types.push_back(msg[pos]);
+        stream.subtypes.push_back(msg[pos + 1]);
+        pos += 3;
+    }
+
+    return true;
+}
+
+bool Decoder::Codings(const char * msg, size_t size) {
+    // type, stream and the number of fields the schema described
+    if (size < 7)
+        return false;
+
+    std::unordered_map<uint32_t, Stream>::iterator it = streams.find(Read32(msg + 1));
+    if (it == streams.end())
+        return false;
+
+    Stream & stream = it->second;
+    size_t fields = Read16(msg + 5);
+
+    if (fields != stream.types.size() || size != 7 + fields)
+        return false;
+
+    stream.codings.assign(msg + 7, msg + 7 + fields);
+    stream.slots.assign(fields, std::vector<std::string>());
+    stream.times.assign(fields, 0);
+
+    return true;
+}
+
+bool Decoder::Resync(const char * msg, size_t size) {
+    // type and stream, then the state of every coded field
+    if (size < 5)
+        return false;
+
+    std::unordered_map<uint32_t, Stream>::iterator it = streams.find(Read32(msg + 1));
+    if (it == streams.end() || it->second.codings.empty())
+        return false;
+
+    Stream & stream = it->second;
+    size_t pos = 5;
+
+    for (size_t i = 0; i < stream.codings.size(); i++) {
+        if (stream.codings[i] == DICTIONARY) {
+            std::vector<std::string> & slots = stream.slots[i];
+            uint64_t count;
+
+            if (!ReadVarint(msg, size, pos, count) || count > MAX_SLOTS)
+                return false;
+
+            slots.assign(count, std::string());
+
+            for (std::string & slot : slots) {
+                uint64_t len;
+                if (!ReadVarint(msg, size, pos, len) || len > size - pos)
+                    return false;
+
+                slot.assign(msg + pos, len);
+                pos += len;
+            }
+        }
+        else if (stream.codings[i] == DELTA) {
+            if (size - pos < 8)
+                return false;
+
+            stream.times[i] = (int64_t)((uint64_t)Read32(msg + pos) << 32 | Read32(msg + pos + 4));
+            pos += 8;
+        }
+    }
+
+    return pos == size;
+}
+
+bool Decoder::Expand(Stream & stream, const char * msg, size_t size) {
+    // type, stream and flags
+    if (stream.codings.empty() || size < 6)
+        return false;
+
+    if (msg[5] & RESET) {
+        for (std::vector<std::string> & slots : stream.slots)
+            slots.clear();
+
+        std::fill(stream.times.begin(), stream.times.end(), 0);
+    }
+
+    // the plain record has the same stream, and values copied or looked up
+    expanded.assign("R");
+    expanded.append(msg + 1, 4);
+
+    size_t pos = 6;
+
+    for (size_t i = 0; i < stream.codings.size(); i++) {
+        if (pos >= size)
+            return false;
+
+        bool present = msg[pos++];
+        expanded.push_back(present);
+
+        if (!present)
+            continue;
+
+        if (stream.codings[i] == PLAIN) {
+            size_t start = pos;
+            if (!SkipValue(stream.types[i], stream.subtypes[i], msg, size, pos))
+                return false;
+
+            expanded.append(msg + start, pos - start);
+        }
+        else if (stream.codings[i] == DICTIONARY) {
+            std::vector<std::string> & slots = stream.slots[i];
+            uint64_t ref;
+            uint64_t slot;
+
+            if (!ReadVarint(msg, size, pos, ref))
+                return false;
+
+            if (ref == 0) {
+                // a new value for the slot
+                uint64_t len;
+
+                if (!ReadVarint(msg, size, pos, slot) || !ReadVarint(msg, size, pos, len) || slot >= MAX_SLOTS || len > size - pos)
+                    return false;
+
+                if (slot >= slots.size())
+                    slots.resize(slot + 1);
+
+                slots[slot].assign(msg + pos, len);
+                pos += len;
+            }
+            else {
+                slot = ref - 1;
+                if (slot >= slots.size())
+                    return false;
+            }
+
+            Append32(expanded, slots[slot].size());
+            expanded.append(slots[slot]);
+        }
+        else if (stream.codings[i] == DELTA) {
+            uint64_t zigzag;
+            if (!ReadVarint(msg, size, pos, zigzag))
+                return false;
+
+            stream.times[i] += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+
+            double val = stream.times[i] / 1e6;
+            uint64_t bits;
+            memcpy(&bits, &val, sizeof(bits));
+
+            Append32(expanded, bits >> 32);
+            Append32(expanded, bits & 0xffffffff);
+        }
+        else {
+            return false;
+        }
+    }
+
+    return pos == size;
+}
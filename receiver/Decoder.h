@@ -0,0 +1,143 @@
+// See the file "COPYING" for copyright.
+//
+// Decoder for the stream a TCP writer sends over one connection
+//
+// A connection starts with the key line when the writer has a key, then
+// optionally "#acks <session>" and "#compression <name>" lines. What
+// follows, decompressed, is either records or, with acks, batches framed
+// by "#batch <sequence> <records> <length>" lines that are acknowledged
+// with "#ack <sequence>" replies. Records are json objects or tsv lines,
+// one per line, or binary messages with a 32 bit length as described in
+// src/Binary.h. Encoded binary records are passed on as the plain records
+// they stand for, and their codings and state messages not at all.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Buffer.h"
+#include "Decompressor.h"
+
+namespace receiver {
+
+enum Format {
+    UNKNOWN,
+    JSON,
+    TSV,
+    BINARY,
+};
+
+struct Record {
+    std::string_view peer;
+
+    // log path, empty when the stream does not carry it (json without
+    // multiplex)
+    std::string_view path;
+
+    Format format;
+
+    // a line without its newline, or a binary message without its length,
+    // pointing into the decoder's buffer (or, for an encoded record, what
+    // it was expanded to)
+    std::string_view data;
+
+    // tsv header lines and binary schemas, which describe the records
+    // that follow
+    bool header;
+};
+
+typedef std::function<void(const Record &)> Handler;
+
+// highest batch received per writer session, for telling retransmits
+// after a reconnect apart
+class Sessions {
+
+public:
+    // whether the batch was received before, remembering it if not
+    bool Seen(const std::string & session, uint64_t sequence);
+
+private:
+    std::mutex lock;
+    std::unordered_map<std::string, uint64_t> received;
+};
+
+class Decoder {
+
+public:
+    // key is the line expected first, empty when the writer sends none
+    Decoder(const std::string & peer, const std::string & key, Sessions * sessions);
+    ~Decoder();
+
+    // room for reading at least len bytes from the connection
+    char * Prepare(size_t len);
+
+    // decode n bytes read into the room, passing the records to handler
+    bool Commit(size_t n, const Handler & handler);
+
+    // acknowledgements to send back
+    std::string & Replies() { return replies; }
+
+    const std::string & LastError() const { return error; }
+
+private:
+    enum State {
+        KEY,
+        HEADERS,
+        BODY,
+    };
+
+    bool Fail(const std::string & msg);
+    bool Headers();
+    bool Body(const Handler & handler);
+    bool Records(const char * data, size_t len, size_t & used, const Handler & handler);
+    bool Lines(const char * data, size_t len, size_t & used, const Handler & handler);
+    bool Messages(const char * data, size_t len, size_t & used, const Handler & handler);
+
+    // a binary stream's path and fields, and with codings the values the
+    // records refer back to
+    struct Stream {
+        std::string path;
+        std::vector<uint8_t> types;
+        std::vector<uint8_t> subtypes;
+        std::vector<uint8_t> codings;
+        std::vector<std::vector<std::string>> slots;
+        std::vector<int64_t> times;
+    };
+
+    bool Schema(const char * msg, size_t size);
+    bool Codings(const char * msg, size_t size);
+    bool Resync(const char * msg, size_t size);
+    bool Expand(Stream & stream, const char * msg, size_t size);
+
+    std::string peer;
+    std::string key;
+    Sessions * sessions;
+
+    State state;
+    bool acks;
+    std::string session;
+    Decompressor * decompressor;
+
+    // data as read and, with compression, decompressed
+    Buffer raw;
+    Buffer buffer;
+
+    Format format;
+    std::string path;
+
+    // tsv header lines waiting for the path
+    std::vector<std::string> held;
+    std::unordered_map<uint32_t, Stream> streams;
+    std::string expanded;
+
+    std::string replies;
+    std::string error;
+};
+
+}
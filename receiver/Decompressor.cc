@@ -0,0 +1,167 @@
+// See the file "COPYING" for copyright.
+//
+// Streaming decompression of what a compressing TCP writer sends
+
+#include <cstring>
+
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "Decompressor.h"
+
+using namespace receiver;
+
+namespace {
+
+// size of the steps decompressed output grows in
+const size_t CHUNK_SIZE = 65536;
+
+class Gzip : public Decompressor {
+
+public:
+    Gzip() : initialized(false) {
+        memset(&stream, 0, sizeof(stream));
+
+        // gzip header and trailer around the deflate stream
+        initialized = inflateInit2(&stream, 15 + 16) == Z_OK;
+    }
+
+    ~Gzip() {
+        if (initialized)
+            inflateEnd(&stream);
+    }
+
+    bool Decompress(const char * data, size_t len, Buffer & out) {
+        if (!initialized) {
+            error = "Error initializing gzip";
+            return false;
+        }
+
+        stream.next_in = (Bytef *)data;
+        stream.avail_in = len;
+
+        do {
+            stream.next_out = (Bytef *)out.Space(CHUNK_SIZE);
+            stream.avail_out = CHUNK_SIZE;
+
+            int ret = inflate(&stream, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) {
+                error = std::string("Error decompressing gzip: ") + (stream.msg ? stream.msg : "invalid data");
+                return false;
+            }
+
+            out.Grow(CHUNK_SIZE - stream.avail_out);
+        } while (stream.avail_out == 0);
+
+        return true;
+    }
+
+private:
+    z_stream stream;
+    bool initialized;
+};
+
+#ifdef HAVE_ZSTD
+class Zstd : public Decompressor {
+
+public:
+    Zstd() : ctx(ZSTD_createDCtx()) {}
+
+    ~Zstd() {
+        ZSTD_freeDCtx(ctx);
+    }
+
+    bool Decompress(const char * data, size_t len, Buffer & out) {
+        ZSTD_inBuffer input = {data, len, 0};
+
+        for (;;) {
+            ZSTD_outBuffer output = {out.Space(CHUNK_SIZE), CHUNK_SIZE, 0};
+
+            size_t ret = ZSTD_decompressStream(ctx, &output, &input);
+            if (ZSTD_isError(ret)) {
+                error = std::string("Error decompressing zstd: ") + ZSTD_getErrorName(ret);
+                return false;
+            }
+
+            out.Grow(output.pos);
+
+            // done once the input is used up and the output did not fill
+            if (input.pos == input.size && output.pos < output.size)
+                return true;
+        }
+    }
+
+private:
+    ZSTD_DCtx * ctx;
+};
+#endif
+
+#ifdef HAVE_LZ4
+class Lz4 : public Decompressor {
+
+public:
+    Lz4() : ctx(nullptr) {
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+            ctx = nullptr;
+    }
+
+    ~Lz4() {
+        if (ctx != nullptr)
+            LZ4F_freeDecompressionContext(ctx);
+    }
+
+    bool Decompress(const char * data, size_t len, Buffer & out) {
+        if (ctx == nullptr) {
+            error = "Error initializing lz4";
+            return false;
+        }
+
+        for (;;) {
+            size_t dst_len = CHUNK_SIZE;
+            size_t src_len = len;
+
+            size_t ret = LZ4F_decompress(ctx, out.Space(CHUNK_SIZE), &dst_len, data, &src_len, nullptr);
+            if (LZ4F_isError(ret)) {
+                error = std::string("Error decompressing lz4: ") + LZ4F_getErrorName(ret);
+                return false;
+            }
+
+            out.Grow(dst_len);
+            data += src_len;
+            len -= src_len;
+
+            if (len == 0 && dst_len < CHUNK_SIZE)
+                return true;
+        }
+    }
+
+private:
+    LZ4F_dctx * ctx;
+};
+#endif
+
+}
+
+Decompressor * Decompressor::Create(const std::string & name) {
+    if (name == "gzip")
+        return new Gzip();
+
+#ifdef HAVE_ZSTD
+    if (name == "zstd")
+        return new Zstd();
+#endif
+
+#ifdef HAVE_LZ4
+    if (name == "lz4")
+        return new Lz4();
+#endif
+
+    return nullptr;
+}
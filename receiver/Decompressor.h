@@ -0,0 +1,31 @@
+// See the file "COPYING" for copyright.
+//
+// Streaming decompression of what a compressing TCP writer sends
+
+#pragma once
+
+#include <string>
+
+#include "Buffer.h"
+
+namespace receiver {
+
+class Decompressor {
+
+public:
+    // decompressor for a name from a "#compression" line, nullptr when the
+    // name is unknown or not built in
+    static Decompressor * Create(const std::string & name);
+
+    virtual ~Decompressor() {}
+
+    // append what len bytes of the stream decompress to
+    virtual bool Decompress(const char * data, size_t len, Buffer & out) = 0;
+
+    const std::string & LastError() const { return error; }
+
+protected:
+    std::string error;
+};
+
+}
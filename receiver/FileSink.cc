@@ -0,0 +1,95 @@
+// See the file "COPYING" for copyright.
+//
+// Handler writing received records to one file per log path
+
+#include <arpa/inet.h>
+
+#include "FileSink.h"
+
+using namespace receiver;
+
+FileSink::FileSink(const std::string & dir) : dir(dir) {}
+
+FileSink::~FileSink() {
+    for (auto & entry : files) {
+        if (entry.second->file)
+            fclose(entry.second->file);
+
+        delete entry.second;
+    }
+}
+
+FileSink::File * FileSink::Open(const std::string & name) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = files.find(name);
+    if (found != files.end())
+        return found->second;
+
+    File * file = new File;
+    file->file = fopen((dir + "/" + name).c_str(), "ab");
+
+    // a file that failed to open stays closed instead of being retried for
+    // every record
+    if (file->file) {
+        file->fresh = ftell(file->file) == 0;
+    }
+    else {
+        error = "cannot open " + dir + "/" + name;
+        file->fresh = false;
+    }
+
+    files[name] = file;
+
+    return file;
+}
+
+void FileSink::Write(const Record & record) {
+    // paths come from the writers, keep them from leaving dir
+    std::string name(record.path.empty() ? "unknown" : record.path);
+    for (char & c : name) {
+        if (c == '/')
+            c = '_';
+    }
+
+    if (name[0] == '.')
+        name[0] = '_';
+
+    name += record.format == BINARY ? ".bin" : ".log";
+
+    File * file = Open(name);
+    if (!file->file)
+        return;
+
+    std::lock_guard<std::mutex> guard(file->lock);
+
+    if (record.format == BINARY) {
+        uint32_t len = htonl(record.data.size());
+
+        fwrite(&len, sizeof(len), 1, file->file);
+        fwrite(record.data.data(), 1, record.data.size(), file->file);
+
+        return;
+    }
+
+    // every connection repeats the header, a file needs it once
+    if (record.header && !file->fresh)
+        return;
+
+    if (!record.header)
+        file->fresh = false;
+
+    fwrite(record.data.data(), 1, record.data.size(), file->file);
+    fputc('\n', file->file);
+}
+
+void FileSink::Flush() {
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (auto & entry : files) {
+        std::lock_guard<std::mutex> file_guard(entry.second->lock);
+
+        if (entry.second->file)
+            fflush(entry.second->file);
+    }
+}
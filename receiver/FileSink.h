@@ -0,0 +1,53 @@
+// See the file "COPYING" for copyright.
+//
+// Handler writing received records to one file per log path
+//
+// Json and tsv records go to <dir>/<path>.log one per line, binary
+// messages to <dir>/<path>.bin with their 32 bit length in front. Records
+// of streams that do not carry their path go to "unknown". Tsv headers are
+// only written to new files, binary schemas whenever they are received so
+// that records always follow the schema describing them.
+
+#pragma once
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "Decoder.h"
+
+namespace receiver {
+
+class FileSink {
+
+public:
+    FileSink(const std::string & dir);
+    ~FileSink();
+
+    // write a record, safe from any worker
+    void Write(const Record & record);
+
+    // write out what is buffered
+    void Flush();
+
+    const std::string & LastError() const { return error; }
+
+private:
+    struct File {
+        std::mutex lock;
+        FILE * file;
+        bool fresh;
+    };
+
+    File * Open(const std::string & name);
+
+    std::string dir;
+
+    std::mutex lock;
+    std::unordered_map<std::string, File *> files;
+
+    std::string error;
+};
+
+}
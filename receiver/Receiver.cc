@@ -0,0 +1,403 @@
+// See the file "COPYING" for copyright.
+//
+// Server receiving the log streams of TCP writers
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+
+#include "Receiver.h"
+
+using namespace receiver;
+
+struct Receiver::Connection {
+    int fd;
+    SSL * ssl;
+    bool accepted;
+    std::string peer;
+    Decoder * decoder;
+
+    // replies not sent yet
+    std::string out;
+
+    // events the connection waits for
+    uint32_t events;
+};
+
+static std::string SSLError() {
+    char buf[256];
+    unsigned long code = ERR_get_error();
+
+    if (code == 0)
+        return strerror(errno);
+
+    ERR_error_string_n(code, buf, sizeof(buf));
+    ERR_clear_error();
+
+    return buf;
+}
+
+Receiver::Receiver(const Options & options, const Handler & handler) : options(options), handler(handler), ctx(nullptr), listener(-1), next_worker(0), stopping(false) {}
+
+Receiver::~Receiver() {
+    Stop();
+    Shutdown();
+
+    if (listener >= 0)
+        close(listener);
+
+    if (ctx)
+        SSL_CTX_free(ctx);
+}
+
+bool Receiver::Fail(const std::string & msg) {
+    error = msg;
+    return false;
+}
+
+void Receiver::Report(Connection * conn, const std::string & msg) {
+    if (options.errors)
+        options.errors(conn->peer + ": " + msg);
+}
+
+bool Receiver::Start() {
+    if (!options.cert.empty()) {
+        ctx = SSL_CTX_new(TLS_server_method());
+        if (!ctx)
+            return Fail("cannot create tls context: " + SSLError());
+
+        if (SSL_CTX_use_certificate_chain_file(ctx, options.cert.c_str()) != 1)
+            return Fail("cannot load certificate " + options.cert + ": " + SSLError());
+
+        const std::string & private_key = options.private_key.empty() ? options.cert : options.private_key;
+        if (SSL_CTX_use_PrivateKey_file(ctx, private_key.c_str(), SSL_FILETYPE_PEM) != 1)
+            return Fail("cannot load private key " + private_key + ": " + SSLError());
+
+        // replies are written from a string that may grow between attempts
+        SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo * result;
+    std::string port = std::to_string(options.port);
+
+    int status = getaddrinfo(options.host.empty() ? nullptr : options.host.c_str(), port.c_str(), &hints, &result);
+    if (status != 0)
+        return Fail("cannot resolve " + options.host + ": " + gai_strerror(status));
+
+    for (struct addrinfo * addr = result; addr; addr = addr->ai_next) {
+        listener = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+        if (listener < 0)
+            continue;
+
+        int on = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        if (bind(listener, addr->ai_addr, addr->ai_addrlen) == 0 && listen(listener, SOMAXCONN) == 0)
+            break;
+
+        error = strerror(errno);
+
+        close(listener);
+        listener = -1;
+    }
+
+    freeaddrinfo(result);
+
+    if (listener < 0)
+        return Fail("cannot listen on port " + port + ": " + error);
+
+    int threads = options.threads > 0 ? options.threads : std::thread::hardware_concurrency();
+
+    for (int i = 0; i < std::max(threads, 1); i++) {
+        Worker * worker = new Worker;
+        workers.push_back(worker);
+
+        worker->epoll = epoll_create1(EPOLL_CLOEXEC);
+        worker->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        if (worker->epoll < 0 || worker->wake < 0)
+            return Fail(std::string("cannot create epoll instance: ") + strerror(errno));
+
+        // an event without a connection wakes the worker to stop
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        epoll_ctl(worker->epoll, EPOLL_CTL_ADD, worker->wake, &event);
+
+        worker->thread = std::thread(&Receiver::Work, this, worker);
+    }
+
+    return true;
+}
+
+void Receiver::Run() {
+    while (!stopping.load()) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+
+        int fd = accept4(listener, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                continue;
+
+            break;
+        }
+
+        char host[NI_MAXHOST];
+        char port[NI_MAXSERV];
+        if (getnameinfo((struct sockaddr *)&addr, addrlen, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+            strcpy(host, "?");
+            strcpy(port, "?");
+        }
+
+        Connection * conn = new Connection;
+        conn->fd = fd;
+        conn->ssl = nullptr;
+        conn->accepted = !ctx;
+        conn->peer = strchr(host, ':') ? std::string("[") + host + "]:" + port : std::string(host) + ":" + port;
+        conn->decoder = new Decoder(conn->peer, options.key, &sessions);
+        conn->events = EPOLLIN;
+
+        if (ctx) {
+            conn->ssl = SSL_new(ctx);
+            SSL_set_fd(conn->ssl, fd);
+        }
+
+        // connections are spread round robin and stay with their worker
+        Worker * worker = workers[next_worker++ % workers.size()];
+
+        std::lock_guard<std::mutex> guard(worker->lock);
+        worker->connections.insert(conn);
+
+        struct epoll_event event;
+        event.events = conn->events;
+        event.data.ptr = conn;
+        epoll_ctl(worker->epoll, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    Shutdown();
+}
+
+void Receiver::Stop() {
+    if (stopping.exchange(true))
+        return;
+
+    for (Worker * worker : workers) {
+        uint64_t one = 1;
+        if (write(worker->wake, &one, sizeof(one)) < 0)
+            continue;
+    }
+
+    // wakes up accept last, Run tears the workers down once it returns
+    if (listener >= 0)
+        shutdown(listener, SHUT_RDWR);
+}
+
+void Receiver::Shutdown() {
+    for (Worker * worker : workers) {
+        if (worker->thread.joinable())
+            worker->thread.join();
+
+        for (Connection * conn : worker->connections) {
+            if (conn->ssl)
+                SSL_free(conn->ssl);
+
+            close(conn->fd);
+            delete conn->decoder;
+            delete conn;
+        }
+
+        if (worker->epoll >= 0)
+            close(worker->epoll);
+
+        if (worker->wake >= 0)
+            close(worker->wake);
+
+        delete worker;
+    }
+
+    workers.clear();
+}
+
+void Receiver::Work(Worker * worker) {
+    struct epoll_event events[64];
+
+    while (!stopping.load()) {
+        int n = epoll_wait(worker->epoll, events, 64, -1);
+
+        for (int i = 0; i < n; i++) {
+            if (!events[i].data.ptr)
+                continue;
+
+            Handle(worker, (Connection *)events[i].data.ptr, events[i].events);
+        }
+    }
+}
+
+void Receiver::Handle(Worker * worker, Connection * conn, uint32_t events) {
+    bool ok = true;
+
+    if (!conn->accepted)
+        ok = Accept(conn);
+
+    // reading before looking at hangups gets the last records of a
+    // writer that closed its side
+    if (ok && conn->accepted && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        ok = Read(conn);
+
+    if (ok && conn->accepted)
+        ok = Write(conn);
+
+    if (!ok) {
+        Close(worker, conn);
+        return;
+    }
+
+    Watch(worker, conn);
+}
+
+bool Receiver::Accept(Connection * conn) {
+    int status = SSL_accept(conn->ssl);
+
+    if (status == 1) {
+        conn->accepted = true;
+        conn->events = EPOLLIN;
+
+        return true;
+    }
+
+    switch (SSL_get_error(conn->ssl, status)) {
+    case SSL_ERROR_WANT_READ:
+        conn->events = EPOLLIN;
+        return true;
+
+    case SSL_ERROR_WANT_WRITE:
+        conn->events = EPOLLOUT;
+        return true;
+
+    default:
+        Report(conn, "tls handshake failed: " + SSLError());
+        return false;
+    }
+}
+
+bool Receiver::Read(Connection * conn) {
+    while (true) {
+        char * room = conn->decoder->Prepare(65536);
+        ssize_t n;
+
+        if (conn->ssl) {
+            n = SSL_read(conn->ssl, room, 65536);
+
+            if (n <= 0) {
+                int reason = SSL_get_error(conn->ssl, n);
+
+                if (reason == SSL_ERROR_WANT_READ || reason == SSL_ERROR_WANT_WRITE)
+                    return true;
+
+                if (reason != SSL_ERROR_ZERO_RETURN && !(reason == SSL_ERROR_SYSCALL && ERR_peek_error() == 0 && errno == 0))
+                    Report(conn, "cannot read: " + SSLError());
+
+                return false;
+            }
+        }
+        else {
+            n = recv(conn->fd, room, 65536, 0);
+
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    return true;
+
+                Report(conn, std::string("cannot read: ") + strerror(errno));
+                return false;
+            }
+
+            if (n == 0)
+                return false;
+        }
+
+        if (!conn->decoder->Commit(n, handler)) {
+            Report(conn, conn->decoder->LastError());
+            return false;
+        }
+
+        conn->out += conn->decoder->Replies();
+        conn->decoder->Replies().clear();
+    }
+}
+
+bool Receiver::Write(Connection * conn) {
+    while (!conn->out.empty()) {
+        ssize_t n;
+
+        if (conn->ssl) {
+            n = SSL_write(conn->ssl, conn->out.data(), conn->out.size());
+
+            if (n <= 0) {
+                int reason = SSL_get_error(conn->ssl, n);
+
+                if (reason == SSL_ERROR_WANT_READ || reason == SSL_ERROR_WANT_WRITE)
+                    break;
+
+                Report(conn, "cannot send replies: " + SSLError());
+                return false;
+            }
+        }
+        else {
+            n = send(conn->fd, conn->out.data(), conn->out.size(), MSG_NOSIGNAL);
+
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    break;
+
+                Report(conn, std::string("cannot send replies: ") + strerror(errno));
+                return false;
+            }
+        }
+
+        conn->out.erase(0, n);
+    }
+
+    conn->events = conn->out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+
+    return true;
+}
+
+void Receiver::Watch(Worker * worker, Connection * conn) {
+    struct epoll_event event;
+    event.events = conn->events;
+    event.data.ptr = conn;
+    epoll_ctl(worker->epoll, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+void Receiver::Close(Worker * worker, Connection * conn) {
+    epoll_ctl(worker->epoll, EPOLL_CTL_DEL, conn->fd, nullptr);
+
+    if (conn->ssl) {
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+    }
+
+    close(conn->fd);
+    delete conn->decoder;
+
+    std::lock_guard<std::mutex> guard(worker->lock);
+    worker->connections.erase(conn);
+
+    delete conn;
+}
@@ -0,0 +1,99 @@
+// See the file "COPYING" for copyright.
+//
+// Server receiving the log streams of TCP writers
+//
+// Connections are accepted on the calling thread and spread over worker
+// threads, each waiting on its own epoll instance. Every connection stays
+// with one worker, which terminates tls, decodes the stream and calls the
+// handler for every record, so the handler has to be safe to call from
+// all workers at once. Replies over tls may raise SIGPIPE, which the
+// program should ignore.
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <openssl/ssl.h>
+
+#include "Decoder.h"
+
+namespace receiver {
+
+class Receiver {
+
+public:
+    struct Options {
+        std::string host;
+        int port;
+
+        // certificate chain and private key, tls is off without them
+        std::string cert;
+        std::string private_key;
+
+        // line writers send first, empty to accept writers without a key
+        std::string key;
+
+        int threads;
+
+        // called with the errors of connections, from the workers
+        std::function<void(const std::string &)> errors;
+    };
+
+    Receiver(const Options & options, const Handler & handler);
+    ~Receiver();
+
+    // listen and start the workers
+    bool Start();
+
+    // accept connections until stopped
+    void Run();
+
+    // stop accepting and close all connections, safe from any thread
+    void Stop();
+
+    const std::string & LastError() const { return error; }
+
+private:
+    struct Connection;
+
+    struct Worker {
+        int epoll;
+        int wake;
+        std::thread thread;
+
+        // connections owned by the worker
+        std::mutex lock;
+        std::unordered_set<Connection *> connections;
+    };
+
+    bool Fail(const std::string & msg);
+    void Report(Connection * conn, const std::string & msg);
+    void Shutdown();
+    void Work(Worker * worker);
+    void Handle(Worker * worker, Connection * conn, uint32_t events);
+    bool Accept(Connection * conn);
+    bool Read(Connection * conn);
+    bool Write(Connection * conn);
+    void Watch(Worker * worker, Connection * conn);
+    void Close(Worker * worker, Connection * conn);
+
+    Options options;
+    Handler handler;
+    Sessions sessions;
+
+    SSL_CTX * ctx;
+    int listener;
+    std::vector<Worker *> workers;
+    size_t next_worker;
+    std::atomic<bool> stopping;
+
+    std::string error;
+};
+
+}
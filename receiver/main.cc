@@ -0,0 +1,140 @@
+// See the file "COPYING" for copyright.
+//
+// tcpwriter-receiver, a collector for TCP writers
+//
+// Records are written to one file per log path with -o, otherwise they are
+// counted and the rate is printed every second.
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "FileSink.h"
+#include "Receiver.h"
+
+using namespace receiver;
+
+static void Usage() {
+    fprintf(stderr, "Usage: tcpwriter-receiver [-b host] [-p port] [-c cert] [-k private key] [-K key] [-t threads] [-o dir]\n");
+    fprintf(stderr, "  -b  address to listen on, all by default\n");
+    fprintf(stderr, "  -p  port to listen on, 1337 by default\n");
+    fprintf(stderr, "  -c  certificate chain, enabling tls\n");
+    fprintf(stderr, "  -k  private key for the certificate, when not in its file\n");
+    fprintf(stderr, "  -K  key writers send first\n");
+    fprintf(stderr, "  -t  worker threads, one per cpu by default\n");
+    fprintf(stderr, "  -o  directory to write a file per log path to\n");
+    exit(1);
+}
+
+int main(int argc, char ** argv) {
+    Receiver::Options options;
+    options.port = 1337;
+    options.threads = 0;
+
+    const char * dir = nullptr;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:p:c:k:K:t:o:")) != -1) {
+        switch (opt) {
+        case 'b':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = atoi(optarg);
+            break;
+        case 'c':
+            options.cert = optarg;
+            break;
+        case 'k':
+            options.private_key = optarg;
+            break;
+        case 'K':
+            options.key = optarg;
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'o':
+            dir = optarg;
+            break;
+        default:
+            Usage();
+        }
+    }
+
+    if (optind != argc)
+        Usage();
+
+    options.errors = [](const std::string & msg) {
+        fprintf(stderr, "%s\n", msg.c_str());
+    };
+
+    FileSink * sink = dir ? new FileSink(dir) : nullptr;
+    std::atomic<uint64_t> records(0);
+
+    Receiver receiver(options, [&](const Record & record) {
+        if (sink)
+            sink->Write(record);
+
+        if (!record.header)
+            records.fetch_add(1, std::memory_order_relaxed);
+    });
+
+    // signals are blocked before the workers start, so they inherit the
+    // mask and only the thread waiting for them below stops the receiver
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!receiver.Start()) {
+        fprintf(stderr, "%s\n", receiver.LastError().c_str());
+        return 1;
+    }
+
+    std::thread([&]() {
+        int received;
+        sigwait(&signals, &received);
+        receiver.Stop();
+    }).detach();
+
+    std::atomic<bool> running(true);
+
+    std::thread progress([&]() {
+        uint64_t last = 0;
+
+        while (running.load()) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+
+            if (sink) {
+                sink->Flush();
+                continue;
+            }
+
+            uint64_t now = records.load(std::memory_order_relaxed);
+            printf("%llu records/s, %llu total\n", (unsigned long long)(now - last), (unsigned long long)now);
+            fflush(stdout);
+
+            last = now;
+        }
+    });
+
+    receiver.Run();
+
+    running.store(false);
+    progress.join();
+
+    delete sink;
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+// See the file "COPYING" for copyright.
+//
+// Pinning the threads the TCP writers start to CPUs
+
+#include <cstdlib>
+
+#include <sched.h>
+
+#include "Affinity.h"
+
+using namespace logging;
+using namespace writer;
+
+bool Affinity::Parse(const std::string & list, std::vector<int> & cpus) {
+    cpus.clear();
+
+    size_t start = 0;
+
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+
+        std::string entry = list.substr(start, end - start);
+        size_t dash = entry.find('-');
+
+        char * rest;
+        long first = strtol(entry.c_str(), &rest, 10);
+        long last = first;
+
+        if (rest == entry.c_str() || (*rest != '\0' && *rest != '-'))
+            return false;
+
+        if (dash != std::string::npos) {
+            const char * from = entry.c_str() + dash + 1;
+            last = strtol(from, &rest, 10);
+
+            if (rest == from || *rest != '\0')
+                return false;
+        }
+
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+
+        for (long cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+
+        start = end + 1;
+    }
+
+    return !cpus.empty();
+}
+
+int Affinity::Set(pthread_t thread, const std::vector<int> & cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+
+    return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
@@ -0,0 +1,26 @@
+// See the file "COPYING" for copyright.
+//
+// Pinning the threads the TCP writers start to CPUs
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+namespace logging {
+namespace writer {
+
+class Affinity {
+
+public:
+    // parse a list of CPUs like "0,2-3" into cpus, false if malformed
+    static bool Parse(const std::string & list, std::vector<int> & cpus);
+
+    // restrict thread to the given CPUs, returning 0 or an errno value
+    static int Set(pthread_t thread, const std::vector<int> & cpus);
+};
+
+}
+}
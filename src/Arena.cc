@@ -0,0 +1,75 @@
+// See the file "COPYING" for copyright.
+//
+// Bump allocator for data living as long as a batch
+
+#include "Arena.h"
+
+using namespace logging;
+using namespace writer;
+
+Arena::Arena() : used(BLOCK_SIZE) {}
+
+Arena::~Arena() {
+    Reset();
+
+    for (char * block : free_blocks)
+        delete [] block;
+}
+
+void * Arena::Allocate(size_t len) {
+    // round up so every allocation stays aligned
+    len = (len + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+    if (len > BLOCK_SIZE) {
+        large.push_back(new char[len]);
+        return large.back();
+    }
+
+    // start a new block, reusing one from an earlier batch
+    if (used + len > BLOCK_SIZE) {
+        if (free_blocks.empty()) {
+            blocks.push_back(new char[BLOCK_SIZE]);
+        }
+        else {
+            blocks.push_back(free_blocks.back());
+            free_blocks.pop_back();
+        }
+
+        used = 0;
+    }
+
+    void * ptr = blocks.back() + used;
+    used += len;
+
+    return ptr;
+}
+
+void Arena::Reset() {
+    free_blocks.insert(free_blocks.end(), blocks.begin(), blocks.end());
+    blocks.clear();
+    used = BLOCK_SIZE;
+
+    for (char * block : large)
+        delete [] block;
+
+    large.clear();
+}
+
+void BufferPool::Take(std::string & data) {
+    if (!buffers.empty()) {
+        data.swap(buffers.back());
+        buffers.pop_back();
+    }
+
+    data.clear();
+}
+
+void BufferPool::Give(std::string & data) {
+    // beyond a few buffers are likely left from a burst
+    if (buffers.size() < MAX_BUFFERS) {
+        buffers.emplace_back();
+        buffers.back().swap(data);
+    }
+
+    data.clear();
+}
@@ -0,0 +1,63 @@
+// See the file "COPYING" for copyright.
+//
+// Bump allocator for data living as long as a batch
+//
+// Allocations are carved from fixed-size blocks and only freed all at once
+// by Reset, which keeps the blocks for the next batch, so a batch of the
+// same size as the one before allocates nothing from the heap. Batches
+// queued as strings get their buffers from a BufferPool for the same
+// reason.
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace logging {
+namespace writer {
+
+class Arena {
+
+public:
+    static const size_t BLOCK_SIZE = 65536;
+
+    Arena();
+    ~Arena();
+
+    // len bytes aligned for any type, valid until Reset
+    void * Allocate(size_t len);
+
+    // free everything allocated at once
+    void Reset();
+
+private:
+    Arena(const Arena &) = delete;
+    Arena & operator=(const Arena &) = delete;
+
+    std::vector<char *> blocks;
+    std::vector<char *> free_blocks;
+    size_t used;
+
+    // allocations too large for a block, freed on Reset
+    std::vector<char *> large;
+};
+
+// free list of string buffers that keep their capacity
+class BufferPool {
+
+public:
+    static const size_t MAX_BUFFERS = 16;
+
+    // swap an empty buffer from the pool into data
+    void Take(std::string & data);
+
+    // swap data into the pool, leaving data empty
+    void Give(std::string & data);
+
+private:
+    std::vector<std::string> buffers;
+};
+
+}
+}
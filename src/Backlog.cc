@@ -0,0 +1,120 @@
+// See the file "COPYING" for copyright.
+//
+// Bounded backlog of data the TCP writer could not send yet
+
+#include "Backlog.h"
+
+using namespace logging;
+using namespace writer;
+
+Backlog::Backlog() : claimed(false), offset(0), bytes(0), records(0), capacity(0) {}
+
+Backlog::~Backlog() {
+    for (Entry & entry : entries) {
+        if (entry.trace)
+            Tracer::Finish(entry.trace);
+    }
+}
+
+void Backlog::SetCapacity(size_t capacity) {
+    this->capacity = capacity;
+}
+
+bool Backlog::Fits(size_t len) const {
+    return bytes + len <= capacity;
+}
+
+void Backlog::Push(const char * data, size_t len, size_t records, bool started, Trace * trace) {
+    entries.push_back(Entry{std::string(), records, started, trace});
+
+    pool.Take(entries.back().data);
+    entries.back().data.assign(data, len);
+
+    bytes += len;
+    this->records += records;
+}
+
+bool Backlog::PopOldest(size_t & records) {
+    // never cut into an entry that is partway out the door
+    std::deque<Entry>::iterator it = entries.begin();
+    if (it != entries.end() && (offset > 0 || it->started || claimed))
+        ++it;
+
+    if (it == entries.end())
+        return false;
+
+    records = it->records;
+
+    bytes -= it == entries.begin() ? it->data.size() - offset : it->data.size();
+    this->records -= records;
+
+    Remove(it);
+
+    return true;
+}
+
+bool Backlog::Pop(std::string & data, size_t & records, Trace *& trace) {
+    if (entries.empty() || offset > 0 || entries.front().started || claimed)
+        return false;
+
+    data.swap(entries.front().data);
+    records = entries.front().records;
+    trace = entries.front().trace;
+    entries.front().trace = nullptr;
+
+    bytes -= data.size();
+    this->records -= records;
+
+    Remove(entries.begin());
+
+    return true;
+}
+
+size_t Backlog::DiscardPartial() {
+    if (entries.empty() || (offset == 0 && !entries.front().started))
+        return 0;
+
+    size_t dropped = entries.front().records;
+
+    bytes -= entries.front().data.size() - offset;
+    records -= dropped;
+
+    Remove(entries.begin());
+    offset = 0;
+
+    return dropped;
+}
+
+const char * Backlog::Front() const {
+    return entries.front().data.data() + offset;
+}
+
+size_t Backlog::FrontLen() const {
+    return entries.front().data.size() - offset;
+}
+
+void Backlog::Consume(size_t len) {
+    offset += len;
+    bytes -= len;
+
+    if (offset == entries.front().data.size()) {
+        records -= entries.front().records;
+
+        if (entries.front().trace)
+            entries.front().trace->written = Tracer::Now();
+
+        Remove(entries.begin());
+        offset = 0;
+        claimed = false;
+    }
+}
+
+void Backlog::Remove(std::deque<Entry>::iterator it) {
+    // the buffer goes to the next entry pushed, and a trace goes back
+    // unwritten unless it was sent
+    if (it->trace)
+        Tracer::Finish(it->trace);
+
+    pool.Give(it->data);
+    entries.erase(it);
+}
@@ -0,0 +1,74 @@
+// See the file "COPYING" for copyright.
+//
+// Bounded backlog of data the TCP writer could not send yet
+
+#pragma once
+
+#include <deque>
+#include <string>
+
+#include "Arena.h"
+#include "Tracer.h"
+
+namespace logging {
+namespace writer {
+
+class Backlog {
+
+public:
+    Backlog();
+    ~Backlog();
+
+    void SetCapacity(size_t capacity);
+    bool Fits(size_t len) const;
+
+    // queue data holding the given number of records, started marks
+    // data whose beginning has already been sent, and the trace of its
+    // batch, if any, is finished once it is out
+    void Push(const char * data, size_t len, size_t records, bool started = false, Trace * trace = nullptr);
+
+    // drop the oldest entry that has not started sending
+    bool PopOldest(size_t & records);
+
+    // take the front entry if none of it was sent, swapping its buffer
+    // with the one data had, along with its trace
+    bool Pop(std::string & data, size_t & records, Trace *& trace);
+
+    // drop the front entry if it was partially sent
+    size_t DiscardPartial();
+
+    // keep the front entry from being dropped or taken while all of it
+    // is with the compressor, until it is consumed or released again
+    void Claim() { claimed = true; }
+    void Release() { claimed = false; }
+
+    // unsent data of the front entry
+    const char * Front() const;
+    size_t FrontLen() const;
+    void Consume(size_t len);
+
+    bool Empty() const { return entries.empty(); }
+    size_t Size() const { return bytes; }
+    size_t Records() const { return records; }
+
+private:
+    struct Entry {
+        std::string data;
+        size_t records;
+        bool started;
+        Trace * trace;
+    };
+
+    void Remove(std::deque<Entry>::iterator it);
+
+    std::deque<Entry> entries;
+    BufferPool pool;
+    bool claimed;
+    size_t offset;
+    size_t bytes;
+    size_t records;
+    size_t capacity;
+};
+
+}
+}
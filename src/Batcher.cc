@@ -0,0 +1,66 @@
+// See the file "COPYING" for copyright.
+//
+// Adaptive batch sizes aiming at a target delivery latency
+
+#include <algorithm>
+#include <cmath>
+
+#include "Batcher.h"
+
+using namespace logging;
+using namespace writer;
+
+Batcher::Batcher() : target(0), max_records(0), limit(1), rate(0), send_time(0), record_size(0), last_time(0), last_written(0) {}
+
+void Batcher::SetTarget(double target, size_t max_records) {
+    this->target = target;
+    this->max_records = std::max(max_records, (size_t)1);
+
+    // start out sending every record until the rate is known
+    limit = 1;
+}
+
+void Batcher::Update(double now, uint64_t written) {
+    if (!Enabled())
+        return;
+
+    if (last_time == 0) {
+        last_time = now;
+        last_written = written;
+        return;
+    }
+
+    double elapsed = now - last_time;
+    if (elapsed < INTERVAL)
+        return;
+
+    // exponentially weighted by time, so estimates made at any spacing
+    // settle alike
+    double weight = 1 - exp(-elapsed / SMOOTHING);
+    rate += weight * ((written - last_written) / elapsed - rate);
+
+    last_time = now;
+    last_written = written;
+
+    // the time a batch may take to fill, with half of it as headroom
+    double fill = std::max(target - send_time, 0.0) / 2;
+    size_t wanted = std::max(std::min((size_t)(rate * fill), max_records), (size_t)1);
+
+    limit = wanted > limit ? std::min(wanted, 2 * limit) : wanted;
+}
+
+void Batcher::Sent(double now, uint64_t written, size_t records, size_t bytes, double age, double send) {
+    if (!Enabled() || records == 0)
+        return;
+
+    // keep the slowest sends in view, they are what breaks the target
+    send_time = send > send_time ? send : send_time + 0.1 * (send - send_time);
+
+    double size = (double)bytes / records;
+    record_size = record_size == 0 ? size : record_size + (size - record_size) / 8;
+
+    Update(now, written);
+
+    if (age + send > target)
+        limit = std::max(limit / 2, (size_t)1);
+}
@@ -0,0 +1,66 @@
+// See the file "COPYING" for copyright.
+//
+// Adaptive batch sizes aiming at a target delivery latency
+//
+// A record waits for its batch to fill and then for the batch to be sent.
+// The batcher estimates the rate records arrive at and the time a send
+// takes, and sizes batches to fill within half of what the target leaves
+// once sending is accounted for. A batch that still goes out late halves
+// the size right away, while growth is limited to doubling per estimate
+// so a short burst is not taken for the new rate.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace logging {
+namespace writer {
+
+class Batcher {
+
+public:
+    // largest batch without a bound of its own
+    static const size_t MAX_RECORDS = 65536;
+
+    Batcher();
+
+    // aim for records to be sent within target seconds of being written,
+    // in batches of at most max_records, 0 to not adapt
+    void SetTarget(double target, size_t max_records);
+
+    bool Enabled() const { return target > 0; }
+    double Target() const { return target; }
+
+    // records a batch should hold before it is sent
+    size_t Records() const { return limit; }
+
+    // average formatted size of a record
+    size_t RecordSize() const { return record_size; }
+
+    // update the rate estimate with the records written so far
+    void Update(double now, uint64_t written);
+
+    // a batch of records taking bytes went out send seconds after it was
+    // started, with its first record written age seconds before that
+    void Sent(double now, uint64_t written, size_t records, size_t bytes, double age, double send);
+
+private:
+    // spacing of rate estimates, and how long one takes to settle
+    static constexpr double INTERVAL = 0.1;
+    static constexpr double SMOOTHING = 1.0;
+
+    double target;
+    size_t max_records;
+    size_t limit;
+
+    double rate;
+    double send_time;
+    double record_size;
+
+    double last_time;
+    uint64_t last_written;
+};
+
+}
+}
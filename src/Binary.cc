@@ -0,0 +1,404 @@
+// See the file "COPYING" for copyright.
+//
+// Compact binary encoding of log records, with the schema sent once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+#include <arpa/inet.h>
+
+#include "Binary.h"
+
+using namespace logging;
+using namespace writer;
+
+Binary::Binary() : dictionary_size(0), reset(true), continued(false), tracking(false) {
+    static std::atomic<uint32_t> next_stream(0);
+    stream = next_stream++;
+}
+
+Binary::Binary(uint32_t stream) : stream(stream), dictionary_size(0), reset(true), continued(false), tracking(false) {}
+
+void Binary::SetCodings(const std::vector<Coding> & codings, size_t dictionary_size) {
+    this->codings.clear();
+    this->dictionary_size = dictionary_size;
+
+    // with all fields plain, records are sent as before
+    if (std::any_of(codings.begin(), codings.end(), [](Coding coding) { return coding != PLAIN; }))
+        this->codings = codings;
+
+    dictionaries.resize(this->codings.size());
+    last_times.resize(this->codings.size());
+
+    continued = false;
+    tracking = false;
+    changes.clear();
+    saved.clear();
+
+    Reset();
+}
+
+void Binary::Reset() {
+    // the batch that carried on last may still be sent again, so what it
+    // started from is kept aside
+    if (tracking) {
+        saved.swap(dictionaries);
+        dictionaries.resize(saved.size());
+        tracking = false;
+    }
+
+    for (Dictionary & dictionary : dictionaries) {
+        dictionary.slots.clear();
+        dictionary.values.clear();
+        dictionary.order.clear();
+        dictionary.positions.clear();
+    }
+
+    std::fill(last_times.begin(), last_times.end(), 0);
+    reset = true;
+}
+
+void Binary::Continue() {
+    // everything before is through, so only this batch's changes matter
+    continued = true;
+    tracking = true;
+    changes.clear();
+    saved.clear();
+    start_times = last_times;
+}
+
+void Binary::State(ODesc * desc) {
+    if (!continued)
+        return;
+
+    // the slots now, or as reset left them, with the changes since the
+    // batch started undone
+    const std::vector<Dictionary> & current = tracking ? dictionaries : saved;
+    std::vector<std::vector<std::string>> values(current.size());
+
+    for (size_t i = 0; i < current.size(); i++)
+        values[i] = current[i].values;
+
+    for (std::vector<Change>::reverse_iterator it = changes.rbegin(); it != changes.rend(); ++it) {
+        if (it->defined)
+            values[it->field][it->slot] = it->value;
+        else
+            values[it->field].resize(it->slot);
+    }
+
+    Begin(STATE);
+
+    U32(stream);
+
+    for (size_t i = 0; i < codings.size(); i++) {
+        if (codings[i] == DICTIONARY) {
+            Varint(values[i].size());
+
+            for (const std::string & value : values[i]) {
+                Varint(value.size());
+                message.append(value);
+            }
+        }
+        else if (codings[i] == DELTA) {
+            U64((uint64_t)start_times[i]);
+        }
+    }
+
+    End(desc);
+}
+
+bool Binary::Continues(const char * data, size_t len) {
+    // length, type, stream and the flags of the first record
+    return len >= 10 && data[4] == ENCODED && !(data[9] & RESET);
+}
+
+Binary::Type Binary::WireType(TypeTag tag) {
+    switch (tag) {
+    case TYPE_BOOL:
+        return BOOL;
+    case TYPE_INT:
+        return INT;
+    case TYPE_COUNT:
+    case TYPE_COUNTER:
+        return COUNT;
+    case TYPE_DOUBLE:
+        return DOUBLE;
+    case TYPE_TIME:
+        return TIME;
+    case TYPE_INTERVAL:
+        return INTERVAL;
+    case TYPE_PORT:
+        return PORT;
+    case TYPE_ADDR:
+        return ADDR;
+    case TYPE_SUBNET:
+        return SUBNET;
+    case TYPE_STRING:
+    case TYPE_FILE:
+    case TYPE_FUNC:
+        return STRING;
+    case TYPE_ENUM:
+        return ENUM;
+    case TYPE_PATTERN:
+        return PATTERN;
+    case TYPE_TABLE:
+        return SET;
+    case TYPE_VECTOR:
+        return VECTOR;
+    case TYPE_VOID:
+        return NONE;
+    default:
+        return OTHER;
+    }
+}
+
+void Binary::Begin(Message type) {
+    message.clear();
+    U8(type);
+}
+
+void Binary::End(ODesc * desc) {
+    uint32_t len = htonl(message.size());
+
+    desc->AddRaw((const char *)&len, sizeof(len));
+    desc->AddRaw(message.data(), message.size());
+}
+
+void Binary::U8(uint8_t val) {
+    message.push_back((char)val);
+}
+
+void Binary::U16(uint16_t val) {
+    val = htons(val);
+    message.append((const char *)&val, sizeof(val));
+}
+
+void Binary::U32(uint32_t val) {
+    val = htonl(val);
+    message.append((const char *)&val, sizeof(val));
+}
+
+void Binary::U64(uint64_t val) {
+    U32(val >> 32);
+    U32(val & 0xffffffff);
+}
+
+void Binary::Varint(uint64_t val) {
+    while (val >= 0x80) {
+        message.push_back((char)(val | 0x80));
+        val >>= 7;
+    }
+
+    message.push_back((char)val);
+}
+
+void Binary::String(const char * data, size_t len) {
+    U32(len);
+    message.append(data, len);
+}
+
+void Binary::Addr(const threading::Value::addr_t & addr) {
+    if (addr.family == IPv4) {
+        U8(4);
+        message.append((const char *)&addr.in.in4, sizeof(addr.in.in4));
+    }
+    else {
+        U8(6);
+        message.append((const char *)&addr.in.in6, sizeof(addr.in.in6));
+    }
+}
+
+void Binary::Encode(const threading::Value * val) {
+    U8(val->present);
+
+    if (!val->present)
+        return;
+
+    switch (val->type) {
+    case TYPE_BOOL:
+        U8(val->val.int_val != 0);
+        break;
+
+    case TYPE_INT:
+        U64((uint64_t)val->val.int_val);
+        break;
+
+    case TYPE_COUNT:
+    case TYPE_COUNTER:
+        U64(val->val.uint_val);
+        break;
+
+    case TYPE_DOUBLE:
+    case TYPE_TIME:
+    case TYPE_INTERVAL: {
+        uint64_t bits;
+        memcpy(&bits, &val->val.double_val, sizeof(bits));
+        U64(bits);
+        break;
+    }
+
+    case TYPE_PORT:
+        U64(val->val.port_val.port);
+        U8(val->val.port_val.proto);
+        break;
+
+    case TYPE_ADDR:
+        Addr(val->val.addr_val);
+        break;
+
+    case TYPE_SUBNET:
+        Addr(val->val.subnet_val.prefix);
+        U8(val->val.subnet_val.length);
+        break;
+
+    case TYPE_STRING:
+    case TYPE_ENUM:
+    case TYPE_FILE:
+    case TYPE_FUNC:
+        String(val->val.string_val.data, val->val.string_val.length);
+        break;
+
+    case TYPE_PATTERN:
+        String(val->val.pattern_text_val, strlen(val->val.pattern_text_val));
+        break;
+
+    case TYPE_TABLE:
+        U32(val->val.set_val.size);
+        for (bro_int_t i = 0; i < val->val.set_val.size; i++)
+            Encode(val->val.set_val.vals[i]);
+        break;
+
+    case TYPE_VECTOR:
+        U32(val->val.vector_val.size);
+        for (bro_int_t i = 0; i < val->val.vector_val.size; i++)
+            Encode(val->val.vector_val.vals[i]);
+        break;
+
+    default:
+        // nothing the log framework hands to writers, sent as empty
+        String("", 0);
+        break;
+    }
+}
+
+void Binary::Lookup(size_t field, const char * data, size_t len) {
+    Dictionary & dictionary = dictionaries[field];
+    key.assign(data, len);
+
+    std::unordered_map<std::string, uint32_t>::const_iterator it = dictionary.slots.find(key);
+    if (it != dictionary.slots.end()) {
+        // a value sent before, now the most recently used
+        dictionary.order.splice(dictionary.order.end(), dictionary.order, dictionary.positions[it->second]);
+        Varint(it->second + 1);
+        return;
+    }
+
+    uint32_t slot;
+
+    if (dictionary.values.size() < dictionary_size) {
+        slot = dictionary.values.size();
+        dictionary.values.push_back(key);
+
+        if (tracking)
+            changes.push_back(Change{field, slot, false, std::string()});
+        dictionary.positions.push_back(dictionary.order.insert(dictionary.order.end(), slot));
+    }
+    else {
+        // redefine the least recently used slot
+        slot = dictionary.order.front();
+        dictionary.slots.erase(dictionary.values[slot]);
+
+        if (tracking)
+            changes.push_back(Change{field, slot, true, std::move(dictionary.values[slot])});
+
+        dictionary.values[slot] = key;
+        dictionary.order.splice(dictionary.order.end(), dictionary.order, dictionary.order.begin());
+    }
+
+    dictionary.slots.emplace(key, slot);
+
+    Varint(0);
+    Varint(slot);
+    Varint(len);
+    message.append(data, len);
+}
+
+void Binary::Delta(int64_t & last, double val) {
+    int64_t usecs = llround(val * 1e6);
+    int64_t delta = usecs - last;
+    last = usecs;
+
+    // zigzag, so small steps back take few bytes too
+    Varint(((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+}
+
+void Binary::Schema(ODesc * desc, const std::string & path, int num_fields, const threading::Field * const * fields) {
+    Begin(SCHEMA);
+
+    U8(VERSION);
+    U32(stream);
+    String(path.data(), path.size());
+    U16(num_fields);
+
+    for (int i = 0; i < num_fields; i++) {
+        String(fields[i]->name, strlen(fields[i]->name));
+        U8(WireType(fields[i]->type));
+        U8(WireType(fields[i]->subtype));
+        U8(fields[i]->optional);
+    }
+
+    End(desc);
+
+    if (!Stateful())
+        return;
+
+    Begin(CODINGS);
+
+    U32(stream);
+    U16(num_fields);
+
+    for (int i = 0; i < num_fields; i++)
+        U8(codings[i]);
+
+    End(desc);
+}
+
+void Binary::Record(ODesc * desc, int num_fields, threading::Value ** vals) {
+    if (!Stateful()) {
+        Begin(RECORD);
+
+        U32(stream);
+
+        for (int i = 0; i < num_fields; i++)
+            Encode(vals[i]);
+
+        End(desc);
+        return;
+    }
+
+    Begin(ENCODED);
+
+    U32(stream);
+    U8(reset ? RESET : 0);
+    reset = false;
+
+    for (int i = 0; i < num_fields; i++) {
+        const threading::Value * val = vals[i];
+
+        if (codings[i] == PLAIN || !val->present) {
+            Encode(val);
+            continue;
+        }
+
+        U8(1);
+
+        if (codings[i] == DICTIONARY)
+            Lookup(i, val->val.string_val.data, val->val.string_val.length);
+        else
+            Delta(last_times[i], val->val.double_val);
+    }
+
+    End(desc);
+}
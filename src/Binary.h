@@ -0,0 +1,211 @@
+// See the file "COPYING" for copyright.
+//
+// Compact binary encoding of log records, with the schema sent once
+//
+// Every message is a 32 bit length followed by that many bytes, starting
+// with a message type. Integers are big endian and strings are a 32 bit
+// length followed by their bytes.
+//
+//   schema  'S', u8 version, u32 stream, string path, u16 fields, and per
+//           field string name, u8 type, u8 subtype, u8 optional
+//   record  'R', u32 stream, and per field u8 present followed by the value
+//           when present
+//
+// Values are encoded by their type:
+//
+//   bool                        u8
+//   int                         i64
+//   count, counter              u64
+//   double, time, interval      ieee 754 double as u64
+//   port                        u64 port, u8 protocol
+//   addr                        u8 4 or 6, 4 or 16 address bytes
+//   subnet                      addr, u8 prefix length
+//   string, enum, pattern, ...  string
+//   set, vector                 u32 elements, and per element u8 present
+//                               followed by the value of the subtype
+//
+// Streams tell the records of writers sharing a connection apart.
+//
+// Top level fields can be coded to take less room, in which case the
+// schema is followed by
+//
+//   codings 'C', u32 stream, u16 fields, and per field u8 coding
+//
+// and records are sent as
+//
+//   encoded 'E', u32 stream, u8 flags, and per field u8 present followed
+//           by the value, in its coding when present
+//
+// with varints of 7 bits per byte, least significant first. Dictionary
+// coded strings and enums are a varint reference, slot + 1 for a value
+// defined before, or 0 followed by varint slot, varint length and the
+// bytes of a new value for that slot. Delta coded times are a zigzag
+// varint of microseconds since the field's value in the record before.
+//
+// A RESET flag starts slots and deltas over. Values stay in at most
+// dictionary size slots per field, the least recently used being
+// redefined once all are taken.
+//
+// Slots and deltas carry on from one batch to the next while the batch
+// before is sure to reach the receiver first over the same connection.
+// Otherwise a batch starts with RESET, and when records that carried on
+// have to be sent again, on a new connection or from the spool, they are
+// preceded by
+//
+//   state   'D', u32 stream, and per coded field, a dictionary's varint
+//           slots and per slot varint length and bytes, or a delta's
+//           i64 microseconds
+//
+// with the slots and deltas as they were before those records.
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "threading/SerialTypes.h"
+#include "Desc.h"
+
+namespace logging {
+namespace writer {
+
+class Binary {
+
+public:
+    static const uint8_t VERSION = 1;
+
+    enum Message : uint8_t {
+        SCHEMA = 'S',
+        RECORD = 'R',
+        CODINGS = 'C',
+        ENCODED = 'E',
+        STATE = 'D',
+    };
+
+    enum Coding : uint8_t {
+        PLAIN = 0,
+        DICTIONARY = 1,
+        DELTA = 2,
+    };
+
+    // flags of encoded records
+    static const uint8_t RESET = 1;
+
+    enum Type : uint8_t {
+        NONE = 0,
+        BOOL = 1,
+        INT = 2,
+        COUNT = 3,
+        DOUBLE = 4,
+        TIME = 5,
+        INTERVAL = 6,
+        PORT = 7,
+        ADDR = 8,
+        SUBNET = 9,
+        STRING = 10,
+        ENUM = 11,
+        PATTERN = 12,
+        SET = 13,
+        VECTOR = 14,
+        OTHER = 15,
+    };
+
+    // encoder for a new stream, numbered uniquely within the process
+    Binary();
+
+    // encoder for more records of a stream, as formatter threads need
+    explicit Binary(uint32_t stream);
+
+    uint32_t Stream() const { return stream; }
+
+    // code the fields as given, one coding per field, with at most
+    // dictionary_size values per dictionary coded field
+    void SetCodings(const std::vector<Coding> & codings, size_t dictionary_size);
+
+    // whether records refer back to earlier ones
+    bool Stateful() const { return !codings.empty(); }
+
+    // start slots and deltas over for a new batch
+    void Reset();
+
+    // carry slots and deltas over into a new batch, remembering them as
+    // they are for State
+    void Continue();
+
+    // append a state message with the slots and deltas as they were at
+    // the start of the last batch that carried on, nothing if none did
+    void State(ODesc * desc);
+
+    // whether an encoded batch relies on the batches before it
+    static bool Continues(const char * data, size_t len);
+
+    // append the schema message for the given fields, and their codings
+    // when there are any
+    void Schema(ODesc * desc, const std::string & path, int num_fields, const threading::Field * const * fields);
+
+    // append a record message with the values in schema order, encoded
+    // when fields are coded
+    void Record(ODesc * desc, int num_fields, threading::Value ** vals);
+
+private:
+    // values of a dictionary coded field by slot, and the slots from least
+    // to most recently used
+    struct Dictionary {
+        std::unordered_map<std::string, uint32_t> slots;
+        std::vector<std::string> values;
+        std::list<uint32_t> order;
+        std::vector<std::list<uint32_t>::iterator> positions;
+    };
+
+    // a slot as it was before a batch that carried on, for State to roll
+    // back to
+    struct Change {
+        size_t field;
+        uint32_t slot;
+        bool defined;
+        std::string value;
+    };
+
+    static Type WireType(TypeTag tag);
+
+    void Begin(Message message);
+    void End(ODesc * desc);
+
+    void U8(uint8_t val);
+    void U16(uint16_t val);
+    void U32(uint32_t val);
+    void U64(uint64_t val);
+    void Varint(uint64_t val);
+    void String(const char * data, size_t len);
+    void Addr(const threading::Value::addr_t & addr);
+    void Encode(const threading::Value * val);
+    void Lookup(size_t field, const char * data, size_t len);
+    void Delta(int64_t & last, double val);
+
+    uint32_t stream;
+
+    // empty unless fields are coded
+    std::vector<Coding> codings;
+    size_t dictionary_size;
+    std::vector<Dictionary> dictionaries;
+    std::vector<int64_t> last_times;
+    bool reset;
+    std::string key;
+
+    // since the last batch that carried on, its changes and times, and
+    // the dictionaries it left once reset
+    bool continued;
+    bool tracking;
+    std::vector<Change> changes;
+    std::vector<int64_t> start_times;
+    std::vector<Dictionary> saved;
+
+    // message being built, the length goes in front once it is known
+    std::string message;
+};
+
+}
+}
@@ -0,0 +1,96 @@
+// See the file "COPYING" for copyright.
+//
+// Chain of fixed-size chunks holding a batch of formatted records
+
+#include <algorithm>
+#include <cstring>
+
+#include "Chunks.h"
+
+using namespace logging;
+using namespace writer;
+
+Chunks::Chunks() : size(0) {}
+
+Chunks::~Chunks() {
+    for (char * chunk : chunks)
+        delete [] chunk;
+
+    for (char * chunk : free_chunks)
+        delete [] chunk;
+}
+
+void Chunks::Append(const char * data, size_t len) {
+    while (len > 0) {
+        size_t used = size % CHUNK_SIZE;
+
+        // start a new chunk, reusing one from an earlier batch
+        if (used == 0 && size / CHUNK_SIZE == chunks.size()) {
+            if (free_chunks.empty()) {
+                chunks.push_back(new char[CHUNK_SIZE]);
+            }
+            else {
+                chunks.push_back(free_chunks.back());
+                free_chunks.pop_back();
+            }
+        }
+
+        size_t n = std::min(len, CHUNK_SIZE - used);
+        memcpy(chunks.back() + used, data, n);
+
+        data += n;
+        len -= n;
+        size += n;
+    }
+}
+
+void Chunks::Clear() {
+    free_chunks.insert(free_chunks.end(), chunks.begin(), chunks.end());
+    chunks.clear();
+    size = 0;
+}
+
+void Chunks::Swap(Chunks & other) {
+    chunks.swap(other.chunks);
+    free_chunks.swap(other.free_chunks);
+    std::swap(size, other.size);
+}
+
+int Chunks::Vectors(size_t offset, struct iovec * iov, int max) const {
+    return Vectors(offset, size - std::min(offset, size), iov, max);
+}
+
+int Chunks::Vectors(size_t offset, size_t len, struct iovec * iov, int max) const {
+    int count = 0;
+    size_t end = std::min(offset + len, size);
+
+    while (offset < end && count < max) {
+        size_t used = offset % CHUNK_SIZE;
+        size_t n = std::min(CHUNK_SIZE - used, end - offset);
+
+        iov[count].iov_base = chunks[offset / CHUNK_SIZE] + used;
+        iov[count].iov_len = n;
+        count++;
+
+        offset += n;
+    }
+
+    return count;
+}
+
+void Chunks::Copy(size_t offset, size_t len, std::string & out) const {
+    out.clear();
+    out.reserve(len);
+
+    len = std::min(len, size - std::min(offset, size));
+
+    while (len > 0) {
+        size_t used = offset % CHUNK_SIZE;
+        size_t n = std::min(CHUNK_SIZE - used, len);
+
+        out.append(chunks[offset / CHUNK_SIZE] + used, n);
+
+        offset += n;
+        len -= n;
+    }
+}
@@ -0,0 +1,55 @@
+// See the file "COPYING" for copyright.
+//
+// Chain of fixed-size chunks holding a batch of formatted records
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <sys/uio.h>
+
+namespace logging {
+namespace writer {
+
+class Chunks {
+
+public:
+    // the payload of a full tls record
+    static const size_t CHUNK_SIZE = 16384;
+
+    Chunks();
+    ~Chunks();
+
+    void Append(const char * data, size_t len);
+
+    size_t Size() const { return size; }
+    bool Empty() const { return size == 0; }
+
+    // return all chunks to the free list for the next batch
+    void Clear();
+
+    // exchange contents, free lists included, with another chain
+    void Swap(Chunks & other);
+
+    // fill at most max iovecs with the data from offset on, returning the
+    // number used
+    int Vectors(size_t offset, struct iovec * iov, int max) const;
+
+    // the same for at most len bytes from offset on
+    int Vectors(size_t offset, size_t len, struct iovec * iov, int max) const;
+
+    // copy len bytes from offset on into out, replacing its contents
+    void Copy(size_t offset, size_t len, std::string & out) const;
+
+private:
+    Chunks(const Chunks &) = delete;
+    Chunks & operator=(const Chunks &) = delete;
+
+    std::vector<char *> chunks;
+    std::vector<char *> free_chunks;
+    size_t size;
+};
+
+}
+}
@@ -0,0 +1,292 @@
+// See the file "COPYING" for copyright.
+//
+// Streaming compression of the data sent over a connection
+
+#include <cstring>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "Compressor.h"
+
+using namespace logging;
+using namespace writer;
+
+namespace {
+
+// size of the steps compressed output grows in
+const size_t CHUNK_SIZE = 16384;
+
+class Gzip : public Compressor {
+
+public:
+    Gzip(int level) : Compressor("gzip", level), initialized(false) {
+        memset(&stream, 0, sizeof(stream));
+    }
+
+    ~Gzip() {
+        if (initialized)
+            deflateEnd(&stream);
+    }
+
+    bool Reset() {
+        if (initialized)
+            return deflateReset(&stream) == Z_OK;
+
+        // window bits above 15 ask for a gzip header and trailer
+        if (deflateInit2(&stream, level < 0 ? Z_DEFAULT_COMPRESSION : level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            error = std::string("Error initializing gzip: ") + (stream.msg ? stream.msg : "unknown error");
+            return false;
+        }
+
+        initialized = true;
+
+        return true;
+    }
+
+    bool Compress(const char * data, size_t len, std::string & out) {
+        stream.next_in = (Bytef *)data;
+        stream.avail_in = len;
+
+        // a sync flush ends on a byte boundary the receiver can decode up to
+        do {
+            size_t used = out.size();
+            out.resize(used + CHUNK_SIZE);
+
+            stream.next_out = (Bytef *)&out[used];
+            stream.avail_out = CHUNK_SIZE;
+
+            int ret = deflate(&stream, Z_SYNC_FLUSH);
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                error = std::string("Error compressing with gzip: ") + (stream.msg ? stream.msg : "unknown error");
+                return false;
+            }
+
+            out.resize(used + CHUNK_SIZE - stream.avail_out);
+        } while (stream.avail_out == 0);
+
+        return true;
+    }
+
+private:
+    z_stream stream;
+    bool initialized;
+};
+
+#ifdef HAVE_ZSTD
+class Zstd : public Compressor {
+
+public:
+    Zstd(int level) : Compressor("zstd", level), ctx(ZSTD_createCCtx()) {}
+
+    ~Zstd() {
+        ZSTD_freeCCtx(ctx);
+    }
+
+    bool Reset() {
+        if (!ctx) {
+            error = "Error initializing zstd: out of memory";
+            return false;
+        }
+
+        ZSTD_CCtx_reset(ctx, ZSTD_reset_session_only);
+
+        size_t ret = ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+        if (ZSTD_isError(ret)) {
+            error = std::string("Error initializing zstd: ") + ZSTD_getErrorName(ret);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool Compress(const char * data, size_t len, std::string & out) {
+        ZSTD_inBuffer input = {data, len, 0};
+        size_t remaining;
+
+        // a flush ends the current block so the receiver can decode it
+        do {
+            size_t used = out.size();
+            out.resize(used + CHUNK_SIZE);
+
+            ZSTD_outBuffer output = {&out[used], CHUNK_SIZE, 0};
+
+            remaining = ZSTD_compressStream2(ctx, &output, &input, ZSTD_e_flush);
+            if (ZSTD_isError(remaining)) {
+                error = std::string("Error compressing with zstd: ") + ZSTD_getErrorName(remaining);
+                return false;
+            }
+
+            out.resize(used + output.pos);
+        } while (remaining > 0);
+
+        return true;
+    }
+
+private:
+    ZSTD_CCtx * ctx;
+};
+#endif
+
+#ifdef HAVE_LZ4
+class Lz4 : public Compressor {
+
+public:
+    Lz4(int level) : Compressor("lz4", level), ctx(nullptr), started(false) {
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = level < 0 ? 0 : level;
+    }
+
+    ~Lz4() {
+        if (ctx)
+            LZ4F_freeCompressionContext(ctx);
+    }
+
+    bool Reset() {
+        if (!ctx) {
+            LZ4F_errorCode_t ret = LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
+            if (LZ4F_isError(ret)) {
+                error = std::string("Error initializing lz4: ") + LZ4F_getErrorName(ret);
+                return false;
+            }
+        }
+
+        // the frame header goes out with the first data
+        started = false;
+
+        return true;
+    }
+
+    bool Compress(const char * data, size_t len, std::string & out) {
+        size_t used = out.size();
+        size_t bound = LZ4F_compressBound(len, &prefs) + LZ4F_compressBound(0, &prefs) + LZ4F_HEADER_SIZE_MAX;
+        size_t ret;
+
+        out.resize(used + bound);
+
+        char * dst = &out[used];
+        char * end = dst + bound;
+
+        if (!started) {
+            ret = LZ4F_compressBegin(ctx, dst, end - dst, &prefs);
+            if (LZ4F_isError(ret))
+                return Fail(out, used, ret);
+
+            dst += ret;
+            started = true;
+        }
+
+        ret = LZ4F_compressUpdate(ctx, dst, end - dst, data, len, nullptr);
+        if (LZ4F_isError(ret))
+            return Fail(out, used, ret);
+
+        dst += ret;
+
+        // close the current block so the receiver can decode it
+        ret = LZ4F_flush(ctx, dst, end - dst, nullptr);
+        if (LZ4F_isError(ret))
+            return Fail(out, used, ret);
+
+        dst += ret;
+
+        out.resize(dst - out.data());
+
+        return true;
+    }
+
+private:
+    bool Fail(std::string & out, size_t used, size_t ret) {
+        out.resize(used);
+        error = std::string("Error compressing with lz4: ") + LZ4F_getErrorName(ret);
+        return false;
+    }
+
+    LZ4F_cctx * ctx;
+    LZ4F_preferences_t prefs;
+    bool started;
+};
+#endif
+
+}
+
+bool Compressor::Parse(const std::string & spec, std::string & name, int & level, std::string & error) {
+    size_t colon = spec.find(':');
+
+    name = spec.substr(0, colon);
+    level = -1;
+
+    if (colon != std::string::npos) {
+        try {
+            level = stoi(spec.substr(colon + 1));
+        }
+        catch (const std::exception &) {
+            error = "Invalid compression level: " + spec.substr(colon + 1);
+            return false;
+        }
+    }
+
+    if (name.empty() || name == "none") {
+        name.clear();
+        return true;
+    }
+
+    if (name == "gzip") {
+        if (level > 9) {
+            error = "Invalid compression level for gzip: " + std::to_string(level);
+            return false;
+        }
+
+        return true;
+    }
+
+    if (name == "zstd") {
+#ifdef HAVE_ZSTD
+        if (level > ZSTD_maxCLevel()) {
+            error = "Invalid compression level for zstd: " + std::to_string(level);
+            return false;
+        }
+
+        return true;
+#else
+        error = "Compression not available in this build: zstd";
+        return false;
+#endif
+    }
+
+    if (name == "lz4") {
+#ifdef HAVE_LZ4
+        return true;
+#else
+        error = "Compression not available in this build: lz4";
+        return false;
+#endif
+    }
+
+    error = "Unknown compression: " + name;
+    return false;
+}
+
+Compressor * Compressor::Create(const std::string & name, int level) {
+    if (name == "gzip")
+        return new Gzip(level);
+
+#ifdef HAVE_ZSTD
+    if (name == "zstd")
+        return new Zstd(level);
+#endif
+
+#ifdef HAVE_LZ4
+    if (name == "lz4")
+        return new Lz4(level);
+#endif
+
+    return nullptr;
+}
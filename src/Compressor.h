@@ -0,0 +1,43 @@
+// See the file "COPYING" for copyright.
+//
+// Streaming compression of the data sent over a connection
+
+#pragma once
+
+#include <string>
+
+namespace logging {
+namespace writer {
+
+class Compressor {
+
+public:
+    virtual ~Compressor() {}
+
+    // split a "name" or "name:level" setting, with an empty name or "none"
+    // disabling compression and level -1 using the algorithm's default
+    static bool Parse(const std::string & spec, std::string & name, int & level, std::string & error);
+
+    // compressor for a parsed setting, nullptr when disabled
+    static Compressor * Create(const std::string & name, int level);
+
+    // start a new stream, done for every new connection
+    virtual bool Reset() = 0;
+
+    // append data compressed to out, flushed so the receiver can decode
+    // everything up to here without waiting for more
+    virtual bool Compress(const char * data, size_t len, std::string & out) = 0;
+
+    const std::string & Name() const { return name; }
+    const std::string & LastError() const { return error; }
+
+protected:
+    Compressor(const std::string & name, int level) : name(name), level(level) {}
+
+    std::string name;
+    int level;
+    std::string error;
+};
+
+}
+}
@@ -0,0 +1,1199 @@
+// See the file "COPYING" for copyright.
+//
+// TCP and TLS connection used by the TCP writer
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <string>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <netdb.h>
+
+#include "Connection.h"
+#include "TLSContext.h"
+
+using namespace logging;
+using namespace writer;
+
+static double Now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// bound on the tls handshake and the first lines when the connect
+// timeout sets none, so a peer that never answers cannot keep the
+// connection pending or a blocking write stuck forever
+static const double HANDSHAKE_TIMEOUT = 30;
+
+static std::string AddrString(const struct sockaddr_storage & addr) {
+    char addrstr[INET6_ADDRSTRLEN];
+    inet_ntop(addr.ss_family, addr.ss_family == AF_INET ? (const void *)&(((const struct sockaddr_in *)&addr)->sin_addr) : (const void *)&(((const struct sockaddr_in6 *)&addr)->sin6_addr), addrstr, sizeof(addrstr));
+    return addrstr;
+}
+
+Connection::Connection(const Options & options) : options(options), sock(-1), ctx(nullptr), ssl(nullptr), session(nullptr), handshake(false), handshaking(false), resumed(false), offloaded(false), wait_events(POLLOUT), nodelay(false), unreachable(false), tuned(false), ring(nullptr), compressor(Compressor::Create(options.compression, options.compression_level)), compressed_offset(0), oversized(0), addr_index(0), resolved(0), connecting(false), deadline(0), next_attempt(0), failures(0), connects(0), jitter(std::random_device()()) {}
+
+Connection::~Connection() {
+    Close();
+
+    if (session != nullptr)
+        SSL_SESSION_free(session);
+
+    if (ctx != nullptr)
+        TLSContext::Release(ctx);
+
+    delete compressor;
+}
+
+int Connection::NewSession(SSL * ssl, SSL_SESSION * session) {
+    Connection * conn = (Connection *)SSL_get_app_data(ssl);
+    if (conn == nullptr)
+        return 0;
+
+    // keep the newest session for the next reconnect
+    if (conn->session != nullptr)
+        SSL_SESSION_free(conn->session);
+
+    conn->session = session;
+
+    return 1;
+}
+
+bool Connection::Fail(const char * format, ...) {
+    // record the error and release whatever was set up
+    char msg[1024];
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(msg, sizeof(msg), format, args);
+    va_end(args);
+
+    error = msg;
+
+    Close();
+    return false;
+}
+
+void Connection::Warn(const char * format, ...) {
+    // socket options are checked on the first socket only, the kernel
+    // treats the later ones alike
+    if (tuned)
+        return;
+
+    char msg[1024];
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(msg, sizeof(msg), format, args);
+    va_end(args);
+
+    warnings.push_back(msg);
+}
+
+std::vector<std::string> Connection::TakeWarnings() {
+    std::vector<std::string> taken;
+    taken.swap(warnings);
+
+    return taken;
+}
+
+void Connection::Tune() {
+    if (options.send_buffer > 0) {
+        int size = std::min(options.send_buffer, (size_t)INT_MAX / 2);
+        int got = 0;
+        socklen_t len = sizeof(got);
+
+        // linux doubles the size asked for to leave room for bookkeeping
+        if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0)
+            Warn("Error setting send buffer of %s: %s", Name().c_str(), strerror(errno));
+        else if (getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &got, &len) == 0 && got / 2 < size)
+            Warn("Send buffer of %s clamped to %d bytes by the kernel instead of %d (see net.core.wmem_max)", Name().c_str(), got / 2, size);
+    }
+
+    // the socket is made by the thread that sends on it, also for shared
+    // connections
+    if (options.io_uring && !options.nonblocking && options.transport != TRANSPORT_UDP && ring == nullptr) {
+        std::string reason;
+
+        ring = Uring::ForThread(reason);
+        if (ring == nullptr)
+            Warn("Sending to %s without io_uring: %s", Name().c_str(), reason.c_str());
+    }
+
+    if (options.transport != TRANSPORT_TCP) {
+        tuned = true;
+        return;
+    }
+
+    int on = 1;
+
+    if (nodelay || options.nagle == NAGLE_OFF)
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    if (options.keepalive > 0) {
+        // a dead peer is noticed after three unanswered probes
+        int interval = std::max((int)std::min(ceil(options.keepalive), (double)INT_MAX), 1);
+        int probes = 3;
+
+        if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0 || setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &interval, sizeof(interval)) < 0 || setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0 || setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes)) < 0)
+            Warn("Error setting keepalive of %d seconds on %s: %s", interval, Name().c_str(), strerror(errno));
+    }
+
+    if (options.user_timeout > 0) {
+        unsigned int timeout = std::min(options.user_timeout * 1000, (double)UINT_MAX);
+        unsigned int got = 0;
+        socklen_t len = sizeof(got);
+
+        if (setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout)) < 0)
+            Warn("Error setting user timeout on %s: %s", Name().c_str(), strerror(errno));
+        else if (getsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &got, &len) == 0 && got != timeout)
+            Warn("User timeout of %s set to %u ms by the kernel instead of %u", Name().c_str(), got, timeout);
+    }
+
+    if (!options.congestion_control.empty()) {
+        // names are at most 16 bytes, as TCP_CA_NAME_MAX in linux/tcp.h
+        char got[16] = "";
+        socklen_t len = sizeof(got);
+
+        if (setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, options.congestion_control.data(), options.congestion_control.size()) < 0)
+            Warn("Congestion control %s unavailable for %s: %s (see net.ipv4.tcp_allowed_congestion_control)", options.congestion_control.c_str(), Name().c_str(), strerror(errno));
+        else if (getsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, got, &len) == 0 && options.congestion_control != std::string(got, strnlen(got, len)))
+            Warn("Congestion control of %s is %s instead of %s", Name().c_str(), got, options.congestion_control.c_str());
+    }
+
+    tuned = true;
+}
+
+void Connection::Push() {
+    // uncorking sends the partial segment ending a batch right away
+    if (options.nagle != NAGLE_CORK || options.transport != TRANSPORT_TCP || sock < 0)
+        return;
+
+    int off = 0;
+    int on = 1;
+
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+bool Connection::Resolve() {
+    // reuse addresses until they get too old
+    if (!addrs.empty() && Now() - resolved < options.dns_ttl)
+        return true;
+
+    if (options.transport == TRANSPORT_UNIX || options.transport == TRANSPORT_SEQPACKET) {
+        // the host is the path of the socket
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+
+        if (options.host.size() >= sizeof(addr.sun_path)) {
+            unreachable = true;
+            return Fail("Socket path too long: %s", options.host.c_str());
+        }
+
+        memcpy(addr.sun_path, options.host.c_str(), options.host.size());
+
+        struct sockaddr_storage storage;
+        memcpy(&storage, &addr, sizeof(addr));
+
+        addrs.assign(1, storage);
+        addr_lens.assign(1, sizeof(addr));
+        resolved = Now();
+
+        return true;
+    }
+
+    // getaddrinfo can block for seconds, so it runs on a thread of its
+    // own and FinishConnect picks up the addresses
+    lookup = std::make_shared<Lookup>();
+    lookup->done = false;
+    lookup->ret = 0;
+
+    try {
+        std::thread(&Connection::RunLookup, lookup, options.host, std::to_string(options.tcpport), options.transport == TRANSPORT_UDP ? SOCK_DGRAM : SOCK_STREAM).detach();
+    }
+    catch (const std::exception & e) {
+        lookup.reset();
+        return Fail("Error starting lookup of %s: %s", options.host.c_str(), e.what());
+    }
+
+    return true;
+}
+
+void Connection::RunLookup(std::shared_ptr<Lookup> lookup, std::string host, std::string port, int socktype) {
+    // get address info
+    struct addrinfo * addr;
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+
+    hints.ai_socktype = socktype;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &addr);
+
+    std::lock_guard<std::mutex> guard(lookup->lock);
+
+    if (ret == 0) {
+        for (struct addrinfo * it = addr; it != nullptr; it = it->ai_next) {
+            struct sockaddr_storage storage;
+            memcpy(&storage, it->ai_addr, it->ai_addrlen);
+
+            lookup->addrs.push_back(storage);
+            lookup->addr_lens.push_back(it->ai_addrlen);
+        }
+
+        // clean up
+        freeaddrinfo(addr);
+    }
+
+    lookup->ret = ret;
+    lookup->done = true;
+    lookup->finished.notify_one();
+}
+
+bool Connection::FinishResolve(int timeout) {
+    // returns true once the addresses are in, false when failed or still
+    // resolving
+    std::unique_lock<std::mutex> guard(lookup->lock);
+
+    if (!lookup->finished.wait_for(guard, std::chrono::milliseconds(timeout), [this]() { return lookup->done; })) {
+        if (deadline == 0 || Now() < deadline)
+            return false;
+
+        guard.unlock();
+
+        unreachable = true;
+        return Fail("Timed out resolving %s", options.host.c_str());
+    }
+
+    int ret = lookup->ret;
+
+    addrs.swap(lookup->addrs);
+    addr_lens.swap(lookup->addr_lens);
+
+    guard.unlock();
+    lookup.reset();
+
+    if (ret != 0) {
+        unreachable = true;
+        return Fail("Error resolving %s: %s", options.host.c_str(), gai_strerror(ret));
+    }
+
+    resolved = Now();
+
+    return true;
+}
+
+void Connection::SetOptions(const Options & options) {
+    // another collector has addresses and tls sessions of its own
+    if (options.host != this->options.host || options.tcpport != this->options.tcpport) {
+        addrs.clear();
+        addr_lens.clear();
+        addr_index = 0;
+
+        if (session != nullptr) {
+            SSL_SESSION_free(session);
+            session = nullptr;
+        }
+    }
+
+    this->options = options;
+
+    // socket options are checked again on the next socket
+    tuned = false;
+    failures = 0;
+    next_attempt = 0;
+}
+
+std::string Connection::Name() const {
+    switch (options.transport) {
+    case TRANSPORT_UNIX:
+    case TRANSPORT_SEQPACKET:
+        return options.host;
+
+    case TRANSPORT_UDP:
+        return options.host + ":" + std::to_string(options.tcpport) + "/udp";
+
+    default:
+        return options.host + ":" + std::to_string(options.tcpport);
+    }
+}
+
+bool Connection::StartConnect() {
+    // drop a connect that was still in progress
+    Close();
+
+    unreachable = false;
+
+    if (!Resolve())
+        return false;
+
+    addr_index = 0;
+
+    if (lookup) {
+        // connecting starts once the addresses are in
+        connecting = true;
+        deadline = options.connect_timeout > 0 ? Now() + options.connect_timeout : 0;
+
+        return true;
+    }
+
+    return ConnectAddress(0);
+}
+
+bool Connection::ConnectAddress(int err) {
+    // start connecting to the next address that does not fail right away
+    for (; addr_index < addrs.size(); addr_index++) {
+        const struct sockaddr_storage & addr = addrs[addr_index];
+
+        int type = options.transport == TRANSPORT_UDP ? SOCK_DGRAM : options.transport == TRANSPORT_SEQPACKET ? SOCK_SEQPACKET : SOCK_STREAM;
+
+        sock = socket(addr.ss_family, type, 0);
+        if (sock < 0)
+            return Fail("Error opening socket: %s", strerror(errno));
+
+        Tune();
+
+        // connect in the background so it can be bounded by the timeout
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+        int ret = connect(sock, (const struct sockaddr *)&addr, addr_lens[addr_index]);
+        if (ret == 0 || errno == EINPROGRESS) {
+            connecting = true;
+            deadline = options.connect_timeout > 0 ? Now() + options.connect_timeout : 0;
+
+            return true;
+        }
+
+        err = errno;
+
+        close(sock);
+        sock = -1;
+    }
+
+    std::string addrstr = addrs.empty() || addrs.back().ss_family == AF_UNIX ? options.host : AddrString(addrs.back());
+
+    // look the name up again next time
+    addrs.clear();
+
+    unreachable = true;
+    return Fail("Error connecting to %s: %s", addrstr.c_str(), strerror(err));
+}
+
+void Connection::SetNoDelay(bool enabled) {
+    if (enabled == nodelay || options.nagle != NAGLE_AUTO)
+        return;
+
+    nodelay = enabled;
+
+    if (sock >= 0 && options.transport == TRANSPORT_TCP) {
+        int on = enabled;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+}
+
+bool Connection::FinishConnect(int timeout) {
+    // returns true once connected, false when failed or still connecting
+    if (lookup) {
+        if (FinishResolve(timeout))
+            ConnectAddress(0);
+
+        return false;
+    }
+
+    if (handshaking)
+        return Handshake(timeout);
+
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLOUT;
+
+    int ret;
+
+    do {
+        ret = poll(&pfd, 1, timeout);
+    } while (ret < 0 && errno == EINTR);
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (ret == 0) {
+        if (deadline == 0 || Now() < deadline)
+            return false;
+
+        err = ETIMEDOUT;
+    }
+    else if (ret < 0) {
+        err = errno;
+    }
+    else {
+        getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+    }
+
+    if (err != 0) {
+        close(sock);
+        sock = -1;
+        connecting = false;
+
+        // move on to the next address, failing once none are left
+        addr_index++;
+        ConnectAddress(err);
+
+        return false;
+    }
+
+    if (options.tls) {
+        // the handshake stays non-blocking and gets a deadline of its own
+        if (!SetupTLS())
+            return false;
+
+        handshaking = true;
+        deadline = Now() + (options.connect_timeout > 0 ? options.connect_timeout : HANDSHAKE_TIMEOUT);
+
+        return Handshake(0);
+    }
+
+    return Introduce();
+}
+
+bool Connection::Handshake(int timeout) {
+    // returns true once connected, false when failed or still negotiating
+    while (true) {
+        ERR_clear_error();
+        errno = 0;
+
+        int ret = SSL_connect(ssl);
+        if (ret == 1)
+            break;
+
+        struct pollfd pfd;
+        pfd.fd = sock;
+
+        switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            pfd.events = POLLIN;
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            pfd.events = POLLOUT;
+            break;
+        case SSL_ERROR_SYSCALL:
+            if (errno != 0)
+                return Fail("Error completing TLS handshake: %s", strerror(errno));
+
+            return Fail("Error completing TLS handshake: %s", TLSContext::LastError());
+        default:
+            return Fail("Error completing TLS handshake: %s", TLSContext::LastError());
+        }
+
+        double left = deadline - Now();
+        if (left <= 0) {
+            unreachable = true;
+            return Fail("Timed out completing TLS handshake with %s", Name().c_str());
+        }
+
+        int wait = std::min(timeout, (int)ceil(left * 1000));
+
+        do {
+            ret = poll(&pfd, 1, wait);
+        } while (ret < 0 && errno == EINTR);
+
+        // not ready yet, the next call goes on from here
+        if (ret == 0)
+            return false;
+
+        if (ret < 0)
+            return Fail("Error waiting for TLS handshake: %s", strerror(errno));
+    }
+
+    handshaking = false;
+    handshake = true;
+    resumed = SSL_session_reused(ssl);
+
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+    offloaded = BIO_get_ktls_send(SSL_get_wbio(ssl));
+#endif
+
+    // get peer certificate
+    X509 * peer = SSL_get_peer_certificate(ssl);
+    if (peer == nullptr)
+        return Fail("Error getting TLS certificate");
+
+    // clean up
+    X509_free(peer);
+
+    // verify peer certificate
+    long lret = SSL_get_verify_result(ssl);
+    if (lret != X509_V_OK)
+        return Fail("Error verifying TLS certificate: %s", X509_verify_cert_error_string(lret));
+
+    // let tls return short writes and retry them from a moving buffer
+    SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // return from reads after handling session tickets
+    SSL_clear_mode(ssl, SSL_MODE_AUTO_RETRY);
+
+    return Introduce();
+}
+
+bool Connection::Introduce() {
+    connecting = false;
+
+    // back to blocking for the first lines, bounded by the timeout since
+    // a zero timeout would let a peer that stops reading block forever
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+
+    double timeout = options.connect_timeout > 0 ? options.connect_timeout : HANDSHAKE_TIMEOUT;
+
+    struct timeval tv;
+    tv.tv_sec = (time_t)timeout;
+    tv.tv_usec = (suseconds_t)((timeout - tv.tv_sec) * 1000000);
+
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (!SendHeader())
+        return false;
+
+    // the key line and preamble are out, hold everything else back until
+    // the end of a batch
+    if (options.transport == TRANSPORT_TCP && options.nagle == NAGLE_CORK) {
+        int on = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+
+    // no timeouts on the established connection
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (options.nonblocking) {
+        // switch to non-blocking sends once connected
+        if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0)
+            return Fail("Error setting socket non-blocking: %s", strerror(errno));
+    }
+
+    connects++;
+
+    return true;
+}
+
+bool Connection::Connect() {
+    if (!StartConnect()) {
+        Backoff();
+        return false;
+    }
+
+    while (connecting) {
+        if (FinishConnect(1000))
+            break;
+    }
+
+    if (!Connected()) {
+        Backoff();
+        return false;
+    }
+
+    failures = 0;
+
+    return true;
+}
+
+Connection::State Connection::Reconnect() {
+    if (Connected())
+        return CONNECTED;
+
+    if (!connecting) {
+        if (Now() < next_attempt)
+            return PENDING;
+
+        if (!StartConnect()) {
+            Backoff();
+            return FAILED;
+        }
+    }
+
+    if (!FinishConnect(0)) {
+        if (connecting)
+            return PENDING;
+
+        Backoff();
+        return FAILED;
+    }
+
+    failures = 0;
+
+    return CONNECTED;
+}
+
+void Connection::Backoff() {
+    // exponential delay with jitter so writers do not reconnect in lockstep
+    double delay = options.reconnect_min * (1 << std::min(failures, 20));
+    if (delay > options.reconnect_max)
+        delay = options.reconnect_max;
+
+    delay *= std::uniform_real_distribution<double>(0.5, 1.0)(jitter);
+
+    next_attempt = Now() + delay;
+    failures++;
+}
+
+bool Connection::SetupTLS() {
+    int ret;
+
+    // contexts are shared and kept across reconnects
+    if (ctx == nullptr) {
+        ctx = TLSContext::Acquire(options.cert, error);
+        if (ctx == nullptr) {
+            Close();
+            return false;
+        }
+    }
+
+    // setup tls connection
+    ssl = SSL_new(ctx);
+    if (ssl == nullptr)
+        return Fail("Error setting up TLS structure: %s", TLSContext::LastError());
+
+    // set tls hostname
+    ret = SSL_set_tlsext_host_name(ssl, options.host.c_str());
+    if (ret != 1)
+        return Fail("Error setting TLS hostname: %s", TLSContext::LastError());
+
+    // set underlying file descriptor
+    ret = SSL_set_fd(ssl, sock);
+    if (ret != 1)
+        return Fail("Error setting TLS descriptor: %s", TLSContext::LastError());
+
+    // offer the last session for an abbreviated handshake
+    SSL_set_app_data(ssl, this);
+    if (session != nullptr)
+        SSL_set_session(ssl, session);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    // openssl moves the keys to the kernel once negotiated, falling
+    // back to encrypting itself when the cipher or kernel lack support
+    if (options.ktls)
+        SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
+
+    return true;
+}
+
+bool Connection::SendHeader() {
+    if (!options.key.empty()) {
+        // write key line
+        std::string line = options.key + "\n";
+
+        if (!WriteAll(line.c_str(), line.size())) {
+            // clean up
+            Close();
+            return false;
+        }
+    }
+
+    if (!options.ack_session.empty()) {
+        // batches are framed from here on and acknowledged by the receiver
+        std::string line = "#acks " + options.ack_session + "\n";
+
+        if (!WriteAll(line.c_str(), line.size())) {
+            // clean up
+            Close();
+            return false;
+        }
+    }
+
+    if (compressor != nullptr) {
+        // every connection starts a new compressed stream, announced by
+        // a header line so the receiver can detect it
+        if (!compressor->Reset())
+            return Fail("%s", compressor->LastError().c_str());
+
+        std::string line = "#compression " + compressor->Name() + "\n";
+
+        if (!WriteAll(line.c_str(), line.size())) {
+            // clean up
+            Close();
+            return false;
+        }
+    }
+
+    if (!options.preamble.empty()) {
+        std::string preamble = options.preamble;
+        size_t offset = 0;
+
+        if (!options.ack_session.empty())
+            preamble.insert(0, "#batch 0 0 " + std::to_string(preamble.size()) + "\n");
+
+        if (!SendAll(preamble.data(), preamble.size(), offset)) {
+            // clean up
+            Close();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Connection::Close() {
+    // unread data such as tls session tickets makes the close a reset,
+    // which can discard what the peer has not read yet
+    if (handshake)
+        ReadPending();
+
+    if (ssl != nullptr) {
+        // stop tls
+        if (handshake)
+            SSL_shutdown(ssl);
+
+        SSL_free(ssl);
+        ssl = nullptr;
+    }
+
+    if (sock >= 0) {
+        // close socket
+        close(sock);
+        sock = -1;
+    }
+
+    offloaded = false;
+
+    // compressed data belongs to the stream of the closed connection
+    compressed.clear();
+    compressed_offset = 0;
+
+    handshake = false;
+    handshaking = false;
+    connecting = false;
+
+    // a lookup still running finishes on its own
+    lookup.reset();
+}
+
+ssize_t Connection::Send(const char * msg, size_t len) {
+    if (compressor == nullptr) {
+        ssize_t ret = Write(msg, len);
+        if (ret == (ssize_t)len)
+            Push();
+
+        return ret;
+    }
+
+    // the previous batch has to be out before taking the next
+    if (Flush() < 0)
+        return -1;
+
+    if (Pending())
+        return 0;
+
+    compressed.clear();
+    compressed_offset = 0;
+
+    if (!compressor->Compress(msg, len, compressed)) {
+        error = compressor->LastError();
+        return -1;
+    }
+
+    // what the socket does not take now is written by later calls
+    if (Flush() < 0)
+        return -1;
+
+    return len;
+}
+
+ssize_t Connection::Send(const Chunks & chunks, size_t offset) {
+    if (compressor != nullptr) {
+        // the compressor takes the rest of the batch at once
+        std::string batch;
+        chunks.Copy(offset, chunks.Size() - offset, batch);
+
+        return Send(batch.data(), batch.size());
+    }
+
+    struct iovec iov[64];
+
+    if (options.tls && !offloaded) {
+        // chunks are as big as a tls record allows
+        if (chunks.Vectors(offset, iov, 1) == 0)
+            return 0;
+
+        ssize_t ret = Write((const char *)iov[0].iov_base, iov[0].iov_len);
+        if (ret > 0 && offset + ret == chunks.Size())
+            Push();
+
+        return ret;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = chunks.Vectors(offset, iov, sizeof(iov) / sizeof(iov[0]));
+
+    ssize_t ret = -1;
+    bool sent = false;
+
+    if (ring != nullptr && !ring->Broken()) {
+        ret = ring->Send(sock, iov, msg.msg_iovlen);
+        sent = ret >= 0 || !ring->Broken();
+    }
+
+    // a ring that failed has nothing in flight once Send returns, so what
+    // it did not send goes out with plain sends from here on
+    if (ring != nullptr && ring->Broken()) {
+        Warn("Sending to %s without io_uring, which failed", Name().c_str());
+        ring = nullptr;
+    }
+
+    if (!sent) {
+        do {
+            ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (ret < 0 && errno == EINTR);
+    }
+
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            wait_events = POLLOUT;
+            return 0;
+        }
+
+        error = std::string("Error sending data: ") + strerror(errno);
+        return -1;
+    }
+
+    if (offset + ret == chunks.Size())
+        Push();
+
+    return ret;
+}
+
+ssize_t Connection::Flush() {
+    ssize_t written = 0;
+
+    while (Pending()) {
+        ssize_t ret = Write(compressed.data() + compressed_offset, compressed.size() - compressed_offset);
+        if (ret < 0)
+            return -1;
+
+        if (ret == 0)
+            break;
+
+        compressed_offset += ret;
+        written += ret;
+    }
+
+    if (written > 0 && !Pending())
+        Push();
+
+    return written;
+}
+
+ssize_t Connection::Write(const char * msg, size_t len) {
+    // with the kernel encrypting, data goes to the socket as it is
+    if (options.tls && !offloaded) {
+        ERR_clear_error();
+
+        int ret = SSL_write(ssl, msg, len);
+        if (ret <= 0) {
+            switch (SSL_get_error(ssl, ret)) {
+            case SSL_ERROR_WANT_WRITE:
+                wait_events = POLLOUT;
+                return 0;
+            case SSL_ERROR_WANT_READ:
+                // renegotiation needs to read before writing again
+                wait_events = POLLIN;
+                return 0;
+            case SSL_ERROR_SYSCALL:
+                if (errno == EINTR) {
+                    wait_events = POLLOUT;
+                    return 0;
+                }
+
+                error = std::string("Error sending TLS data: ") + strerror(errno);
+                return -1;
+            default:
+                error = std::string("Error sending TLS data: ") + TLSContext::LastError();
+                return -1;
+            }
+        }
+
+        return ret;
+    }
+    else {
+        ssize_t ret;
+
+        if (ring != nullptr) {
+            struct iovec iov = {(void *)msg, len};
+            ret = ring->Send(sock, &iov, 1);
+        }
+        else {
+            do {
+                ret = send(sock, msg, len, MSG_NOSIGNAL);
+            } while (ret < 0 && errno == EINTR);
+        }
+
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                wait_events = POLLOUT;
+                return 0;
+            }
+
+            error = std::string("Error sending data: ") + strerror(errno);
+            return -1;
+        }
+
+        return ret;
+    }
+}
+
+bool Connection::Wait(int timeout) {
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = wait_events;
+
+    int ret;
+
+    do {
+        ret = poll(&pfd, 1, timeout);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret > 0;
+}
+
+bool Connection::WaitReadable(int timeout) {
+    // data already decrypted is not seen by poll
+    if (options.tls && ssl != nullptr && SSL_pending(ssl) > 0)
+        return true;
+
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+
+    int ret;
+
+    do {
+        ret = poll(&pfd, 1, timeout);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret > 0;
+}
+
+bool Connection::ReadPending(std::string * received) {
+    // only acknowledgements are expected from the peer, but tls 1.3
+    // delivers session tickets after the handshake and closes show up as
+    // readable
+    char buf[4096];
+
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+
+    while (poll(&pfd, 1, 0) > 0 || (options.tls && SSL_pending(ssl) > 0)) {
+        if (options.tls) {
+            ERR_clear_error();
+
+            int ret = SSL_read(ssl, buf, sizeof(buf));
+            if (ret <= 0) {
+                int err = SSL_get_error(ssl, ret);
+
+                // a handled session ticket, more may follow
+                if (err == SSL_ERROR_WANT_READ)
+                    continue;
+
+                if (err == SSL_ERROR_WANT_WRITE)
+                    return true;
+
+                error = std::string("Error reading TLS data: ") + (err == SSL_ERROR_ZERO_RETURN ? "connection closed" : TLSContext::LastError());
+                return false;
+            }
+
+            if (received != nullptr)
+                received->append(buf, ret);
+        }
+        else {
+            ssize_t ret = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                return true;
+
+            // without a connection there is nothing to close, and refused
+            // datagrams are lost like any other
+            if (options.transport == TRANSPORT_UDP && (ret == 0 || errno == ECONNREFUSED))
+                continue;
+
+            if (ret <= 0) {
+                error = std::string("Error reading data: ") + (ret == 0 ? "connection closed" : strerror(errno));
+                return false;
+            }
+
+            if (received != nullptr)
+                received->append(buf, ret);
+        }
+    }
+
+    return true;
+}
+
+ssize_t Connection::SendRecords(const Chunks & chunks, const std::vector<size_t> & record_ends, size_t offset) {
+    // a datagram is at most 64k, spanning at most 6 chunks
+    static const size_t MAX_DATAGRAM = 65507;
+    static const int DATAGRAMS = 64;
+    static const int VECTORS = 8;
+
+    struct mmsghdr msgs[DATAGRAMS];
+    struct iovec iov[DATAGRAMS * VECTORS];
+    size_t ends[DATAGRAMS];
+    int count = 0;
+
+    size_t size = chunks.Size();
+    size_t start = offset;
+    size_t next = std::upper_bound(record_ends.begin(), record_ends.end(), offset) - record_ends.begin();
+
+    memset(msgs, 0, sizeof(msgs));
+
+    while (start < size && count < DATAGRAMS) {
+        // pack whole records up to the datagram size
+        size_t end = start;
+
+        while (next < record_ends.size() && (end == start || record_ends[next] - start <= options.datagram_size))
+            end = record_ends[next++];
+
+        if (end == start)
+            end = size;
+
+        // the kernel takes no datagram above 64k, so such a record is
+        // skipped once what is packed before it is out
+        if (end - start > MAX_DATAGRAM) {
+            if (count > 0)
+                break;
+
+            oversized++;
+            return end - offset;
+        }
+
+        msgs[count].msg_hdr.msg_iov = iov + count * VECTORS;
+        msgs[count].msg_hdr.msg_iovlen = chunks.Vectors(start, end - start, iov + count * VECTORS, VECTORS);
+        ends[count] = end;
+        count++;
+
+        start = end;
+    }
+
+    if (count == 0)
+        return 0;
+
+    int ret;
+
+    do {
+        ret = sendmmsg(sock, msgs, count, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            wait_events = POLLOUT;
+            return 0;
+        }
+
+        // a collector not listening shows up on a later send, take the
+        // datagrams as lost like any other
+        if (errno == ECONNREFUSED)
+            return ends[count - 1] - offset;
+
+        error = std::string("Error sending datagrams: ") + strerror(errno);
+        return -1;
+    }
+
+    return ends[ret - 1] - offset;
+}
+
+size_t Connection::TakeOversized() {
+    size_t taken = oversized;
+    oversized = 0;
+
+    return taken;
+}
+
+bool Connection::SendAll(const char * msg, size_t len, size_t & offset) {
+    while (offset < len) {
+        ssize_t ret = Send(msg + offset, len - offset);
+        if (ret < 0)
+            return false;
+
+        if (ret == 0) {
+            Wait(1000);
+            continue;
+        }
+
+        offset += ret;
+    }
+
+    return FlushAll(offset);
+}
+
+bool Connection::SendAll(const Chunks & chunks, size_t & offset) {
+    while (offset < chunks.Size()) {
+        ssize_t ret = Send(chunks, offset);
+        if (ret < 0)
+            return false;
+
+        if (ret == 0) {
+            Wait(1000);
+            continue;
+        }
+
+        offset += ret;
+    }
+
+    return FlushAll(offset);
+}
+
+bool Connection::FlushAll(size_t & offset) {
+    // the batch is not out before its compressed data is
+    while (Pending()) {
+        ssize_t ret = Flush();
+        if (ret < 0) {
+            offset = 0;
+            return false;
+        }
+
+        if (ret == 0)
+            Wait(1000);
+    }
+
+    return true;
+}
+
+bool Connection::WriteAll(const char * msg, size_t len) {
+    // uncompressed lines sent during the handshake
+    size_t offset = 0;
+
+    while (offset < len) {
+        ssize_t ret = Write(msg + offset, len - offset);
+        if (ret < 0)
+            return false;
+
+        if (ret == 0) {
+            Wait(1000);
+            continue;
+        }
+
+        offset += ret;
+    }
+
+    return true;
+}
@@ -0,0 +1,286 @@
+// See the file "COPYING" for copyright.
+//
+// TCP and TLS connection used by the TCP writer
+//
+// Besides TCP, the collector can be reached over a unix socket, as a
+// stream or as messages, or over UDP. Datagrams carry whole records,
+// packed up to the datagram size and sent with sendmmsg.
+//
+// Socket options are applied to every new socket and read back, with a
+// warning for each one the kernel refused or clamped.
+
+#pragma once
+
+#include <cstdint>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "Chunks.h"
+#include "Compressor.h"
+#include "Uring.h"
+
+namespace logging {
+namespace writer {
+
+class Connection {
+
+public:
+    enum Transport {
+        TRANSPORT_TCP,
+        TRANSPORT_UNIX,
+        TRANSPORT_SEQPACKET,
+        TRANSPORT_UDP,
+    };
+
+    enum Nagle {
+        // kernel default, switched off for small adaptive batches
+        NAGLE_AUTO,
+        NAGLE_ON,
+        NAGLE_OFF,
+        // hold partial segments until the end of every batch
+        NAGLE_CORK,
+    };
+
+    struct Options {
+        std::string host;
+        int tcpport;
+        bool tls;
+        std::string cert;
+        std::string key;
+        bool nonblocking;
+
+        // seconds allowed for resolving, connecting and the tls handshake,
+        // 0 for no limit except 30 seconds for the handshake
+        double connect_timeout;
+
+        // bounds for the randomized exponential delay between reconnects
+        double reconnect_min;
+        double reconnect_max;
+
+        // seconds resolved addresses are reused
+        double dns_ttl;
+
+        // compression of everything after the key line, empty for none
+        std::string compression;
+        int compression_level;
+
+        // sent at the start of every connection, after the key line and
+        // through the compressor, to describe the records that follow
+        std::string preamble;
+
+        // hand tls encryption to the kernel when openssl and the kernel
+        // support it
+        bool ktls;
+
+        // session announced for acknowledged batches, empty for a plain
+        // stream; the preamble is then framed as batch 0
+        std::string ack_session;
+
+        // how the collector is reached, with host naming the socket for
+        // the unix transports
+        Transport transport;
+
+        // largest datagram sent over udp
+        size_t datagram_size;
+
+        // socket send buffer in bytes, 0 for the kernel default
+        size_t send_buffer;
+
+        // how small writes are coalesced over tcp
+        Nagle nagle;
+
+        // seconds idle before keepalive probes and between them, and
+        // seconds sent data may stay unacknowledged, 0 for the defaults
+        double keepalive;
+        double user_timeout;
+
+        // tcp congestion control algorithm, empty for the default
+        std::string congestion_control;
+
+        // send blocking batches through the thread's io_uring ring
+        bool io_uring;
+    };
+
+    Connection(const Options & options);
+    ~Connection();
+
+    // connect, negotiate tls and send the key line, blocking for at most
+    // the connect timeout
+    bool Connect();
+    void Close();
+    bool Connected() const { return sock >= 0 && !connecting; }
+
+    enum State {
+        CONNECTED,
+        PENDING,
+        FAILED,
+    };
+
+    // take the next step towards reconnecting without blocking on the
+    // network: wait out the backoff, start a connect or finish one
+    State Reconnect();
+
+    // failed attempts since the last successful connect
+    int Failures() const { return failures; }
+
+    // connections made so far, telling this one from the one before
+    uint64_t Connects() const { return connects; }
+
+    // returns bytes sent, 0 if the socket would block and -1 on error;
+    // with compression a batch is taken whole and its compressed data
+    // goes out with later sends or flushes
+    ssize_t Send(const char * msg, size_t len);
+
+    // send chained data from offset like Send, in one vectored write or,
+    // with tls, one full record per chunk
+    ssize_t Send(const Chunks & chunks, size_t offset);
+
+    // write compressed data still waiting, returns bytes written, 0 if
+    // the socket would block and -1 on error
+    ssize_t Flush();
+    bool Pending() const { return compressed_offset < compressed.size(); }
+
+    // wait for the socket to be ready for the last blocked send
+    bool Wait(int timeout);
+
+    // wait for the peer to send something
+    bool WaitReadable(int timeout);
+
+    // send from offset until everything is out or the connection fails,
+    // with compression offset falls back to 0 on failure since the batch
+    // may not have left the compressed stream
+    bool SendAll(const char * msg, size_t len, size_t & offset);
+    bool SendAll(const Chunks & chunks, size_t & offset);
+
+    // send the records from offset on in as few datagrams as fit, with
+    // record boundaries in record_ends; returns bytes sent, 0 if the
+    // socket would block and -1 on error
+    ssize_t SendRecords(const Chunks & chunks, const std::vector<size_t> & record_ends, size_t offset);
+
+    // records too big for any datagram, skipped since the last call
+    size_t TakeOversized();
+
+    // process anything the peer sent, appending it to received when
+    // given, false if the peer closed the connection
+    bool ReadPending(std::string * received = nullptr);
+
+    // whether the last tls handshake resumed a cached session
+    bool Resumed() const { return resumed; }
+
+    // whether the kernel encrypts what is sent on this connection
+    bool Offloaded() const { return offloaded; }
+
+    // session callback for the shared tls context
+    static int NewSession(SSL * ssl, SSL_SESSION * session);
+
+    // description of the last failure and whether it was reaching the host
+    const std::string & LastError() const { return error; }
+    bool Unreachable() const { return unreachable; }
+
+    const Options & GetOptions() const { return options; }
+
+    // replace the preamble sent on the next connect
+    void SetPreamble(const std::string & preamble) { options.preamble = preamble; }
+
+    // replace the options, those of the socket and where it goes taking
+    // effect with the next connect, which is tried right away
+    void SetOptions(const Options & options);
+
+    // send small writes right away instead of coalescing them while data
+    // is unacknowledged, kept across reconnects; tcp with nagle auto only
+    void SetNoDelay(bool enabled);
+
+    // warnings about socket options since the last call
+    std::vector<std::string> TakeWarnings();
+
+    // host and port for messages
+    std::string Name() const;
+
+private:
+    bool Fail(const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+    // name lookup on a thread of its own, shared with it so a connection
+    // closed meanwhile can leave it behind
+    struct Lookup {
+        std::mutex lock;
+        std::condition_variable finished;
+        bool done;
+        int ret;
+        std::vector<struct sockaddr_storage> addrs;
+        std::vector<socklen_t> addr_lens;
+    };
+
+    bool Resolve();
+    static void RunLookup(std::shared_ptr<Lookup> lookup, std::string host, std::string port, int socktype);
+    bool FinishResolve(int timeout);
+    bool StartConnect();
+    bool ConnectAddress(int err);
+    void Tune();
+    void Warn(const char * format, ...) __attribute__((format(printf, 2, 3)));
+    void Push();
+    bool FinishConnect(int timeout);
+    bool SetupTLS();
+    bool Handshake(int timeout);
+    bool Introduce();
+    bool SendHeader();
+    ssize_t Write(const char * msg, size_t len);
+    bool WriteAll(const char * msg, size_t len);
+    bool FlushAll(size_t & offset);
+    void Backoff();
+
+    Options options;
+
+    int sock;
+    SSL_CTX * ctx;
+    SSL * ssl;
+    SSL_SESSION * session;
+    bool handshake;
+    bool handshaking;
+    bool resumed;
+    bool offloaded;
+    short wait_events;
+    bool nodelay;
+
+    std::string error;
+    bool unreachable;
+    std::vector<std::string> warnings;
+    bool tuned;
+
+    // ring of the sending thread, nullptr for plain sends
+    Uring * ring;
+
+    // compressed data not yet written
+    Compressor * compressor;
+    std::string compressed;
+    size_t compressed_offset;
+
+    size_t oversized;
+
+    // cached addresses for the host
+    std::vector<struct sockaddr_storage> addrs;
+    std::vector<socklen_t> addr_lens;
+    size_t addr_index;
+    double resolved;
+    std::shared_ptr<Lookup> lookup;
+
+    // reconnect state
+    bool connecting;
+    double deadline;
+    double next_attempt;
+    int failures;
+    uint64_t connects;
+    std::minstd_rand jitter;
+};
+
+}
+}
@@ -0,0 +1,227 @@
+// See the file "COPYING" for copyright.
+//
+// JSON serializer specialized for one stream's schema
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+
+#include <arpa/inet.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "FastJSON.h"
+
+using namespace logging;
+using namespace writer;
+
+static bool Special(unsigned char c) {
+    // bytes every version of the json formatter writes as they are
+    return c < 32 || c > 126 || c == '"' || c == '\\' || c == '\'' || c == '&';
+}
+
+static bool Plain(const char * data, size_t len) {
+    size_t i = 0;
+
+#ifdef __SSE2__
+    // check 16 bytes at a time, with bytes above 127 negative as signed
+    const __m128i space = _mm_set1_epi8(32);
+    const __m128i del = _mm_set1_epi8(127);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i apostrophe = _mm_set1_epi8('\'');
+    const __m128i ampersand = _mm_set1_epi8('&');
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(chunk, space), _mm_cmpeq_epi8(chunk, del));
+        special = _mm_or_si128(special, _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+        special = _mm_or_si128(special, _mm_or_si128(_mm_cmpeq_epi8(chunk, apostrophe), _mm_cmpeq_epi8(chunk, ampersand)));
+
+        if (_mm_movemask_epi8(special))
+            return false;
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (Special(data[i]))
+            return false;
+    }
+
+    return true;
+}
+
+FastJSON::FastJSON(threading::formatter::JSON * fallback, threading::formatter::JSON::TimeFormat timestamps, const std::string & open, int num_fields, const threading::Field * const * fields) : fallback(fallback), timestamps(timestamps), open(open) {
+    encoders.reserve(num_fields);
+
+    for (int i = 0; i < num_fields; i++) {
+        // field names are identifiers and go in as they are
+        std::string key = std::string("\"") + fields[i]->name + "\":";
+        encoders.push_back(Encoder{key, KindOf(fields[i]->type), KindOf(fields[i]->subtype)});
+    }
+}
+
+FastJSON::Kind FastJSON::KindOf(TypeTag type) const {
+    switch (type) {
+    case TYPE_BOOL:
+        return BOOL;
+    case TYPE_INT:
+        return INT;
+    case TYPE_COUNT:
+    case TYPE_COUNTER:
+        return COUNT;
+    case TYPE_PORT:
+        return PORT;
+    case TYPE_ADDR:
+        return ADDR;
+    case TYPE_SUBNET:
+        return SUBNET;
+    case TYPE_STRING:
+    case TYPE_ENUM:
+    case TYPE_FILE:
+    case TYPE_FUNC:
+        return STRING;
+    case TYPE_TIME:
+        return timestamps == threading::formatter::JSON::TS_MILLIS ? TIME_MILLIS : GENERIC;
+    case TYPE_TABLE:
+    case TYPE_VECTOR:
+        return CONTAINER;
+    default:
+        return GENERIC;
+    }
+}
+
+template<typename T>
+void FastJSON::Integer(T val) {
+    char digits[24];
+    char * end = std::to_chars(digits, digits + sizeof(digits), val).ptr;
+    out.append(digits, end - digits);
+}
+
+void FastJSON::Generic(threading::Value * val) {
+    // what the generic formatter writes for the value on its own
+    scratch.Clear();
+    fallback->Describe(&scratch, val);
+    out.append((const char *)scratch.Bytes(), scratch.Len());
+}
+
+void FastJSON::Addr(const threading::Value::addr_t & addr) {
+    char text[INET6_ADDRSTRLEN];
+
+    if (addr.family == IPv4)
+        inet_ntop(AF_INET, &addr.in.in4, text, sizeof(text));
+    else
+        inet_ntop(AF_INET6, &addr.in.in6, text, sizeof(text));
+
+    out.append(text);
+}
+
+void FastJSON::Encode(Kind kind, Kind element, threading::Value * val) {
+    switch (kind) {
+    case BOOL:
+        out.append(val->val.int_val == 0 ? "false" : "true");
+        break;
+
+    case INT:
+        Integer(val->val.int_val);
+        break;
+
+    case COUNT:
+        // counts json cannot hold are reported by the formatter
+        if (val->val.uint_val >= INT64_MAX)
+            Generic(val);
+        else
+            Integer(val->val.uint_val);
+        break;
+
+    case PORT:
+        Integer(val->val.port_val.port);
+        break;
+
+    case ADDR:
+        out.push_back('"');
+        Addr(val->val.addr_val);
+        out.push_back('"');
+        break;
+
+    case SUBNET:
+        out.push_back('"');
+        Addr(val->val.subnet_val.prefix);
+        out.push_back('/');
+        Integer((unsigned int)val->val.subnet_val.length);
+        out.push_back('"');
+        break;
+
+    case STRING:
+        if (!Plain(val->val.string_val.data, val->val.string_val.length)) {
+            Generic(val);
+            break;
+        }
+
+        out.push_back('"');
+        out.append(val->val.string_val.data, val->val.string_val.length);
+        out.push_back('"');
+        break;
+
+    case TIME_MILLIS:
+        Integer((uint64_t)(val->val.double_val * 1000));
+        break;
+
+    case CONTAINER: {
+        bro_int_t size = val->type == TYPE_TABLE ? val->val.set_val.size : val->val.vector_val.size;
+        threading::Value ** items = val->type == TYPE_TABLE ? val->val.set_val.vals : val->val.vector_val.vals;
+
+        out.push_back('[');
+
+        for (bro_int_t i = 0; i < size; i++) {
+            if (i > 0)
+                out.push_back(',');
+
+            threading::Value * item = items[i];
+
+            // missing elements and nested containers are rare
+            if (!item->present || element == CONTAINER)
+                Generic(item);
+            else
+                Encode(element, GENERIC, item);
+        }
+
+        out.push_back(']');
+        break;
+    }
+
+    case GENERIC:
+        Generic(val);
+        break;
+    }
+}
+
+const std::string & FastJSON::Describe(threading::Value ** vals) {
+    out.assign(open);
+
+    // fields of the opening need a comma before the first field here
+    bool comma = open.size() > 1;
+
+    for (size_t i = 0; i < encoders.size(); i++) {
+        threading::Value * val = vals[i];
+        if (!val->present)
+            continue;
+
+        const Encoder & encoder = encoders[i];
+
+        if (comma)
+            out.push_back(',');
+
+        out.append(encoder.key);
+        Encode(encoder.kind, encoder.element, val);
+
+        comma = true;
+    }
+
+    out.push_back('}');
+
+    return out;
+}
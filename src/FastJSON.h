@@ -0,0 +1,73 @@
+// See the file "COPYING" for copyright.
+//
+// JSON serializer specialized for one stream's schema
+//
+// Produces the same bytes as threading::formatter::JSON. Keys are quoted
+// once up front and every field gets an encoder picked from its type, so
+// records are written straight into one buffer. Values whose rendering
+// depends on the Zeek version (doubles, epoch and iso8601 times, strings
+// needing escapes, counts too large for JSON) are handed to the generic
+// formatter.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "threading/SerialTypes.h"
+#include "threading/formatters/JSON.h"
+#include "Desc.h"
+
+namespace logging {
+namespace writer {
+
+class FastJSON {
+
+public:
+    // records open with open, which is "{" or holds fields of its own
+    FastJSON(threading::formatter::JSON * fallback, threading::formatter::JSON::TimeFormat timestamps, const std::string & open, int num_fields, const threading::Field * const * fields);
+
+    // a record as a json object, valid until the next call
+    const std::string & Describe(threading::Value ** vals);
+
+private:
+    enum Kind {
+        BOOL,
+        INT,
+        COUNT,
+        PORT,
+        ADDR,
+        SUBNET,
+        STRING,
+        TIME_MILLIS,
+        CONTAINER,
+        GENERIC,
+    };
+
+    struct Encoder {
+        std::string key;
+        Kind kind;
+        Kind element;
+    };
+
+    Kind KindOf(TypeTag type) const;
+
+    void Encode(Kind kind, Kind element, threading::Value * val);
+    void Generic(threading::Value * val);
+    void Addr(const threading::Value::addr_t & addr);
+
+    template<typename T>
+    void Integer(T val);
+
+    threading::formatter::JSON * fallback;
+    threading::formatter::JSON::TimeFormat timestamps;
+    std::string open;
+    std::vector<Encoder> encoders;
+
+    // record being built, and scratch space for the generic formatter
+    std::string out;
+    ODesc scratch;
+};
+
+}
+}
@@ -0,0 +1,489 @@
+// See the file "COPYING" for copyright.
+//
+// Connections shared by all TCP writers sending to the same destination
+
+#include <algorithm>
+#include <chrono>
+#include <tuple>
+
+#include "Multiplexer.h"
+
+using namespace logging;
+using namespace writer;
+
+// share of the connection each lane gets when weighted, in bytes per
+// round
+static const size_t QUANTUM = 65536;
+static const size_t WEIGHTS[Destination::LANES] = {4, 2, 1};
+
+// batches kept for reuse, beyond which they are freed
+static const size_t SPARE_BATCHES = 64;
+
+std::mutex Destination::destinations_lock;
+std::map<Destination::Key, Destination *> Destination::destinations;
+
+bool Destination::Key::operator<(const Key & other) const {
+    return std::tie(host, tcpport, transport, lane, tls, cert, key, compression, compression_level) < std::tie(other.host, other.tcpport, other.transport, other.lane, other.tls, other.cert, other.key, other.compression, other.compression_level);
+}
+
+Destination::Destination(const Key & key, const Connection::Options & options, Scheduling scheduling) : key(key), users(0), conn(options), scheduling(scheduling), deficits(), current_lane(0), lane_started(false), bytes(0), capacity(0), dropped(0), stopping(false), connected(false), offloaded(false), pending(false), preambles_changed(false), error_generation(0), reported_generation(0) {
+    for (std::atomic<size_t> & size : lane_bytes)
+        size = 0;
+
+    spare.reserve(SPARE_BATCHES);
+
+    sender = std::thread(&Destination::Run, this);
+}
+
+Destination::~Destination() {
+    // let the sender finish what is queued
+    stopping = true;
+    Wake();
+
+    sender.join();
+
+    for (Batch * batch : spare)
+        delete batch;
+}
+
+Destination * Destination::Acquire(const Connection::Options & options, size_t capacity, int lane, Scheduling scheduling) {
+    std::lock_guard<std::mutex> guard(destinations_lock);
+
+    Key key{options.host, options.tcpport, options.transport, lane, options.tls, options.cert, options.key, options.compression, options.compression_level};
+
+    // the first writer's timeouts, offload setting and scheduling apply
+    // to the shared connection
+    Destination *& destination = destinations[key];
+    if (destination == nullptr) {
+        Connection::Options shared = options;
+        shared.nonblocking = false;
+        shared.preamble.clear();
+
+        destination = new Destination(key, shared, scheduling);
+    }
+
+    // the largest backlog any writer asked for bounds the queue
+    destination->capacities.insert(capacity);
+    destination->capacity = *destination->capacities.rbegin();
+
+    destination->users++;
+
+    return destination;
+}
+
+void Destination::Release(Destination * destination, size_t capacity) {
+    {
+        std::lock_guard<std::mutex> guard(destinations_lock);
+
+        std::multiset<size_t>::iterator it = destination->capacities.find(capacity);
+        if (it != destination->capacities.end())
+            destination->capacities.erase(it);
+
+        if (--destination->users > 0) {
+            // what is queued beyond the new bound goes with the next push
+            // or the sender's next batch
+            if (!destination->capacities.empty())
+                destination->capacity = *destination->capacities.rbegin();
+
+            return;
+        }
+
+        destinations.erase(destination->key);
+    }
+
+    delete destination;
+}
+
+void Destination::Resize(size_t from, size_t to) {
+    {
+        std::lock_guard<std::mutex> guard(destinations_lock);
+
+        std::multiset<size_t>::iterator it = capacities.find(from);
+        if (it != capacities.end())
+            capacities.erase(it);
+
+        capacities.insert(to);
+        capacity = *capacities.rbegin();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lanes_lock);
+
+        Gather();
+        Prune();
+    }
+
+    // writers blocking on a full lane check again
+    std::lock_guard<std::mutex> guard(room_lock);
+    room.notify_all();
+}
+
+bool Destination::Fits(size_t len, int lane) const {
+    size_t used = 0;
+    for (int i = 0; i <= lane; i++)
+        used += lane_bytes[i];
+
+    return used + len <= capacity;
+}
+
+bool Destination::WaitFits(size_t len, int lane, int timeout) {
+    std::unique_lock<std::mutex> guard(room_lock);
+    return room.wait_for(guard, std::chrono::milliseconds(timeout), [this, len, lane]() { return Fits(len, lane); });
+}
+
+Batch * Destination::Take() {
+    {
+        std::lock_guard<std::mutex> guard(spare_lock);
+
+        if (!spare.empty()) {
+            Batch * batch = spare.back();
+            spare.pop_back();
+            return batch;
+        }
+    }
+
+    return new Batch();
+}
+
+void Destination::Push(Batch * batch) {
+    bytes += batch->data.size();
+    lane_bytes[batch->lane] += batch->data.size();
+    queues[batch->lane].Push(batch);
+
+    // the sender only prunes between batches, which may be a while
+    // when a send blocks
+    if (bytes > capacity) {
+        std::lock_guard<std::mutex> guard(lanes_lock);
+
+        Gather();
+        Prune();
+    }
+
+    Wake();
+}
+
+void Destination::AddPreamble(const std::string & preamble, int lane) {
+    if (preamble.empty())
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(preambles_lock);
+
+        preambles.insert(preamble);
+        preambles_changed = true;
+    }
+
+    // a connection that is already up only sent the others, and queueing
+    // it ahead of the writer's records also covers one coming up right
+    // now, at the price of sending it twice
+    Batch * batch = Take();
+    batch->data = preamble;
+    batch->record_ends.clear();
+    batch->droppable = false;
+    batch->lane = lane;
+    batch->whole = true;
+
+    Push(batch);
+}
+
+void Destination::RemovePreamble(const std::string & preamble) {
+    if (preamble.empty())
+        return;
+
+    std::lock_guard<std::mutex> guard(preambles_lock);
+
+    std::multiset<std::string>::iterator it = preambles.find(preamble);
+    if (it != preambles.end())
+        preambles.erase(it);
+
+    preambles_changed = true;
+}
+
+void Destination::UpdatePreamble() {
+    if (!preambles_changed)
+        return;
+
+    std::lock_guard<std::mutex> guard(preambles_lock);
+
+    std::string preamble;
+    for (const std::string & entry : preambles)
+        preamble += entry;
+
+    conn.SetPreamble(preamble);
+    preambles_changed = false;
+}
+
+std::string Destination::LastError() {
+    std::lock_guard<std::mutex> guard(error_lock);
+    return error;
+}
+
+std::vector<std::string> Destination::TakeWarnings() {
+    std::lock_guard<std::mutex> guard(error_lock);
+
+    std::vector<std::string> taken;
+    taken.swap(warnings);
+
+    return taken;
+}
+
+bool Destination::ClaimError(uint64_t generation) {
+    uint64_t reported = reported_generation;
+
+    while (reported < generation) {
+        if (reported_generation.compare_exchange_weak(reported, generation))
+            return true;
+    }
+
+    return false;
+}
+
+void Destination::Wake() {
+    // set under the lock, so a sender between checking for work and
+    // waiting cannot miss it
+    std::lock_guard<std::mutex> guard(wake_lock);
+
+    pending = true;
+    wake.notify_one();
+}
+
+void Destination::Sleep(int timeout) {
+    // wait for new batches or shutdown, at most timeout ms
+    std::unique_lock<std::mutex> guard(wake_lock);
+
+    wake.wait_for(guard, std::chrono::milliseconds(timeout), [this]() { return pending || stopping; });
+    pending = false;
+}
+
+void Destination::SetError(const std::string & msg) {
+    std::lock_guard<std::mutex> guard(error_lock);
+
+    error = msg;
+    error_generation++;
+}
+
+void Destination::Remove(const Batch * batch) {
+    // a batch taken out of the lanes no longer counts against capacity
+    bytes -= batch->data.size();
+    lane_bytes[batch->lane] -= batch->data.size();
+
+    // writers blocking on a full lane check again
+    std::lock_guard<std::mutex> guard(room_lock);
+    room.notify_all();
+}
+
+void Destination::Drop(Batch * batch) {
+    dropped += batch->record_ends.size();
+    Recycle(batch);
+}
+
+void Destination::Recycle(Batch * batch) {
+    // the trace goes back now, the buffers with the batch
+    if (batch->trace) {
+        Tracer::Finish(batch->trace);
+        batch->trace = nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(spare_lock);
+
+        if (spare.size() < SPARE_BATCHES) {
+            spare.push_back(batch);
+            return;
+        }
+    }
+
+    delete batch;
+}
+
+void Destination::Gather() {
+    for (int i = 0; i < LANES; i++) {
+        while (Batch * batch = queues[i].Pop())
+            lanes[i].Push(batch);
+    }
+}
+
+void Destination::Prune() {
+    // drop the oldest droppable batches until back under capacity,
+    // starting with the lowest lane
+    for (int i = LANES - 1; i >= 0 && bytes > capacity; i--) {
+        Lane & lane = lanes[i];
+        Batch * before = nullptr;
+
+        for (Batch * batch = lane.Front(); batch != nullptr && bytes > capacity;) {
+            if (!batch->droppable) {
+                before = batch;
+                batch = batch->later;
+                continue;
+            }
+
+            Batch * later = batch->later;
+
+            lane.Unlink(before);
+            Remove(batch);
+            Drop(batch);
+
+            batch = later;
+        }
+    }
+}
+
+Batch * Destination::Next() {
+    int empty = 0;
+    for (const Lane & lane : lanes)
+        empty += lane.Empty();
+
+    if (empty == LANES)
+        return nullptr;
+
+    Batch * batch = nullptr;
+
+    if (scheduling == STRICT) {
+        for (Lane & lane : lanes) {
+            if (!lane.Empty()) {
+                batch = lane.Pop();
+                break;
+            }
+        }
+    }
+    else {
+        // every lane with batches gets its weight's worth of bytes per
+        // round, carrying over what a large batch has not used up
+        while (batch == nullptr) {
+            Lane & lane = lanes[current_lane];
+
+            if (!lane.Empty()) {
+                if (!lane_started) {
+                    deficits[current_lane] += WEIGHTS[current_lane] * QUANTUM;
+                    lane_started = true;
+                }
+
+                size_t len = lane.Front()->data.size();
+                if (len <= deficits[current_lane]) {
+                    deficits[current_lane] -= len;
+                    batch = lane.Pop();
+                    break;
+                }
+            }
+            else {
+                deficits[current_lane] = 0;
+            }
+
+            current_lane = (current_lane + 1) % LANES;
+            lane_started = false;
+        }
+    }
+
+    Remove(batch);
+
+    return batch;
+}
+
+void Destination::Run() {
+    Batch * batch = nullptr;
+    size_t offset = 0;
+
+    while (true) {
+        if (batch == nullptr) {
+            {
+                std::lock_guard<std::mutex> guard(lanes_lock);
+
+                Gather();
+
+                // the oldest batches of the lowest lanes go first when
+                // over capacity
+                Prune();
+
+                batch = Next();
+            }
+
+            if (batch == nullptr) {
+                if (stopping)
+                    break;
+
+                // notice closed connections and tls session tickets while idle
+                if (conn.Connected() && !conn.ReadPending()) {
+                    SetError(conn.LastError());
+                    conn.Close();
+                    connected = false;
+                }
+
+                Sleep(100);
+                continue;
+            }
+
+            offset = 0;
+        }
+
+        if (!conn.Connected()) {
+            UpdatePreamble();
+
+            Connection::State state = stopping ? (conn.Connect() ? Connection::CONNECTED : Connection::FAILED) : conn.Reconnect();
+
+            // hand socket option warnings to the writers
+            std::vector<std::string> taken = conn.TakeWarnings();
+            if (!taken.empty()) {
+                std::lock_guard<std::mutex> guard(error_lock);
+                warnings.insert(warnings.end(), taken.begin(), taken.end());
+            }
+
+            if (state == Connection::CONNECTED) {
+                offloaded = conn.Offloaded();
+                connected = true;
+                continue;
+            }
+
+            if (state == Connection::FAILED)
+                SetError(conn.LastError());
+
+            if (stopping) {
+                // nowhere left to send anything
+                Drop(batch);
+                batch = nullptr;
+
+                std::lock_guard<std::mutex> guard(lanes_lock);
+
+                Gather();
+
+                for (Lane & lane : lanes) {
+                    while (Batch * queued = lane.Pop()) {
+                        Remove(queued);
+                        Drop(queued);
+                    }
+                }
+
+                break;
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(lanes_lock);
+
+                Gather();
+                Prune();
+            }
+
+            Sleep(100);
+            continue;
+        }
+
+        if (!conn.SendAll(batch->data.data(), batch->data.size(), offset)) {
+            SetError(conn.LastError());
+            conn.Close();
+            connected = false;
+
+            // resend from the first record the old connection cut short
+            std::vector<size_t>::const_iterator it = std::upper_bound(batch->record_ends.begin(), batch->record_ends.end(), offset);
+            offset = it == batch->record_ends.begin() || batch->whole ? 0 : *(it - 1);
+            continue;
+        }
+
+        if (batch->trace)
+            batch->trace->written = Tracer::Now();
+
+        Recycle(batch);
+        batch = nullptr;
+    }
+
+    conn.Close();
+    connected = false;
+}
@@ -0,0 +1,257 @@
+// See the file "COPYING" for copyright.
+//
+// Connections shared by all TCP writers sending to the same destination
+//
+// Writers hand batches to one of a few priority lanes. The sender thread
+// moves them from the lock-free queues into lanes of its own and picks the
+// next batch either strictly by priority or by deficit round robin, so a
+// busy low priority stream cannot hold back the others, and drops what is
+// over capacity starting with the lowest lane. A writer pushing past
+// capacity does that dropping itself, so the queues stay bounded while
+// the sender is stuck in a send. Batches link themselves
+// into queues and lanes, and go back to a pool of the destination once
+// sent, keeping their buffers for the next writer to fill.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Affinity.h"
+#include "Connection.h"
+#include "Queue.h"
+#include "Tracer.h"
+
+namespace logging {
+namespace writer {
+
+struct Batch {
+    Batch() : droppable(false), lane(0), whole(false), trace(nullptr), next(nullptr), later(nullptr) {}
+
+    std::string data;
+    std::vector<size_t> record_ends;
+
+    // may be dropped by the sender when the destination is over capacity
+    bool droppable;
+
+    // priority lane, 0 being the highest
+    int lane;
+
+    // records refer back to earlier ones, so a cut batch is resent whole
+    bool whole;
+
+    // trace handed back once the batch is written or dropped, or nullptr
+    Trace * trace;
+
+    // links in the queue of a lane, and then in the sender's lane
+    std::atomic<Batch *> next;
+    Batch * later;
+
+    ~Batch() {
+        if (trace)
+            Tracer::Finish(trace);
+    }
+};
+
+// batches of a lane in order, linked through the batches, as only the
+// holder of the destination's lanes lock touches them
+class Lane {
+
+public:
+    Lane() : first(nullptr), last(nullptr) {}
+
+    bool Empty() const { return first == nullptr; }
+    Batch * Front() const { return first; }
+
+    void Push(Batch * batch) {
+        batch->later = nullptr;
+
+        if (last)
+            last->later = batch;
+        else
+            first = batch;
+
+        last = batch;
+    }
+
+    // take the batch after before out, or the first one for nullptr
+    Batch * Unlink(Batch * before) {
+        Batch * batch = before ? before->later : first;
+
+        if (before)
+            before->later = batch->later;
+        else
+            first = batch->later;
+
+        if (last == batch)
+            last = before;
+
+        batch->later = nullptr;
+        return batch;
+    }
+
+    Batch * Pop() { return first ? Unlink(nullptr) : nullptr; }
+
+private:
+    Batch * first;
+    Batch * last;
+};
+
+class Destination {
+
+public:
+    static const int LANES = 3;
+
+    enum Scheduling {
+        STRICT,
+        WEIGHTED,
+    };
+
+    struct Key {
+        std::string host;
+        int tcpport;
+        int transport;
+
+        // lane with a connection of its own, or -1 for all lanes
+        int lane;
+
+        bool tls;
+        std::string cert;
+        std::string key;
+        std::string compression;
+        int compression_level;
+
+        bool operator<(const Key & other) const;
+    };
+
+    // shared destination for the given settings, started on first use,
+    // carrying only the given lane or all of them for -1, and holding up
+    // to the largest capacity any of its writers asked for
+    static Destination * Acquire(const Connection::Options & options, size_t capacity, int lane, Scheduling scheduling);
+    static void Release(Destination * destination, size_t capacity);
+
+    // change the capacity a writer asked for, dropping what no longer
+    // fits right away when that lowers it
+    void Resize(size_t from, size_t to);
+
+    // an empty batch to fill and push, from the pool when there is one
+    Batch * Take();
+
+    // hand a batch to the sender thread, dropping the oldest droppable
+    // batches at once when that goes over capacity
+    void Push(Batch * batch);
+
+    // preambles of all writers go out on every new connection, and
+    // ahead of the records of a writer joining later
+    void AddPreamble(const std::string & preamble, int lane);
+    void RemovePreamble(const std::string & preamble);
+
+    // whether a batch fits in the given lane, counting what lower lanes
+    // hold as room since it would be dropped first
+    bool Fits(size_t len, int lane) const;
+
+    // wait up to timeout ms for the sender to make room for a batch,
+    // returning whether it fits
+    bool WaitFits(size_t len, int lane, int timeout);
+    bool Connected() const { return connected; }
+    bool Offloaded() const { return offloaded; }
+    size_t Size() const { return bytes; }
+
+    // records dropped by the sender since the last call
+    uint64_t TakeDropped() { return dropped.exchange(0); }
+
+    // errors are numbered so each writer can tell it has seen one
+    uint64_t ErrorGeneration() const { return error_generation; }
+    std::string LastError();
+
+    // whether the caller is the first to report the given error
+    bool ClaimError(uint64_t generation);
+
+    // pin the sender thread to the given cpus, returning 0 or an errno
+    // value
+    int Pin(const std::vector<int> & cpus) { return Affinity::Set(sender.native_handle(), cpus); }
+
+    // warnings about socket options since the last call
+    std::vector<std::string> TakeWarnings();
+
+    const std::string & Host() const { return key.host; }
+    int Port() const { return key.tcpport; }
+
+private:
+    Destination(const Key & key, const Connection::Options & options, Scheduling scheduling);
+    ~Destination();
+
+    void Run();
+    void Wake();
+    void Sleep(int timeout);
+    void SetError(const std::string & msg);
+    void Remove(const Batch * batch);
+    void Drop(Batch * batch);
+    void Recycle(Batch * batch);
+    void Gather();
+    void Prune();
+    Batch * Next();
+    void UpdatePreamble();
+
+    static std::mutex destinations_lock;
+    static std::map<Key, Destination *> destinations;
+
+    Key key;
+    int users;
+
+    // what every writer asked for, guarded by destinations_lock
+    std::multiset<size_t> capacities;
+
+    Connection conn;
+    IntrusiveMPSCQueue<Batch> queues[LANES];
+    std::thread sender;
+
+    // batches taken from the queues, and the deficit round robin state,
+    // guarded by lanes_lock, whose holder is the queues' one consumer
+    std::mutex lanes_lock;
+    Lane lanes[LANES];
+    Scheduling scheduling;
+    size_t deficits[LANES];
+    int current_lane;
+    bool lane_started;
+
+    std::atomic<size_t> bytes;
+    std::atomic<size_t> lane_bytes[LANES];
+    std::atomic<size_t> capacity;
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> stopping;
+    std::atomic<bool> connected;
+    std::atomic<bool> offloaded;
+
+    // batches pushed since the sender last slept, guarded by wake_lock
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    bool pending;
+
+    // signalled whenever the sender takes bytes out of the lanes
+    std::mutex room_lock;
+    std::condition_variable room;
+
+    // batches done with, for writers to take again
+    std::mutex spare_lock;
+    std::vector<Batch *> spare;
+
+    std::mutex preambles_lock;
+    std::multiset<std::string> preambles;
+    std::atomic<bool> preambles_changed;
+
+    std::mutex error_lock;
+    std::string error;
+    std::vector<std::string> warnings;
+    std::atomic<uint64_t> error_generation;
+    std::atomic<uint64_t> reported_generation;
+};
+
+}
+}
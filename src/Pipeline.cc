@@ -0,0 +1,143 @@
+// See the file "COPYING" for copyright.
+//
+// Pool of threads formatting batches of records for one writer
+
+#include "Affinity.h"
+#include "Pipeline.h"
+
+using namespace logging;
+using namespace writer;
+
+Pipeline::Pipeline(int threads, const Format & format) : format(format), stopping(false) {
+    for (int i = 0; i < threads; i++)
+        this->threads.emplace_back(&Pipeline::Work, this, i);
+}
+
+int Pipeline::Pin(const std::vector<int> & cpus) {
+    for (size_t i = 0; i < threads.size(); i++) {
+        int err = Affinity::Set(threads[i].native_handle(), std::vector<int>{cpus[i % cpus.size()]});
+        if (err != 0)
+            return err;
+    }
+
+    return 0;
+}
+
+Pipeline::~Pipeline() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+
+    queued.notify_all();
+
+    for (std::thread & thread : threads)
+        thread.join();
+
+    // jobs never taken back still hold their values when they were not
+    // formatted
+    for (Job * job : submitted) {
+        if (!job->done) {
+            for (threading::Value ** vals : job->records) {
+                for (int i = 0; i < job->num_fields; i++)
+                    delete vals[i];
+            }
+        }
+
+        delete job;
+    }
+
+    for (Job * job : free_jobs)
+        delete job;
+}
+
+Job * Pipeline::Take(int num_fields) {
+    Job * job;
+
+    if (free_jobs.empty()) {
+        job = new Job;
+    }
+    else {
+        job = free_jobs.back();
+        free_jobs.pop_back();
+    }
+
+    job->num_fields = num_fields;
+    job->traced.clear();
+    job->done = false;
+
+    return job;
+}
+
+void Pipeline::Submit(Job * job) {
+    submitted.push_back(job);
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(job);
+    }
+
+    queued.notify_one();
+}
+
+Job * Pipeline::Next(bool wait) {
+    if (submitted.empty())
+        return nullptr;
+
+    Job * job = submitted.front();
+
+    std::unique_lock<std::mutex> guard(lock);
+
+    if (wait) {
+        formatted.wait(guard, [job]() { return job->done; });
+    }
+    else if (!job->done) {
+        return nullptr;
+    }
+
+    submitted.pop_front();
+
+    return job;
+}
+
+void Pipeline::Release(Job * job) {
+    job->records.clear();
+    job->arena.Reset();
+    job->chunks.Clear();
+    job->record_ends.clear();
+
+    free_jobs.push_back(job);
+}
+
+void Pipeline::Work(int worker) {
+    while (true) {
+        Job * job;
+
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            queued.wait(guard, [this]() { return stopping || !queue.empty(); });
+
+            if (stopping)
+                return;
+
+            job = queue.front();
+            queue.pop_front();
+        }
+
+        format(worker, job);
+
+        // the values are not needed anymore, and freeing them here keeps
+        // that work off the writer thread too
+        for (threading::Value ** vals : job->records) {
+            for (int i = 0; i < job->num_fields; i++)
+                delete vals[i];
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            job->done = true;
+        }
+
+        formatted.notify_all();
+    }
+}
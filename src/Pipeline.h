@@ -0,0 +1,98 @@
+// See the file "COPYING" for copyright.
+//
+// Pool of threads formatting batches of records for one writer
+//
+// The writer thread moves the values of records into a job and submits it
+// once full. Formatter threads take jobs in any order and format them into
+// the job's chunks, while the writer takes them back strictly in the order
+// they were submitted to send them, so records keep their order however
+// the work is spread.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "threading/SerialTypes.h"
+
+#include "Arena.h"
+#include "Chunks.h"
+
+namespace logging {
+namespace writer {
+
+struct Job {
+    // values of the records, deleted once formatted, in arrays from the
+    // arena
+    int num_fields;
+    std::vector<threading::Value **> records;
+    Arena arena;
+
+    // when the first record was written
+    double time;
+
+    // when each traced record was written, and when formatting ended
+    std::vector<double> traced;
+    double formatted;
+
+    // the formatted records and where each one ends
+    Chunks chunks;
+    std::vector<size_t> record_ends;
+
+    bool done;
+};
+
+class Pipeline {
+
+public:
+    // format a job's records into its chunks, called with the number of
+    // the formatter thread
+    typedef std::function<void(int worker, Job * job)> Format;
+
+    Pipeline(int threads, const Format & format);
+    ~Pipeline();
+
+    // an empty job, reusing one returned before
+    Job * Take(int num_fields);
+
+    // hand a job to the formatter threads
+    void Submit(Job * job);
+
+    // the oldest job submitted once it is formatted, waiting for it when
+    // wait is set, or nullptr
+    Job * Next(bool wait);
+
+    // return a job taken from Next
+    void Release(Job * job);
+
+    // jobs submitted and not taken back yet
+    size_t InFlight() const { return submitted.size(); }
+
+    // pin each formatter thread to one of the cpus in turn, returning 0
+    // or an errno value
+    int Pin(const std::vector<int> & cpus);
+
+private:
+    void Work(int worker);
+
+    Format format;
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable queued;
+    std::condition_variable formatted;
+    std::deque<Job *> queue;
+    bool stopping;
+
+    // only touched by the writer thread
+    std::deque<Job *> submitted;
+    std::vector<Job *> free_jobs;
+};
+
+}
+}
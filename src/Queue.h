@@ -0,0 +1,145 @@
+// See the file "COPYING" for copyright.
+//
+// Lock-free multiple producer, single consumer queues
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace logging {
+namespace writer {
+
+// queue of objects linked through their own "std::atomic<T *> next",
+// so pushing allocates nothing; an object is in at most one queue at a
+// time
+template<typename T>
+class IntrusiveMPSCQueue {
+
+public:
+    IntrusiveMPSCQueue() : head(&stub), tail(&stub) {}
+
+    // safe to call from any thread
+    void Push(T * node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+
+        T * prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // only safe to call from the single consumer, nullptr when empty or
+    // while the only node left is still being pushed
+    T * Pop() {
+        T * node = tail;
+        T * next = node->next.load(std::memory_order_acquire);
+
+        // the stub only holds the place of an empty queue
+        if (node == &stub) {
+            if (next == nullptr)
+                return nullptr;
+
+            tail = next;
+            node = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if (next != nullptr) {
+            tail = next;
+            return node;
+        }
+
+        if (node != head.load(std::memory_order_acquire))
+            return nullptr;
+
+        // the last node can only go with the stub behind it
+        Push(&stub);
+
+        next = node->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+            return nullptr;
+
+        tail = next;
+        return node;
+    }
+
+private:
+    IntrusiveMPSCQueue(const IntrusiveMPSCQueue &) = delete;
+    IntrusiveMPSCQueue & operator=(const IntrusiveMPSCQueue &) = delete;
+
+    T stub;
+    std::atomic<T *> head;
+    T * tail;
+};
+
+// queue of a fixed number of values in a ring allocated up front, each
+// cell's sequence telling whose turn it is
+template<typename T>
+class BoundedMPSCQueue {
+
+public:
+    // capacity must be a power of two
+    explicit BoundedMPSCQueue(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1), head(0), tail(0) {
+        for (size_t i = 0; i < capacity; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    ~BoundedMPSCQueue() {
+        delete[] cells;
+    }
+
+    // safe to call from any thread, false when full
+    bool Push(const T & value) {
+        size_t pos = head.load(std::memory_order_relaxed);
+
+        for (;;) {
+            Cell & cell = cells[pos & mask];
+            intptr_t diff = (intptr_t)cell.sequence.load(std::memory_order_acquire) - (intptr_t)pos;
+
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // only safe to call from the single consumer
+    bool Pop(T & value) {
+        Cell & cell = cells[tail & mask];
+
+        if ((intptr_t)cell.sequence.load(std::memory_order_acquire) - (intptr_t)(tail + 1) < 0)
+            return false;
+
+        value = cell.value;
+        cell.sequence.store(tail + mask + 1, std::memory_order_release);
+        tail++;
+
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    BoundedMPSCQueue(const BoundedMPSCQueue &) = delete;
+    BoundedMPSCQueue & operator=(const BoundedMPSCQueue &) = delete;
+
+    Cell * cells;
+    size_t mask;
+    std::atomic<size_t> head;
+    size_t tail;
+};
+
+}
+}
@@ -0,0 +1,63 @@
+// See the file "COPYING" for copyright.
+//
+// Settings changed at run time through LogTCP::reconfigure
+
+#include <set>
+
+#include "Reload.h"
+
+using namespace logging;
+using namespace writer;
+
+std::mutex Reload::lock;
+uint64_t Reload::generation = 0;
+std::map<std::string, std::map<std::string, Reload::Setting>> Reload::posted;
+
+bool Reload::Reloadable(const std::string & name) {
+    // where the collector is, how connections to it are made, how
+    // records are batched and skipped, and how many are traced
+    static const std::set<std::string> reloadable = {
+        "host", "tcpport", "hosts", "connect_timeout", "reconnect_min", "reconnect_max", "dns_ttl",
+        "send_buffer", "nagle", "keepalive", "user_timeout", "congestion_control",
+        "buffer_size", "buffer_records", "buffer_latency", "backlog_size",
+        "target_latency", "sample_rate", "max_records_per_sec", "trace_every",
+    };
+
+    return reloadable.count(name) > 0;
+}
+
+void Reload::Post(const std::string & path, const std::map<std::string, std::string> & settings) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    generation++;
+
+    for (const auto & setting : settings)
+        posted[path][setting.first] = Setting{generation, setting.second};
+}
+
+uint64_t Reload::Take(const std::string & path, uint64_t since, std::map<std::string, std::string> & settings) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    // whichever was posted last of the settings for all writers and those
+    // for the path
+    std::map<std::string, const Setting *> latest;
+
+    for (const std::string & key : {std::string(), path}) {
+        std::map<std::string, std::map<std::string, Setting>>::const_iterator it = posted.find(key);
+        if (it == posted.end())
+            continue;
+
+        for (const auto & setting : it->second) {
+            const Setting *& last = latest[setting.first];
+            if (setting.second.generation > since && (last == nullptr || setting.second.generation > last->generation))
+                last = &setting.second;
+        }
+    }
+
+    for (const auto & setting : latest) {
+        if (setting.second != nullptr)
+            settings[setting.first] = setting.second->value;
+    }
+
+    return generation;
+}
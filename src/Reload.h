@@ -0,0 +1,48 @@
+// See the file "COPYING" for copyright.
+//
+// Settings changed at run time through LogTCP::reconfigure
+//
+// The main thread posts changed settings, for the writers of one path or
+// for all of them, and every writer takes what was posted since it last
+// looked on its heartbeats. Writers started later begin with everything
+// posted so far, ahead of their filter's config.
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace logging {
+namespace writer {
+
+class Reload {
+
+public:
+    // whether the setting can be changed while writers run
+    static bool Reloadable(const std::string & name);
+
+    // post settings for the writers of path, or all writers for an empty
+    // path
+    static void Post(const std::string & path, const std::map<std::string, std::string> & settings);
+
+    // add the settings posted for path after generation since to
+    // settings, returning the generation to pass next time
+    static uint64_t Take(const std::string & path, uint64_t since, std::map<std::string, std::string> & settings);
+
+private:
+    struct Setting {
+        uint64_t generation;
+        std::string value;
+    };
+
+    static std::mutex lock;
+    static uint64_t generation;
+
+    // latest value of every setting posted, by path and name
+    static std::map<std::string, std::map<std::string, Setting>> posted;
+};
+
+}
+}
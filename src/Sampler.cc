@@ -0,0 +1,152 @@
+// See the file "COPYING" for copyright.
+//
+// Sampling and rate limiting of records before they are formatted
+
+#include <algorithm>
+#include <cstring>
+
+#include "Sampler.h"
+
+using namespace logging;
+using namespace writer;
+
+static uint64_t Mix(uint64_t hash) {
+    // splitmix64 finalizer, spreading fnv's weak high bits
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+
+    return hash;
+}
+
+static uint64_t FNV(uint64_t hash, const void * data, size_t len) {
+    const unsigned char * bytes = (const unsigned char *)data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+Sampler::Sampler() : sampling(false), threshold(0), field(-1), sequence(0), limit(0), budget(0), time(0) {}
+
+void Sampler::SetRate(double rate, int field) {
+    // the rate is compared with hashes as a fraction of 2^64
+    sampling = rate < 1;
+    threshold = rate > 0 ? rate * 18446744073709551616.0 : 0;
+    this->field = field;
+}
+
+void Sampler::SetLimit(uint64_t limit) {
+    this->limit = limit;
+    budget = limit;
+    time = 0;
+}
+
+uint64_t Sampler::Hash(const void * data, size_t len) {
+    return Mix(FNV(0xcbf29ce484222325ULL, data, len));
+}
+
+uint64_t Sampler::Hash(const threading::Value * val) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    // unset values all hash alike
+    if (!val->present)
+        return Mix(hash);
+
+    switch (val->type) {
+    case TYPE_BOOL:
+    case TYPE_INT:
+        hash = FNV(hash, &val->val.int_val, sizeof(val->val.int_val));
+        break;
+
+    case TYPE_COUNT:
+    case TYPE_COUNTER:
+        hash = FNV(hash, &val->val.uint_val, sizeof(val->val.uint_val));
+        break;
+
+    case TYPE_PORT:
+        hash = FNV(hash, &val->val.port_val.port, sizeof(val->val.port_val.port));
+        hash = FNV(hash, &val->val.port_val.proto, sizeof(val->val.port_val.proto));
+        break;
+
+    case TYPE_ADDR:
+        if (val->val.addr_val.family == IPv4)
+            hash = FNV(hash, &val->val.addr_val.in.in4, sizeof(val->val.addr_val.in.in4));
+        else
+            hash = FNV(hash, &val->val.addr_val.in.in6, sizeof(val->val.addr_val.in.in6));
+        break;
+
+    case TYPE_SUBNET:
+        if (val->val.subnet_val.prefix.family == IPv4)
+            hash = FNV(hash, &val->val.subnet_val.prefix.in.in4, sizeof(val->val.subnet_val.prefix.in.in4));
+        else
+            hash = FNV(hash, &val->val.subnet_val.prefix.in.in6, sizeof(val->val.subnet_val.prefix.in.in6));
+        hash = FNV(hash, &val->val.subnet_val.length, sizeof(val->val.subnet_val.length));
+        break;
+
+    case TYPE_DOUBLE:
+    case TYPE_TIME:
+    case TYPE_INTERVAL:
+        hash = FNV(hash, &val->val.double_val, sizeof(val->val.double_val));
+        break;
+
+    case TYPE_STRING:
+    case TYPE_ENUM:
+    case TYPE_FILE:
+    case TYPE_FUNC:
+        hash = FNV(hash, val->val.string_val.data, val->val.string_val.length);
+        break;
+
+    case TYPE_PATTERN:
+        hash = FNV(hash, val->val.pattern_text_val, strlen(val->val.pattern_text_val));
+        break;
+
+    case TYPE_TABLE:
+        for (bro_int_t i = 0; i < val->val.set_val.size; i++) {
+            uint64_t element = Hash(val->val.set_val.vals[i]);
+            hash = FNV(hash, &element, sizeof(element));
+        }
+        break;
+
+    case TYPE_VECTOR:
+        for (bro_int_t i = 0; i < val->val.vector_val.size; i++) {
+            uint64_t element = Hash(val->val.vector_val.vals[i]);
+            hash = FNV(hash, &element, sizeof(element));
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return Mix(hash);
+}
+
+Sampler::Verdict Sampler::Check(threading::Value ** vals, double now) {
+    if (sampling) {
+        uint64_t hash = field >= 0 ? Hash(vals[field]) : Mix(++sequence);
+
+        if (hash >= threshold)
+            return SAMPLED;
+    }
+
+    if (limit > 0) {
+        // refill for the time passed, holding at most a second's worth
+        if (time > 0)
+            budget = std::min(budget + (now - time) * limit, (double)limit);
+
+        time = now;
+
+        if (budget < 1)
+            return LIMITED;
+
+        budget -= 1;
+    }
+
+    return KEEP;
+}
@@ -0,0 +1,58 @@
+// See the file "COPYING" for copyright.
+//
+// Sampling and rate limiting of records before they are formatted
+//
+// Sampling keeps a record when the hash of one of its fields falls below
+// the sample rate, so records sharing a value (a connection's uid, say)
+// are kept or skipped together. Without a field every nth record by hash
+// of its number is kept. The rate limit is a token bucket holding one
+// second of records.
+
+#pragma once
+
+#include <cstdint>
+
+#include "threading/SerialTypes.h"
+
+namespace logging {
+namespace writer {
+
+class Sampler {
+
+public:
+    enum Verdict {
+        KEEP,
+        SAMPLED,
+        LIMITED,
+    };
+
+    Sampler();
+
+    // keep the given fraction of records, by the value of field or -1 for
+    // none
+    void SetRate(double rate, int field);
+    int Field() const { return field; }
+
+    // keep at most limit records per second, 0 for no limit
+    void SetLimit(uint64_t limit);
+
+    Verdict Check(threading::Value ** vals, double now);
+
+    // the hash records are sampled by, of plain bytes
+    static uint64_t Hash(const void * data, size_t len);
+
+private:
+    static uint64_t Hash(const threading::Value * val);
+
+    bool sampling;
+    uint64_t threshold;
+    int field;
+    uint64_t sequence;
+
+    uint64_t limit;
+    double budget;
+    double time;
+};
+
+}
+}
@@ -0,0 +1,302 @@
+// See the file "COPYING" for copyright.
+//
+// Disk spool of batches the TCP writer could not keep in memory
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "Spool.h"
+
+using namespace logging;
+using namespace writer;
+
+static const char MAGIC[8] = {'Z', 'T', 'C', 'P', 'S', 'P', 'L', '1'};
+
+Spool::Spool(const std::string & dir, const std::string & name, size_t segment_size, size_t max_segments) : dir(dir), name(name), segment_size(segment_size), max_segments(max_segments), next_sequence(0), bytes(0), records(0) {}
+
+Spool::~Spool() {
+    // whatever is left stays on disk for the next run
+    for (Segment & segment : segments) {
+        if (segment.writable)
+            Finish(segment);
+
+        munmap(segment.map, segment.size);
+        close(segment.fd);
+    }
+}
+
+bool Spool::Fail(const std::string & msg) {
+    error = msg + ": " + strerror(errno);
+    return false;
+}
+
+bool Spool::Open() {
+    DIR * d = opendir(dir.c_str());
+    if (d == nullptr)
+        return Fail("Error opening spool directory " + dir);
+
+    // segments of this spool in the order they were written
+    std::map<uint64_t, std::string> found;
+    std::string prefix = name + "-";
+    std::string suffix = ".spool";
+
+    while (struct dirent * entry = readdir(d)) {
+        std::string file = entry->d_name;
+
+        if (file.size() <= prefix.size() + suffix.size() || file.compare(0, prefix.size(), prefix) != 0 || file.compare(file.size() - suffix.size(), suffix.size(), suffix) != 0)
+            continue;
+
+        std::string sequence = file.substr(prefix.size(), file.size() - prefix.size() - suffix.size());
+        if (sequence.find_first_not_of("0123456789") != std::string::npos)
+            continue;
+
+        found[std::stoull(sequence)] = dir + "/" + file;
+    }
+
+    closedir(d);
+
+    for (const std::pair<const uint64_t, std::string> & segment : found) {
+        next_sequence = segment.first + 1;
+
+        if (!Load(segment.second))
+            return false;
+    }
+
+    return true;
+}
+
+bool Spool::Load(const std::string & path) {
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0)
+        return Fail("Error opening spool segment " + path);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return Fail("Error reading spool segment " + path);
+    }
+
+    size_t size = st.st_size;
+    char * map = size >= HEADER_SIZE ? (char *)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : (char *)MAP_FAILED;
+
+    if (map == MAP_FAILED || memcmp(map, MAGIC, sizeof(MAGIC)) != 0) {
+        // not a segment, or cut short before its header was written
+        if (map != MAP_FAILED)
+            munmap(map, size);
+
+        close(fd);
+        unlink(path.c_str());
+        return true;
+    }
+
+    Segment segment{path, fd, map, size, HEADER_SIZE, HEADER_SIZE, 0, 0, false};
+
+    // count entries from where replay stopped up to where the last run
+    // stopped writing or the data is cut
+    size_t end = std::min((size_t)End(segment), size);
+    size_t offset = std::max((size_t)Read(segment), HEADER_SIZE);
+
+    segment.read = offset;
+
+    while (offset + ENTRY_SIZE <= end) {
+        uint32_t len = *(uint32_t *)(map + offset);
+        if (offset + ENTRY_SIZE + len > end)
+            break;
+
+        segment.records += *(uint32_t *)(map + offset + 4);
+        segment.bytes += len;
+        offset += ENTRY_SIZE + len;
+    }
+
+    if (segment.records == 0) {
+        munmap(map, size);
+        close(fd);
+        unlink(path.c_str());
+        return true;
+    }
+
+    // entries are only read up to the real end
+    segment.end = offset;
+
+    records += segment.records;
+    bytes += segment.bytes;
+    segments.push_back(segment);
+
+    return true;
+}
+
+bool Spool::Create(size_t size) {
+    std::string path = dir + "/" + name + "-" + std::to_string(next_sequence++) + ".spool";
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return Fail("Error creating spool segment " + path);
+
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        unlink(path.c_str());
+        return Fail("Error sizing spool segment " + path);
+    }
+
+    char * map = (char *)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        unlink(path.c_str());
+        return Fail("Error mapping spool segment " + path);
+    }
+
+    Segment segment{path, fd, map, size, HEADER_SIZE, HEADER_SIZE, 0, 0, true};
+
+    memcpy(map, MAGIC, sizeof(MAGIC));
+    End(segment) = HEADER_SIZE;
+    Read(segment) = HEADER_SIZE;
+
+    segments.push_back(segment);
+
+    return true;
+}
+
+void Spool::Finish(Segment & segment) {
+    // give back the space the segment did not use and get it to disk
+    size_t end = segment.end;
+
+    msync(segment.map, end, MS_ASYNC);
+    segment.writable = false;
+
+    // keep reading through the full mapping if it cannot be replaced
+    char * map = (char *)mmap(nullptr, end, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+    if (map == MAP_FAILED)
+        return;
+
+    munmap(segment.map, segment.size);
+    segment.map = map;
+    segment.size = end;
+
+    // failing this only costs disk space until the segment is replayed
+    if (ftruncate(segment.fd, end) < 0)
+        error = std::string("Error truncating spool segment ") + segment.path + ": " + strerror(errno);
+}
+
+void Spool::Remove() {
+    Segment & segment = segments.front();
+
+    records -= segment.records;
+    bytes -= segment.bytes;
+
+    munmap(segment.map, segment.size);
+    close(segment.fd);
+    unlink(segment.path.c_str());
+
+    segments.pop_front();
+}
+
+bool Spool::Append(const char * data, size_t len, size_t records, bool drop_newest, size_t & dropped) {
+    size_t need = ENTRY_SIZE + len;
+    Segment * segment = segments.empty() || !segments.back().writable ? nullptr : &segments.back();
+
+    dropped = 0;
+
+    if (segment != nullptr && segment->end + need > segment->size) {
+        Finish(*segment);
+        segment = nullptr;
+    }
+
+    if (segment == nullptr) {
+        // make room for a new segment
+        while (max_segments > 0 && segments.size() >= max_segments) {
+            if (drop_newest) {
+                dropped = records;
+                return true;
+            }
+
+            dropped += segments.front().records;
+            Remove();
+        }
+
+        // batches larger than a segment get one of their own
+        if (!Create(std::max(segment_size, HEADER_SIZE + need)))
+            return false;
+
+        segment = &segments.back();
+    }
+
+    char * entry = segment->map + segment->end;
+    uint32_t entry_len = len;
+    uint32_t entry_records = records;
+
+    memcpy(entry, &entry_len, sizeof(entry_len));
+    memcpy(entry + 4, &entry_records, sizeof(entry_records));
+    memcpy(entry + ENTRY_SIZE, data, len);
+
+    // the end moves last so a crash never exposes a partial entry
+    segment->end += need;
+    End(*segment) = segment->end;
+
+    segment->records += records;
+    segment->bytes += len;
+    this->records += records;
+    bytes += len;
+
+    return true;
+}
+
+bool Spool::Front(const char *& data, size_t & len, size_t & records) {
+    if (segments.empty())
+        return false;
+
+    Segment & segment = segments.front();
+
+    len = *(uint32_t *)(segment.map + segment.read);
+    records = *(uint32_t *)(segment.map + segment.read + 4);
+    data = segment.map + segment.read + ENTRY_SIZE;
+
+    return true;
+}
+
+void Spool::Pop() {
+    if (segments.empty())
+        return;
+
+    Segment & segment = segments.front();
+
+    uint32_t len = *(uint32_t *)(segment.map + segment.read);
+    uint32_t entry_records = *(uint32_t *)(segment.map + segment.read + 4);
+
+    segment.read += ENTRY_SIZE + len;
+    Read(segment) = segment.read;
+    segment.records -= entry_records;
+    segment.bytes -= len;
+    records -= entry_records;
+    bytes -= len;
+
+    // segments are truncated away once replayed
+    if (segment.read >= segment.end)
+        Remove();
+}
+
+void Spool::Rotate() {
+    if (segments.empty() || !segments.back().writable)
+        return;
+
+    Segment & segment = segments.back();
+
+    if (segment.records > 0) {
+        Finish(segment);
+        return;
+    }
+
+    munmap(segment.map, segment.size);
+    close(segment.fd);
+    unlink(segment.path.c_str());
+
+    segments.pop_back();
+}
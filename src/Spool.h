@@ -0,0 +1,86 @@
+// See the file "COPYING" for copyright.
+//
+// Disk spool of batches the TCP writer could not keep in memory
+//
+// Batches are appended to memory-mapped segment files of a fixed size in
+// the spool directory, named <name>-<sequence>.spool. A segment starts
+// with an 8 byte magic, the 64 bit offset its entries end at and the 64
+// bit offset replay got to, followed by entries of a 32 bit length, a 32
+// bit record count and the data, all in host byte order. Segments left
+// behind by an earlier run are picked up again where replay stopped, and
+// removed once everything in them was taken.
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+
+namespace logging {
+namespace writer {
+
+class Spool {
+
+public:
+    Spool(const std::string & dir, const std::string & name, size_t segment_size, size_t max_segments);
+    ~Spool();
+
+    // load the segments of an earlier run
+    bool Open();
+
+    // append a batch, making room by dropping the oldest segment or the
+    // batch itself once max_segments are in use
+    bool Append(const char * data, size_t len, size_t records, bool drop_newest, size_t & dropped);
+
+    bool Empty() const { return segments.empty(); }
+    uint64_t Bytes() const { return bytes; }
+    uint64_t Records() const { return records; }
+
+    // the oldest batch, valid until the next call changing the spool
+    bool Front(const char *& data, size_t & len, size_t & records);
+    void Pop();
+
+    // start a new segment with the next batch
+    void Rotate();
+
+    const std::string & LastError() const { return error; }
+
+private:
+    struct Segment {
+        std::string path;
+        int fd;
+        char * map;
+        size_t size;
+        size_t end;
+        size_t read;
+        size_t records;
+        uint64_t bytes;
+        bool writable;
+    };
+
+    static constexpr size_t HEADER_SIZE = 24;
+    static constexpr size_t ENTRY_SIZE = 8;
+
+    bool Fail(const std::string & msg);
+    bool Create(size_t size);
+    bool Load(const std::string & path);
+    void Finish(Segment & segment);
+    void Remove();
+    uint64_t & End(Segment & segment) { return *(uint64_t *)(segment.map + 8); }
+    uint64_t & Read(Segment & segment) { return *(uint64_t *)(segment.map + 16); }
+
+    std::string dir;
+    std::string name;
+    size_t segment_size;
+    size_t max_segments;
+
+    std::deque<Segment> segments;
+    uint64_t next_sequence;
+    uint64_t bytes;
+    uint64_t records;
+
+    std::string error;
+};
+
+}
+}
@@ -0,0 +1,87 @@
+// See the file "COPYING" for copyright.
+//
+// Counters published by the TCP writers for LogTCP::stats
+
+#include "Stats.h"
+
+using namespace logging;
+using namespace writer;
+
+std::mutex Stats::registry_lock;
+std::set<Stats *> Stats::registry;
+
+Histogram::Histogram() : total(0), max(0) {
+    for (std::atomic<uint64_t> & count : counts)
+        count.store(0, std::memory_order_relaxed);
+}
+
+int Histogram::Bucket(uint64_t ns) {
+    // values below SUB_BUCKETS are exact, above that the top SUB_BITS
+    // bits after the leading one pick the bucket within its power of two
+    if (ns < SUB_BUCKETS)
+        return ns;
+
+    int magnitude = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (magnitude - SUB_BITS)) & (SUB_BUCKETS - 1);
+
+    return (magnitude - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+uint64_t Histogram::Lowest(int bucket) {
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    int magnitude = bucket / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = bucket % SUB_BUCKETS;
+
+    return (SUB_BUCKETS + sub) << (magnitude - SUB_BITS);
+}
+
+void Histogram::Record(double seconds) {
+    uint64_t ns = seconds > 0 ? seconds * 1e9 : 0;
+
+    counts[Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+
+    // only the writer's own thread records
+    if (ns > max.load(std::memory_order_relaxed))
+        max.store(ns, std::memory_order_relaxed);
+}
+
+double Histogram::Percentile(double fraction) const {
+    uint64_t samples = total.load(std::memory_order_relaxed);
+    if (samples == 0)
+        return 0;
+
+    uint64_t wanted = fraction * samples;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen > wanted)
+            return Lowest(i) / 1e9;
+    }
+
+    return Max();
+}
+
+double Histogram::Max() const {
+    return max.load(std::memory_order_relaxed) / 1e9;
+}
+
+Stats::Stats(const std::string & path) : path(path), records(0), bytes(0), batches(0), dropped(0), reconnects(0), spooled(0), acked(0), sampled(0), limited(0), backlog_bytes(0), backlog_records(0), spool_bytes(0), window_bytes(0), batch_records(0), batch_bytes(0), traced(0), trace_lost(0) {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    registry.insert(this);
+}
+
+Stats::~Stats() {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    registry.erase(this);
+}
+
+void Stats::ForEach(const std::function<void(const Stats &)> & visit) {
+    std::lock_guard<std::mutex> guard(registry_lock);
+
+    for (const Stats * stats : registry)
+        visit(*stats);
+}
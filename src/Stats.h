@@ -0,0 +1,101 @@
+// See the file "COPYING" for copyright.
+//
+// Counters published by the TCP writers for LogTCP::stats
+//
+// Writer threads keep their own plain counters and copy them here on
+// heartbeats, so the main thread only ever reads relaxed atomics. Latency
+// histograms are recorded into directly.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+
+namespace logging {
+namespace writer {
+
+// log-linear histogram in the style of HdrHistogram, with 16 buckets per
+// power of two of nanoseconds for about 6% precision
+class Histogram {
+
+public:
+    Histogram();
+
+    void Record(double seconds);
+
+    // seconds below which the given fraction of the samples fall
+    double Percentile(double fraction) const;
+    double Max() const;
+
+private:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    static int Bucket(uint64_t ns);
+    static uint64_t Lowest(int bucket);
+
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> max;
+};
+
+class Stats {
+
+public:
+    Stats(const std::string & path);
+    ~Stats();
+
+    const std::string path;
+
+    std::atomic<uint64_t> records;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> batches;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> reconnects;
+    std::atomic<uint64_t> spooled;
+    std::atomic<uint64_t> acked;
+    std::atomic<uint64_t> sampled;
+    std::atomic<uint64_t> limited;
+
+    // depth of what waits to be sent, at the last heartbeat
+    std::atomic<uint64_t> backlog_bytes;
+    std::atomic<uint64_t> backlog_records;
+    std::atomic<uint64_t> spool_bytes;
+    std::atomic<uint64_t> window_bytes;
+
+    // batch size chosen by adaptive batching, in records and about in
+    // bytes, 0 while not adapting
+    std::atomic<uint64_t> batch_records;
+    std::atomic<uint64_t> batch_bytes;
+
+    // time formatting a record and sending a batch
+    Histogram write_latency;
+    Histogram flush_latency;
+
+    // records traced and traced batches lost before reaching the socket,
+    // and the time traced records took to be formatted and to wait for
+    // their batch, and their batches to be written out, acknowledged and
+    // all of that together
+    std::atomic<uint64_t> traced;
+    std::atomic<uint64_t> trace_lost;
+    Histogram trace_format;
+    Histogram trace_batch;
+    Histogram trace_send;
+    Histogram trace_ack;
+    Histogram trace_total;
+
+    // call visit for the stats of every writer while they are locked
+    static void ForEach(const std::function<void(const Stats &)> & visit);
+
+private:
+    static std::mutex registry_lock;
+    static std::set<Stats *> registry;
+};
+
+}
+}
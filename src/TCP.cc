@@ -2,9 +2,17 @@
 //
 // Log writer for writing to TCP
 
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <cinttypes>
 #include <string>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -15,366 +23,2239 @@
 using namespace logging;
 using namespace writer;
 
-TCP::TCP(WriterFrontend * frontend) : WriterBackend(frontend), ssl_init(false), sock(-1), host((const char *)BifConst::LogTCP::host->Bytes(), BifConst::LogTCP::host->Len()), tcpport(BifConst::LogTCP::tcpport), retry(BifConst::LogTCP::retry), tls(BifConst::LogTCP::tls), cert((const char *)BifConst::LogTCP::cert->Bytes(), BifConst::LogTCP::cert->Len()), key((const char *)BifConst::LogTCP::key->Bytes(), BifConst::LogTCP::key->Len()) {}
+TCP::TCP(WriterFrontend * frontend) : WriterBackend(frontend), next_endpoint(0), buffered(true), chained_connects(0), finishing(false), pending_records(0), pending_time(0), dropped_records(0), reported_drops(0), written_records(0), stats(nullptr), reload_generation(0), tracer(new Tracer()), pending_trace(nullptr), sampled_records(0), limited_records(0), sent_num_fields(0), sent_fields(nullptr), pipeline(nullptr), job(nullptr), host((const char *)BifConst::LogTCP::host->Bytes(), BifConst::LogTCP::host->Len()), tcpport(BifConst::LogTCP::tcpport), hosts((const char *)BifConst::LogTCP::hosts->Bytes(), BifConst::LogTCP::hosts->Len()), retry(BifConst::LogTCP::retry), tls(BifConst::LogTCP::tls), cert((const char *)BifConst::LogTCP::cert->Bytes(), BifConst::LogTCP::cert->Len()), key((const char *)BifConst::LogTCP::key->Bytes(), BifConst::LogTCP::key->Len()), buffer_size(BifConst::LogTCP::buffer_size), buffer_records(BifConst::LogTCP::buffer_records), buffer_latency(BifConst::LogTCP::buffer_latency), nonblocking(BifConst::LogTCP::nonblocking), backlog_size(BifConst::LogTCP::backlog_size), backlog_policy(DROP_OLDEST), multiplex(BifConst::LogTCP::multiplex), balance(ROUND_ROBIN), connect_timeout(BifConst::LogTCP::connect_timeout), reconnect_min(BifConst::LogTCP::reconnect_min), reconnect_max(BifConst::LogTCP::reconnect_max), dns_ttl(BifConst::LogTCP::dns_ttl), compression_level(-1), format(FORMAT_JSON), ktls(BifConst::LogTCP::ktls), spool_dir((const char *)BifConst::LogTCP::spool_dir->Bytes(), BifConst::LogTCP::spool_dir->Len()), spool_segment_size(BifConst::LogTCP::spool_segment_size), spool_max_segments(BifConst::LogTCP::spool_max_segments), spool_rate(BifConst::LogTCP::spool_rate), acks(BifConst::LogTCP::acks), ack_window(BifConst::LogTCP::ack_window), sample_rate(BifConst::LogTCP::sample_rate), sample_field((const char *)BifConst::LogTCP::sample_field->Bytes(), BifConst::LogTCP::sample_field->Len()), max_records_per_sec(BifConst::LogTCP::max_records_per_sec), include_fields((const char *)BifConst::LogTCP::fields->Bytes(), BifConst::LogTCP::fields->Len()), exclude_fields((const char *)BifConst::LogTCP::exclude_fields->Bytes(), BifConst::LogTCP::exclude_fields->Len()), format_threads(BifConst::LogTCP::format_threads), format_batch(BifConst::LogTCP::format_batch), transport(Connection::TRANSPORT_TCP), datagram_size(BifConst::LogTCP::datagram_size), adaptive_batching(BifConst::LogTCP::adaptive_batching), target_latency(BifConst::LogTCP::target_latency), priority(1), priority_scheduling(Destination::STRICT), priority_connections(BifConst::LogTCP::priority_connections), send_buffer(BifConst::LogTCP::send_buffer), nagle(Connection::NAGLE_AUTO), keepalive(BifConst::LogTCP::keepalive), user_timeout(BifConst::LogTCP::user_timeout), congestion_control((const char *)BifConst::LogTCP::congestion_control->Bytes(), BifConst::LogTCP::congestion_control->Len()), io_uring(BifConst::LogTCP::io_uring), dictionary_fields((const char *)BifConst::LogTCP::dictionary_fields->Bytes(), BifConst::LogTCP::dictionary_fields->Len()), dictionary_size(BifConst::LogTCP::dictionary_size), delta_fields((const char *)BifConst::LogTCP::delta_fields->Bytes(), BifConst::LogTCP::delta_fields->Len()), trace_every(BifConst::LogTCP::trace_every) {}
 
 TCP::~TCP() {
-    if (ssl_init) {
-        // cleanup global tls
-        ERR_free_strings();
-        EVP_cleanup();
+    delete stats;
+
+    // batches still out hand their traces back to it
+    tracer->Release();
+}
+
+std::string TCP::GetConfigValue(const WriterInfo & info, const std::string name) const {
+    // settings changed at run time win over the filter's
+    std::map<std::string, std::string>::const_iterator changed = reloaded.find(name);
+    if (changed != reloaded.end())
+        return changed->second;
+
+    // find config value and return it or an empty string
+    std::map<const char *, const char *>::const_iterator it = info.config.find(name.c_str());
+    if (it == info.config.end())
+        return std::string();
+    else
+        return it->second;
+}
+
+static std::string JSONEscape(const std::string & str) {
+    // escape a string for use inside json quotes
+    std::string escaped;
+
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if ((unsigned char)c < 0x20) {
+            char hex[7];
+            snprintf(hex, sizeof(hex), "\\u%04x", (unsigned char)c);
+            escaped += hex;
+        }
+        else {
+            escaped += c;
+        }
+    }
+
+    return escaped;
+}
+
+static std::string AckSession() {
+    // random so the collector can tell a restarted writer from retransmits
+    std::random_device random;
+    char session[17];
+
+    snprintf(session, sizeof(session), "%08x%08x", random(), random());
+    return session;
+}
+
+static std::string SpoolName(const std::string & path, const std::string & host, int port) {
+    // one spool per stream and collector, safe for use as a file name
+    std::string name = path + "-" + host + "-" + std::to_string(port);
+
+    for (char & c : name) {
+        if (!isalnum((unsigned char)c) && c != '.' && c != '_' && c != '-')
+            c = '_';
+    }
+
+    return name;
+}
+
+static bool ParsePort(const std::string & value, int & port) {
+    try {
+        size_t used = 0;
+        port = stoi(value, &used);
+        return used == value.size() && port > 0 && port < 65536;
+    }
+    catch (const std::exception &) {
+        return false;
+    }
+}
+
+static size_t ParseSize(const std::string & value) {
+    // stoul wraps negative numbers around instead of rejecting them
+    size_t start = value.find_first_not_of(" \t\n\v\f\r");
+    if (start != std::string::npos && value[start] == '-')
+        throw std::invalid_argument(value);
+
+    return stoul(value);
+}
+
+static bool ParseHosts(const std::string & hosts, int default_port, std::vector<std::pair<std::string, int>> & parsed) {
+    // comma separated host:port entries, with [] around ipv6 addresses
+    size_t start = 0;
+
+    while (start < hosts.size()) {
+        size_t end = hosts.find(',', start);
+        if (end == std::string::npos)
+            end = hosts.size();
+
+        std::string entry = hosts.substr(start, end - start);
+        start = end + 1;
+
+        entry.erase(0, entry.find_first_not_of(" \t"));
+        entry.erase(entry.find_last_not_of(" \t") + 1);
+
+        if (entry.empty())
+            continue;
+
+        std::string host = entry;
+        int port = default_port;
+
+        size_t colon = entry.rfind(':');
+        if (entry[0] == '[') {
+            size_t bracket = entry.find(']');
+            if (bracket == std::string::npos)
+                return false;
+
+            host = entry.substr(1, bracket - 1);
+
+            if (bracket + 1 < entry.size()) {
+                if (entry[bracket + 1] != ':')
+                    return false;
+
+                if (!ParsePort(entry.substr(bracket + 2), port))
+                    return false;
+            }
+        }
+        else if (colon != std::string::npos) {
+            host = entry.substr(0, colon);
+            if (!ParsePort(entry.substr(colon + 1), port))
+                return false;
+        }
+
+        parsed.push_back(std::make_pair(host, port));
+    }
+
+    return true;
+}
+
+static bool ParseNagle(const std::string & mode, Connection::Nagle & nagle) {
+    if (mode == "auto")
+        nagle = Connection::NAGLE_AUTO;
+    else if (mode == "on")
+        nagle = Connection::NAGLE_ON;
+    else if (mode == "off")
+        nagle = Connection::NAGLE_OFF;
+    else if (mode == "cork")
+        nagle = Connection::NAGLE_CORK;
+    else
+        return false;
+
+    return true;
+}
+
+static std::string Changed(const std::map<std::string, std::string> & changes, const char * name) {
+    // a setting changed at run time, or an empty string
+    std::map<std::string, std::string>::const_iterator it = changes.find(name);
+    return it == changes.end() ? std::string() : it->second;
+}
+
+static std::set<std::string> ParseList(const std::string & list) {
+    // comma separated names
+    std::set<std::string> parsed;
+    size_t start = 0;
+
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+
+        std::string entry = list.substr(start, end - start);
+        start = end + 1;
+
+        entry.erase(0, entry.find_first_not_of(" \t"));
+        entry.erase(entry.find_last_not_of(" \t") + 1);
+
+        if (!entry.empty())
+            parsed.insert(entry);
     }
+
+    return parsed;
+}
+
+static bool MatchesField(const std::set<std::string> & names, const std::string & field) {
+    // a name matches the field or, as with "id", the record it is part of
+    for (size_t dot = field.find('.'); dot != std::string::npos; dot = field.find('.', dot + 1)) {
+        if (names.count(field.substr(0, dot)))
+            return true;
+    }
+
+    return names.count(field) > 0;
+}
+
+// separators written like the ascii writer's defaults
+static const char * TSV_SEPARATOR = "\t";
+static const char * TSV_SET_SEPARATOR = ",";
+static const char * TSV_EMPTY_FIELD = "(empty)";
+static const char * TSV_UNSET_FIELD = "-";
+
+static std::string TSVHeader(const std::string & path, int num_fields, const threading::Field * const * fields) {
+    // header lines as the ascii writer writes them at the top of a log
+    std::string header;
+
+    header += "#separator \\x09\n";
+    header += std::string("#set_separator") + TSV_SEPARATOR + TSV_SET_SEPARATOR + "\n";
+    header += std::string("#empty_field") + TSV_SEPARATOR + TSV_EMPTY_FIELD + "\n";
+    header += std::string("#unset_field") + TSV_SEPARATOR + TSV_UNSET_FIELD + "\n";
+    header += std::string("#path") + TSV_SEPARATOR + path + "\n";
+
+    std::string names = "#fields";
+    std::string types = "#types";
+
+    for (int i = 0; i < num_fields; i++) {
+        names += std::string(TSV_SEPARATOR) + fields[i]->name;
+        types += std::string(TSV_SEPARATOR) + fields[i]->TypeName();
+    }
+
+    header += names + "\n" + types + "\n";
+
+    return header;
+}
+
+static double Now() {
+    // monotonic time in seconds for buffer latency tracking
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-std::string TCP::GetConfigValue(const WriterInfo & info, const std::string name) const {
-    // find config value and return it or an empty string
-    std::map<const char *, const char *>::const_iterator it = info.config.find(name.c_str());
-    if (it == info.config.end())
-        return std::string();
-    else
-        return it->second;
+bool TCP::DoLoad(Endpoint & endpoint) {
+    if (endpoint.conn->Connect())
+        return true;
+
+    // keep going and reconnect from heartbeats when retrying or when
+    // other endpoints can take over
+    if ((retry || endpoints.size() > 1) && endpoint.conn->Unreachable()) {
+        Warning(endpoint.conn->LastError().c_str());
+        return true;
+    }
+
+    Error(endpoint.conn->LastError().c_str());
+    return false;
+}
+
+bool TCP::DoInit(const WriterInfo & info, int num_fields, const threading::Field * const * fields) {
+    // a writer that fails to start gets no DoFinish, so whatever was set
+    // up until then is freed here
+    if (Setup(info, num_fields, fields))
+        return true;
+
+    Teardown();
+    return false;
+}
+
+bool TCP::Setup(const WriterInfo & info, int num_fields, const threading::Field * const * fields) {
+    stats = new Stats(info.path);
+
+    // a stream spread over several writers gives each a path ending in
+    // "~<shard>", kept for its stats and spool but not sent
+    stream_path = info.path;
+    if (!GetConfigValue(info, "shards").empty() && stream_path.rfind('~') != std::string::npos)
+        stream_path.erase(stream_path.rfind('~'));
+
+    // start out with what was changed at run time before this writer
+    reload_generation = Reload::Take(stream_path, 0, reloaded);
+
+    // get configuration value
+    std::string cfg_host = GetConfigValue(info, "host");
+    std::string cfg_tcpport = GetConfigValue(info, "tcpport");
+    std::string cfg_hosts = GetConfigValue(info, "hosts");
+    std::string cfg_retry = GetConfigValue(info, "retry");
+    std::string cfg_tls = GetConfigValue(info, "tls");
+    std::string cfg_cert = GetConfigValue(info, "cert");
+    std::string cfg_key = GetConfigValue(info, "key");
+    std::string cfg_buffer_size = GetConfigValue(info, "buffer_size");
+    std::string cfg_buffer_records = GetConfigValue(info, "buffer_records");
+    std::string cfg_buffer_latency = GetConfigValue(info, "buffer_latency");
+    std::string cfg_nonblocking = GetConfigValue(info, "nonblocking");
+    std::string cfg_backlog_size = GetConfigValue(info, "backlog_size");
+    std::string cfg_backlog_policy = GetConfigValue(info, "backlog_policy");
+    std::string cfg_multiplex = GetConfigValue(info, "multiplex");
+    std::string cfg_balance = GetConfigValue(info, "balance");
+    std::string cfg_connect_timeout = GetConfigValue(info, "connect_timeout");
+    std::string cfg_reconnect_min = GetConfigValue(info, "reconnect_min");
+    std::string cfg_reconnect_max = GetConfigValue(info, "reconnect_max");
+    std::string cfg_dns_ttl = GetConfigValue(info, "dns_ttl");
+    std::string cfg_compression = GetConfigValue(info, "compression");
+    std::string cfg_format = GetConfigValue(info, "format");
+    std::string cfg_json_timestamps = GetConfigValue(info, "json_timestamps");
+    std::string cfg_ktls = GetConfigValue(info, "ktls");
+    std::string cfg_spool_dir = GetConfigValue(info, "spool_dir");
+    std::string cfg_spool_segment_size = GetConfigValue(info, "spool_segment_size");
+    std::string cfg_spool_max_segments = GetConfigValue(info, "spool_max_segments");
+    std::string cfg_spool_rate = GetConfigValue(info, "spool_rate");
+    std::string cfg_acks = GetConfigValue(info, "acks");
+    std::string cfg_ack_window = GetConfigValue(info, "ack_window");
+    std::string cfg_sample_rate = GetConfigValue(info, "sample_rate");
+    std::string cfg_sample_field = GetConfigValue(info, "sample_field");
+    std::string cfg_max_records_per_sec = GetConfigValue(info, "max_records_per_sec");
+    std::string cfg_fields = GetConfigValue(info, "fields");
+    std::string cfg_exclude_fields = GetConfigValue(info, "exclude_fields");
+    std::string cfg_format_threads = GetConfigValue(info, "format_threads");
+    std::string cfg_format_batch = GetConfigValue(info, "format_batch");
+    std::string cfg_transport = GetConfigValue(info, "transport");
+    std::string cfg_datagram_size = GetConfigValue(info, "datagram_size");
+    std::string cfg_adaptive_batching = GetConfigValue(info, "adaptive_batching");
+    std::string cfg_target_latency = GetConfigValue(info, "target_latency");
+    std::string cfg_priority = GetConfigValue(info, "priority");
+    std::string cfg_priority_scheduling = GetConfigValue(info, "priority_scheduling");
+    std::string cfg_priority_connections = GetConfigValue(info, "priority_connections");
+    std::string cfg_send_buffer = GetConfigValue(info, "send_buffer");
+    std::string cfg_nagle = GetConfigValue(info, "nagle");
+    std::string cfg_keepalive = GetConfigValue(info, "keepalive");
+    std::string cfg_user_timeout = GetConfigValue(info, "user_timeout");
+    std::string cfg_congestion_control = GetConfigValue(info, "congestion_control");
+    std::string cfg_sender_cpus = GetConfigValue(info, "sender_cpus");
+    std::string cfg_format_cpus = GetConfigValue(info, "format_cpus");
+    std::string cfg_io_uring = GetConfigValue(info, "io_uring");
+    std::string cfg_dictionary_fields = GetConfigValue(info, "dictionary_fields");
+    std::string cfg_dictionary_size = GetConfigValue(info, "dictionary_size");
+    std::string cfg_delta_fields = GetConfigValue(info, "delta_fields");
+    std::string cfg_trace_every = GetConfigValue(info, "trace_every");
+
+    // fill in non-empty values, a malformed or negative number fails the
+    // writer rather than throwing out of DoInit
+    try {
+        if (!cfg_host.empty())
+            host = cfg_host;
+        if (!cfg_tcpport.empty())
+            tcpport = stoi(cfg_tcpport);
+        if (!cfg_hosts.empty())
+            hosts = cfg_hosts;
+        if (!cfg_retry.empty())
+            retry = cfg_retry == "T";
+        if (!cfg_tls.empty())
+            tls = cfg_tls == "T";
+        if (!cfg_cert.empty())
+            cert = cfg_cert;
+        if (!cfg_key.empty())
+            key = cfg_key;
+        if (!cfg_buffer_size.empty())
+            buffer_size = ParseSize(cfg_buffer_size);
+        if (!cfg_buffer_records.empty())
+            buffer_records = ParseSize(cfg_buffer_records);
+        if (!cfg_buffer_latency.empty())
+            buffer_latency = stod(cfg_buffer_latency);
+        if (!cfg_nonblocking.empty())
+            nonblocking = cfg_nonblocking == "T";
+        if (!cfg_backlog_size.empty())
+            backlog_size = ParseSize(cfg_backlog_size);
+        if (!cfg_multiplex.empty())
+            multiplex = cfg_multiplex == "T";
+        if (!cfg_connect_timeout.empty())
+            connect_timeout = stod(cfg_connect_timeout);
+        if (!cfg_reconnect_min.empty())
+            reconnect_min = stod(cfg_reconnect_min);
+        if (!cfg_reconnect_max.empty())
+            reconnect_max = stod(cfg_reconnect_max);
+        if (!cfg_dns_ttl.empty())
+            dns_ttl = stod(cfg_dns_ttl);
+        if (!cfg_ktls.empty())
+            ktls = cfg_ktls == "T";
+        if (!cfg_spool_dir.empty())
+            spool_dir = cfg_spool_dir;
+        if (!cfg_spool_segment_size.empty())
+            spool_segment_size = ParseSize(cfg_spool_segment_size);
+        if (!cfg_spool_max_segments.empty())
+            spool_max_segments = ParseSize(cfg_spool_max_segments);
+        if (!cfg_spool_rate.empty())
+            spool_rate = ParseSize(cfg_spool_rate);
+        if (!cfg_acks.empty())
+            acks = cfg_acks == "T";
+        if (!cfg_ack_window.empty())
+            ack_window = ParseSize(cfg_ack_window);
+        if (!cfg_sample_rate.empty())
+            sample_rate = stod(cfg_sample_rate);
+        if (!cfg_sample_field.empty())
+            sample_field = cfg_sample_field;
+        if (!cfg_max_records_per_sec.empty())
+            max_records_per_sec = ParseSize(cfg_max_records_per_sec);
+        if (!cfg_fields.empty())
+            include_fields = cfg_fields;
+        if (!cfg_exclude_fields.empty())
+            exclude_fields = cfg_exclude_fields;
+        if (!cfg_format_threads.empty())
+            format_threads = ParseSize(cfg_format_threads);
+        if (!cfg_format_batch.empty())
+            format_batch = ParseSize(cfg_format_batch);
+        if (!cfg_datagram_size.empty())
+            datagram_size = ParseSize(cfg_datagram_size);
+        if (!cfg_adaptive_batching.empty())
+            adaptive_batching = cfg_adaptive_batching == "T";
+        if (!cfg_target_latency.empty())
+            target_latency = stod(cfg_target_latency);
+        if (!cfg_priority_connections.empty())
+            priority_connections = cfg_priority_connections == "T";
+        if (!cfg_send_buffer.empty())
+            send_buffer = ParseSize(cfg_send_buffer);
+        if (!cfg_keepalive.empty())
+            keepalive = stod(cfg_keepalive);
+        if (!cfg_user_timeout.empty())
+            user_timeout = stod(cfg_user_timeout);
+        if (!cfg_congestion_control.empty())
+            congestion_control = cfg_congestion_control;
+        if (!cfg_io_uring.empty())
+            io_uring = cfg_io_uring == "T";
+        if (!cfg_dictionary_fields.empty())
+            dictionary_fields = cfg_dictionary_fields;
+        if (!cfg_dictionary_size.empty())
+            dictionary_size = ParseSize(cfg_dictionary_size);
+        if (!cfg_delta_fields.empty())
+            delta_fields = cfg_delta_fields;
+        if (!cfg_trace_every.empty())
+            trace_every = ParseSize(cfg_trace_every);
+    }
+    catch (const std::exception &) {
+        Error("Invalid number given in config");
+        return false;
+    }
+
+    if (cfg_backlog_policy.empty())
+        cfg_backlog_policy = std::string((const char *)BifConst::LogTCP::backlog_policy->Bytes(), BifConst::LogTCP::backlog_policy->Len());
+    if (cfg_balance.empty())
+        cfg_balance = std::string((const char *)BifConst::LogTCP::balance->Bytes(), BifConst::LogTCP::balance->Len());
+    if (cfg_compression.empty())
+        cfg_compression = std::string((const char *)BifConst::LogTCP::compression->Bytes(), BifConst::LogTCP::compression->Len());
+    if (cfg_format.empty())
+        cfg_format = std::string((const char *)BifConst::LogTCP::format->Bytes(), BifConst::LogTCP::format->Len());
+    if (cfg_json_timestamps.empty())
+        cfg_json_timestamps = std::string((const char *)BifConst::LogTCP::json_timestamps->Bytes(), BifConst::LogTCP::json_timestamps->Len());
+    if (cfg_transport.empty())
+        cfg_transport = std::string((const char *)BifConst::LogTCP::transport->Bytes(), BifConst::LogTCP::transport->Len());
+    if (cfg_priority.empty())
+        cfg_priority = std::string((const char *)BifConst::LogTCP::priority->Bytes(), BifConst::LogTCP::priority->Len());
+    if (cfg_priority_scheduling.empty())
+        cfg_priority_scheduling = std::string((const char *)BifConst::LogTCP::priority_scheduling->Bytes(), BifConst::LogTCP::priority_scheduling->Len());
+    if (cfg_nagle.empty())
+        cfg_nagle = std::string((const char *)BifConst::LogTCP::nagle->Bytes(), BifConst::LogTCP::nagle->Len());
+    if (cfg_sender_cpus.empty())
+        cfg_sender_cpus = std::string((const char *)BifConst::LogTCP::sender_cpus->Bytes(), BifConst::LogTCP::sender_cpus->Len());
+    if (cfg_format_cpus.empty())
+        cfg_format_cpus = std::string((const char *)BifConst::LogTCP::format_cpus->Bytes(), BifConst::LogTCP::format_cpus->Len());
+
+    if (cfg_backlog_policy == "drop_oldest") {
+        backlog_policy = DROP_OLDEST;
+    }
+    else if (cfg_backlog_policy == "drop_newest") {
+        backlog_policy = DROP_NEWEST;
+    }
+    else if (cfg_backlog_policy == "block") {
+        backlog_policy = BLOCK;
+    }
+    else {
+        Error(Fmt("Unknown backlog policy: %s", cfg_backlog_policy.c_str()));
+        return false;
+    }
+
+    if (cfg_balance == "round_robin") {
+        balance = ROUND_ROBIN;
+    }
+    else if (cfg_balance == "least_backlog") {
+        balance = LEAST_BACKLOG;
+    }
+    else {
+        Error(Fmt("Unknown balance mode: %s", cfg_balance.c_str()));
+        return false;
+    }
+
+    if (cfg_format == "json") {
+        format = FORMAT_JSON;
+    }
+    else if (cfg_format == "json_fast") {
+        format = FORMAT_JSON_FAST;
+    }
+    else if (cfg_format == "tsv") {
+        format = FORMAT_TSV;
+    }
+    else if (cfg_format == "binary") {
+        format = FORMAT_BINARY;
+    }
+    else {
+        Error(Fmt("Unknown format: %s", cfg_format.c_str()));
+        return false;
+    }
+
+    if (cfg_transport == "tcp") {
+        transport = Connection::TRANSPORT_TCP;
+    }
+    else if (cfg_transport == "unix") {
+        transport = Connection::TRANSPORT_UNIX;
+    }
+    else if (cfg_transport == "unix_seqpacket") {
+        transport = Connection::TRANSPORT_SEQPACKET;
+    }
+    else if (cfg_transport == "udp") {
+        transport = Connection::TRANSPORT_UDP;
+    }
+    else {
+        Error(Fmt("Unknown transport: %s", cfg_transport.c_str()));
+        return false;
+    }
+
+    if (cfg_priority == "high") {
+        priority = 0;
+    }
+    else if (cfg_priority == "normal") {
+        priority = 1;
+    }
+    else if (cfg_priority == "low") {
+        priority = 2;
+    }
+    else {
+        Error(Fmt("Unknown priority: %s", cfg_priority.c_str()));
+        return false;
+    }
+
+    if (cfg_priority_scheduling == "strict") {
+        priority_scheduling = Destination::STRICT;
+    }
+    else if (cfg_priority_scheduling == "weighted") {
+        priority_scheduling = Destination::WEIGHTED;
+    }
+    else {
+        Error(Fmt("Unknown priority scheduling: %s", cfg_priority_scheduling.c_str()));
+        return false;
+    }
+
+    if (!ParseNagle(cfg_nagle, nagle)) {
+        Error(Fmt("Unknown nagle mode: %s", cfg_nagle.c_str()));
+        return false;
+    }
+
+    if (!cfg_sender_cpus.empty() && !Affinity::Parse(cfg_sender_cpus, sender_cpus)) {
+        Error(Fmt("Invalid sender cpus: %s", cfg_sender_cpus.c_str()));
+        return false;
+    }
+
+    if (!cfg_format_cpus.empty() && !Affinity::Parse(cfg_format_cpus, format_cpus)) {
+        Error(Fmt("Invalid format cpus: %s", cfg_format_cpus.c_str()));
+        return false;
+    }
+
+    threading::formatter::JSON::TimeFormat json_timestamps;
+
+    if (cfg_json_timestamps == "epoch") {
+        json_timestamps = threading::formatter::JSON::TS_EPOCH;
+    }
+    else if (cfg_json_timestamps == "millis") {
+        json_timestamps = threading::formatter::JSON::TS_MILLIS;
+    }
+    else if (cfg_json_timestamps == "iso8601") {
+        json_timestamps = threading::formatter::JSON::TS_ISO8601;
+    }
+    else {
+        Error(Fmt("Unknown json timestamps: %s", cfg_json_timestamps.c_str()));
+        return false;
+    }
+
+    // tsv lines carry nothing to tell the logs on a shared connection apart
+    if (multiplex && format == FORMAT_TSV) {
+        Error("Format tsv cannot be used with multiplex");
+        return false;
+    }
+
+    // shared connections keep their backlog in the sender thread
+    if (multiplex && !spool_dir.empty()) {
+        Error("Spool cannot be used with multiplex");
+        return false;
+    }
+
+    // acknowledgements on a shared connection would need a session per writer
+    if (multiplex && acks) {
+        Error("Acks cannot be used with multiplex");
+        return false;
+    }
+
+    if (sample_rate < 0 || sample_rate > 1) {
+        Error(Fmt("Invalid sample rate: %f", sample_rate));
+        return false;
+    }
+
+    // sample by a field of the record, "id.orig_h" for a nested one
+    int sample_index = -1;
+
+    if (!sample_field.empty()) {
+        for (int i = 0; i < num_fields; i++) {
+            if (sample_field == fields[i]->name)
+                sample_index = i;
+        }
+
+        if (sample_index < 0) {
+            Error(Fmt("Unknown sample field: %s", sample_field.c_str()));
+            return false;
+        }
+    }
+
+    sampler.SetRate(sample_rate, sample_index);
+    sampler.SetLimit(max_records_per_sec);
+    tracer->SetEvery(trace_every);
+
+    if (adaptive_batching) {
+        if (target_latency <= 0) {
+            Error("Target latency must be positive for adaptive batching");
+            return false;
+        }
+
+        // buffer_records, when set, still bounds the batches
+        batcher.SetTarget(target_latency, buffer_records > 0 ? buffer_records : Batcher::MAX_RECORDS);
+    }
+
+    // everything from here on only sees the projected fields
+    if (!include_fields.empty() || !exclude_fields.empty()) {
+        std::set<std::string> included = ParseList(include_fields);
+        std::set<std::string> excluded = ParseList(exclude_fields);
+
+        for (int i = 0; i < num_fields; i++) {
+            if (!included.empty() && !MatchesField(included, fields[i]->name))
+                continue;
+
+            if (MatchesField(excluded, fields[i]->name))
+                continue;
+
+            projection.push_back(i);
+            projected_fields.push_back(fields[i]);
+        }
+
+        if (projection.empty()) {
+            Error("No fields left to send");
+            return false;
+        }
+
+        projected_vals.resize(projection.size());
+
+        num_fields = projection.size();
+        fields = projected_fields.data();
+    }
+
+    // binary fields coded by name, after projection
+    std::set<std::string> dictionary_names = ParseList(dictionary_fields);
+    std::set<std::string> delta_names = ParseList(delta_fields);
+
+    if (!dictionary_names.empty() || !delta_names.empty()) {
+        if (format != FORMAT_BINARY) {
+            Error("Dictionary and delta fields need format binary");
+            return false;
+        }
+
+        // records refer back to earlier ones, which datagrams may lose
+        if (transport == Connection::TRANSPORT_UDP) {
+            Error("Dictionary and delta fields cannot be used with transport udp");
+            return false;
+        }
+
+        if (dictionary_size == 0) {
+            Error("Dictionary size must be positive");
+            return false;
+        }
+
+        codings.assign(num_fields, Binary::PLAIN);
+
+        for (int i = 0; i < num_fields; i++) {
+            if (dictionary_names.erase(fields[i]->name)) {
+                if (fields[i]->type != TYPE_STRING && fields[i]->type != TYPE_ENUM) {
+                    Error(Fmt("Dictionary field %s is not a string or enum", fields[i]->name));
+                    return false;
+                }
+
+                codings[i] = Binary::DICTIONARY;
+            }
+
+            if (delta_names.erase(fields[i]->name)) {
+                if (fields[i]->type != TYPE_TIME) {
+                    Error(Fmt("Delta field %s is not a time", fields[i]->name));
+                    return false;
+                }
+
+                codings[i] = Binary::DELTA;
+            }
+        }
+
+        if (!dictionary_names.empty()) {
+            Error(Fmt("Unknown dictionary field: %s", dictionary_names.begin()->c_str()));
+            return false;
+        }
+
+        if (!delta_names.empty()) {
+            Error(Fmt("Unknown delta field: %s", delta_names.begin()->c_str()));
+            return false;
+        }
+    }
+
+    std::string error;
+    if (!Compressor::Parse(cfg_compression, compression, compression_level, error)) {
+        Error(error.c_str());
+        return false;
+    }
+
+    // a local socket needs no tls, and a single path no list of hosts
+    if (transport != Connection::TRANSPORT_TCP && tls) {
+        Error(Fmt("TLS cannot be used with transport %s", cfg_transport.c_str()));
+        return false;
+    }
+
+    if ((transport == Connection::TRANSPORT_UNIX || transport == Connection::TRANSPORT_SEQPACKET) && !hosts.empty()) {
+        Error(Fmt("Hosts cannot be used with transport %s", cfg_transport.c_str()));
+        return false;
+    }
+
+    if (transport != Connection::TRANSPORT_TCP && (nagle != Connection::NAGLE_AUTO || keepalive > 0 || user_timeout > 0 || !congestion_control.empty())) {
+        Error(Fmt("Nagle, keepalive, user timeout and congestion control cannot be used with transport %s", cfg_transport.c_str()));
+        return false;
+    }
+
+    // datagrams hold whole records, which rules out everything sending a
+    // batch as a stream of bytes
+    if (transport == Connection::TRANSPORT_UDP && (multiplex || acks || !spool_dir.empty() || !compression.empty())) {
+        Error("Transport udp cannot be used with multiplex, acks, spool or compression");
+        return false;
+    }
+
+    // a list of hosts takes the place of the single host
+    std::vector<std::pair<std::string, int>> targets;
+
+    if (hosts.empty()) {
+        targets.push_back(std::make_pair(host, tcpport));
+    }
+    else if (!ParseHosts(hosts, tcpport, targets) || targets.empty()) {
+        Error(Fmt("Invalid hosts: %s", hosts.c_str()));
+        return false;
+    }
+
+    // tag records so streams sharing a connection can be told apart
+    if (multiplex && (format == FORMAT_JSON || format == FORMAT_JSON_FAST))
+        path_tag = "{\"_path\":\"" + JSONEscape(stream_path) + "\"";
+
+    sent_num_fields = num_fields;
+    sent_fields = fields;
+
+    InitEncoder(encoder, json_timestamps, num_fields, fields);
+
+    // formatter threads each get an encoder of their own
+    if (format_threads > 0) {
+        for (size_t i = 0; i < format_threads; i++) {
+            encoders.push_back(new Encoder);
+            InitEncoder(*encoders.back(), json_timestamps, num_fields, fields);
+        }
+
+        pipeline = new Pipeline(format_threads, [this](int worker, Job * formatting) {
+            // jobs go out in order but are formatted side by side, so
+            // coded records only refer back within their job
+            if (encoders[worker]->binary)
+                encoders[worker]->binary->Reset();
+
+            for (threading::Value ** vals : formatting->records) {
+                Encode(*encoders[worker], sent_num_fields, sent_fields, vals, formatting->chunks);
+                formatting->record_ends.push_back(formatting->chunks.Size());
+            }
+
+            if (!formatting->traced.empty())
+                formatting->formatted = Tracer::Now();
+        });
+
+        if (!format_cpus.empty()) {
+            int err = pipeline->Pin(format_cpus);
+            if (err != 0)
+                Warning(Fmt("Error pinning formatter threads to cpus %s: %s", cfg_format_cpus.c_str(), strerror(err)));
+        }
+    }
+
+    // what describes the records, sent at the start of every connection
+    if (format == FORMAT_TSV) {
+        header = TSVHeader(stream_path, num_fields, fields);
+    }
+    else if (format == FORMAT_BINARY) {
+        ODesc schema;
+        encoder.binary->Schema(&schema, stream_path, num_fields, fields);
+        header.assign((const char *)schema.Bytes(), schema.Len());
+    }
+
+    endpoints.resize(targets.size());
+
+    for (size_t i = 0; i < targets.size(); i++) {
+        Endpoint & endpoint = endpoints[i];
+
+        Connection::Options options = ConnectionOptions(targets[i], header, acks ? AckSession() : std::string());
+
+        endpoint.conn = nullptr;
+        endpoint.destination = nullptr;
+        endpoint.error_generation = 0;
+        endpoint.sent_bytes = 0;
+        endpoint.unflushed = 0;
+        endpoint.sent_batches = 0;
+        endpoint.dropped_records = 0;
+        endpoint.reconnects = 0;
+        endpoint.offload_reported = false;
+        endpoint.spool = nullptr;
+        endpoint.spooled_records = 0;
+        endpoint.replay_budget = 0;
+        endpoint.replay_time = Now();
+        endpoint.replay_limited = 0;
+        endpoint.acked_records = 0;
+
+        endpoint.backlog.SetCapacity(backlog_size);
+        endpoint.window.SetCapacity(ack_window);
+
+        if (multiplex) {
+            endpoint.destination = Destination::Acquire(options, backlog_size, priority_connections ? priority : -1, priority_scheduling);
+            endpoint.destination->AddPreamble(header, priority);
+            endpoint.preamble = header;
+            endpoint.error_generation = endpoint.destination->ErrorGeneration();
+
+            if (!sender_cpus.empty()) {
+                int err = endpoint.destination->Pin(sender_cpus);
+                if (err != 0)
+                    Warning(Fmt("Error pinning sender thread to cpus %s: %s", cfg_sender_cpus.c_str(), strerror(err)));
+            }
+            continue;
+        }
+
+        endpoint.conn = new Connection(options);
+
+        // adapted batches start out small
+        endpoint.conn->SetNoDelay(adaptive_batching);
+
+        // pick up what an earlier run left in the spool
+        if (!spool_dir.empty()) {
+            endpoint.spool = new Spool(spool_dir, SpoolName(info.path, targets[i].first, targets[i].second), spool_segment_size, spool_max_segments);
+
+            if (!endpoint.spool->Open()) {
+                Error(endpoint.spool->LastError().c_str());
+                return false;
+            }
+
+            endpoint.replay_limited = endpoint.spool->Bytes();
+        }
+
+        if (!DoLoad(endpoint))
+            return false;
+
+        ReportOffload(endpoint);
+        ReportTuning(endpoint);
+    }
+
+    // without a shared connection the writer thread sends itself
+    if (!multiplex && !sender_cpus.empty()) {
+        int err = Affinity::Set(pthread_self(), sender_cpus);
+        if (err != 0)
+            Warning(Fmt("Error pinning writer thread to cpus %s: %s", cfg_sender_cpus.c_str(), strerror(err)));
+    }
+
+    // without retry at least one endpoint has to be there from the start
+    if (!multiplex && !retry && !AnyUp()) {
+        if (hosts.empty())
+            Error(Fmt("Error connecting to %s", endpoints[0].conn->Name().c_str()));
+        else
+            Error(Fmt("Error connecting to any of %s", hosts.c_str()));
+        return false;
+    }
+
+    return true;
+}
+
+Connection::Options TCP::ConnectionOptions(const std::pair<std::string, int> & target, const std::string & preamble, const std::string & ack_session) const {
+    return Connection::Options{target.first, target.second, tls, cert, key, nonblocking, connect_timeout, reconnect_min, reconnect_max, dns_ttl, compression, compression_level, preamble, ktls, ack_session, transport, datagram_size, send_buffer, nagle, keepalive, user_timeout, congestion_control, io_uring};
+}
+
+bool TCP::DoFinish(double network_time) {
+    // send anything still buffered
+    finishing = true;
+    Flush();
+
+    for (Endpoint & endpoint : endpoints) {
+        if (endpoint.destination) {
+            // the sender thread sends what is left once the last writer is gone
+            endpoint.destination->RemovePreamble(endpoint.preamble);
+            Destination::Release(endpoint.destination, backlog_size);
+            endpoint.destination = nullptr;
+        }
+        else if (endpoint.conn) {
+            // give the backlog a last chance to go out
+            if (endpoint.conn->Connected())
+                Drain(endpoint, 1000);
+
+            // and the collector a moment to acknowledge it
+            while (acks && !endpoint.window.Empty() && endpoint.conn->Connected()) {
+                if (!endpoint.conn->WaitReadable(1000) || !Receive(endpoint))
+                    break;
+            }
+
+            if (!endpoint.window.Empty())
+                Warning(Fmt("%zu records not acknowledged by %s", endpoint.window.Records(), endpoint.conn->Name().c_str()));
+
+            // what did not get out is kept for the next run when spooling,
+            // and lost otherwise
+            endpoint.backlog.Release();
+            Dropped(endpoint, endpoint.backlog.DiscardPartial());
+
+            std::string data;
+            size_t records;
+            Trace * trace;
+
+            while (endpoint.backlog.Pop(data, records, trace)) {
+                if (trace)
+                    Tracer::Finish(trace);
+
+                if (endpoint.spool)
+                    Spill(endpoint, data.data(), data.size(), records);
+                else
+                    Dropped(endpoint, records);
+            }
+
+            delete endpoint.conn;
+            endpoint.conn = nullptr;
+        }
+
+        // the rest of the spool is replayed by the next run
+        delete endpoint.spool;
+        endpoint.spool = nullptr;
+    }
+
+    Publish();
+    Teardown();
+
+    return true;
+}
+
+void TCP::Teardown() {
+    // frees what is left without sending it, connections along with the
+    // tls contexts they hold
+    for (Endpoint & endpoint : endpoints) {
+        if (endpoint.destination) {
+            endpoint.destination->RemovePreamble(endpoint.preamble);
+            Destination::Release(endpoint.destination, backlog_size);
+            endpoint.destination = nullptr;
+        }
+
+        delete endpoint.conn;
+        endpoint.conn = nullptr;
+
+        delete endpoint.spool;
+        endpoint.spool = nullptr;
+    }
+
+    // stop the formatter threads before their encoders go
+    delete pipeline;
+    pipeline = nullptr;
+
+    for (Encoder * worker_encoder : encoders) {
+        FreeEncoder(*worker_encoder);
+        delete worker_encoder;
+    }
+
+    encoders.clear();
+
+    // free formatter
+    FreeEncoder(encoder);
+}
+
+bool TCP::BufferFull() const {
+    if (!buffered)
+        return true;
+
+    if (buffer_size > 0 && chunks.Size() >= buffer_size)
+        return true;
+
+    // the adapted size takes the place of buffer_records, which bounds it
+    if (batcher.Enabled())
+        return pending_records >= batcher.Records();
+
+    // without thresholds every record is sent immediately
+    if (buffer_size == 0 && buffer_records == 0)
+        return true;
+
+    if (buffer_records > 0 && pending_records >= buffer_records)
+        return true;
+
+    return false;
+}
+
+double TCP::MaxDelay() const {
+    // how long the oldest pending record may wait for its batch
+    return batcher.Enabled() ? std::min(batcher.Target(), buffer_latency) : buffer_latency;
+}
+
+bool TCP::Up(const Endpoint & endpoint) const {
+    if (endpoint.destination)
+        return endpoint.destination->Connected();
+
+    return endpoint.conn->Connected();
+}
+
+bool TCP::AnyUp() const {
+    for (const Endpoint & endpoint : endpoints) {
+        if (Up(endpoint))
+            return true;
+    }
+
+    return false;
+}
+
+TCP::Endpoint & TCP::Pick() {
+    // spread batches over the connected endpoints
+    size_t best = endpoints.size();
+
+    for (size_t i = 0; i < endpoints.size(); i++) {
+        size_t index = (next_endpoint + i) % endpoints.size();
+        const Endpoint & endpoint = endpoints[index];
+
+        if (!Up(endpoint))
+            continue;
+
+        if (balance == ROUND_ROBIN) {
+            best = index;
+            break;
+        }
+
+        size_t load = endpoint.destination ? endpoint.destination->Size() : endpoint.backlog.Size();
+        if (best == endpoints.size() || load < (endpoints[best].destination ? endpoints[best].destination->Size() : endpoints[best].backlog.Size()))
+            best = index;
+    }
+
+    // with everything down keep rotating so backlogs fill evenly
+    if (best == endpoints.size())
+        best = next_endpoint % endpoints.size();
+
+    next_endpoint = best + 1;
+
+    return endpoints[best];
+}
+
+void TCP::ReportTuning(Endpoint & endpoint) {
+    // socket options the kernel did not take as asked
+    std::vector<std::string> warnings = endpoint.destination ? endpoint.destination->TakeWarnings() : endpoint.conn->TakeWarnings();
+
+    for (const std::string & warning : warnings)
+        Warning(warning.c_str());
+}
+
+void TCP::ReportOffload(Endpoint & endpoint) {
+    // say once per connection whether the kernel took over encryption
+    if (!tls || !ktls)
+        return;
+
+    if (!Up(endpoint)) {
+        endpoint.offload_reported = false;
+        return;
+    }
+
+    if (endpoint.offload_reported)
+        return;
+
+    std::string name = endpoint.destination ? endpoint.destination->Host() + ":" + std::to_string(endpoint.destination->Port()) : endpoint.conn->Name();
+    bool offloaded = endpoint.destination ? endpoint.destination->Offloaded() : endpoint.conn->Offloaded();
+
+    if (offloaded)
+        MsgThread::Info(Fmt("Kernel TLS offload enabled for %s", name.c_str()));
+    else
+        MsgThread::Info(Fmt("Kernel TLS offload not available for %s, encrypting in OpenSSL", name.c_str()));
+
+    endpoint.offload_reported = true;
+}
+
+void TCP::Publish() {
+    // make this writer's counters visible to LogTCP::stats
+    uint64_t bytes = 0;
+    uint64_t batches = 0;
+    uint64_t reconnects = 0;
+    uint64_t spooled = 0;
+    uint64_t acked = 0;
+    uint64_t backlog_bytes = 0;
+    uint64_t backlog_records = 0;
+    uint64_t spool_bytes = 0;
+    uint64_t window_bytes = 0;
+
+    for (const Endpoint & endpoint : endpoints) {
+        bytes += endpoint.sent_bytes;
+        batches += endpoint.sent_batches;
+        reconnects += endpoint.reconnects;
+        spooled += endpoint.spooled_records;
+        acked += endpoint.acked_records;
+        backlog_bytes += endpoint.backlog.Size();
+        backlog_records += endpoint.backlog.Records();
+        spool_bytes += endpoint.spool ? endpoint.spool->Bytes() : 0;
+        window_bytes += endpoint.window.Size();
+    }
+
+    stats->records.store(written_records, std::memory_order_relaxed);
+    stats->bytes.store(bytes, std::memory_order_relaxed);
+    stats->batches.store(batches, std::memory_order_relaxed);
+    stats->dropped.store(dropped_records, std::memory_order_relaxed);
+    stats->reconnects.store(reconnects, std::memory_order_relaxed);
+    stats->spooled.store(spooled, std::memory_order_relaxed);
+    stats->acked.store(acked, std::memory_order_relaxed);
+    stats->sampled.store(sampled_records, std::memory_order_relaxed);
+    stats->limited.store(limited_records, std::memory_order_relaxed);
+    stats->backlog_bytes.store(backlog_bytes, std::memory_order_relaxed);
+    stats->backlog_records.store(backlog_records, std::memory_order_relaxed);
+    stats->spool_bytes.store(spool_bytes, std::memory_order_relaxed);
+    stats->window_bytes.store(window_bytes, std::memory_order_relaxed);
+    stats->batch_records.store(batcher.Enabled() ? batcher.Records() : 0, std::memory_order_relaxed);
+    stats->batch_bytes.store(batcher.Enabled() ? batcher.Records() * batcher.RecordSize() : 0, std::memory_order_relaxed);
+
+    // traces back from the connections since the last time
+    tracer->Collect(stats);
+    stats->traced.store(tracer->Traced(), std::memory_order_relaxed);
+    stats->trace_lost.store(tracer->Lost(), std::memory_order_relaxed);
+}
+
+void TCP::Dropped(Endpoint & endpoint, size_t records) {
+    endpoint.dropped_records += records;
+    dropped_records += records;
+}
+
+bool TCP::Failed(Endpoint & endpoint) {
+    // heartbeats take care of reconnecting
+    if (retry || endpoints.size() > 1) {
+        Warning(endpoint.conn->LastError().c_str());
+        endpoint.conn->Close();
+
+        // the rest of a half sent entry is meaningless on a new connection,
+        // while unacknowledged batches and those whose compressed data was
+        // not out yet are sent again
+        endpoint.unflushed = 0;
+        endpoint.backlog.Release();
+        Dropped(endpoint, endpoint.backlog.DiscardPartial());
+        endpoint.window.Rewind();
+
+        if (retry || AnyUp())
+            return true;
+    }
+
+    Error(endpoint.conn->LastError().c_str());
+    return false;
+}
+
+bool TCP::Failover(Endpoint & endpoint) {
+    // move what waits for a lost endpoint to the ones still up
+    std::string data;
+    size_t records;
+    Trace * trace;
+
+    while (!endpoint.window.Empty() || !endpoint.backlog.Empty()) {
+        Endpoint & other = Pick();
+        if (&other == &endpoint || !Up(other))
+            break;
+
+        // unacknowledged batches are the oldest
+        if (!(endpoint.window.Empty() ? endpoint.backlog.Pop(data, records, trace) : endpoint.window.Pop(data, records, trace)))
+            break;
+
+        if (!Queue(other, data.data(), data.size(), records, false, trace) || !Drain(other, nonblocking ? 0 : -1))
+            return false;
+    }
+
+    return true;
+}
+
+size_t TCP::RecordsBefore(size_t offset) const {
+    // number of buffered records that end at or before offset
+    return std::upper_bound(record_ends.begin(), record_ends.end(), offset) - record_ends.begin();
+}
+
+bool TCP::Drain(Endpoint & endpoint, int timeout) {
+    if (acks)
+        return DrainWindow(endpoint, timeout);
+
+    // send backlog until it is empty or the socket stays full for timeout ms
+    Connection * conn = endpoint.conn;
+    Backlog & backlog = endpoint.backlog;
+
+    while (conn->Connected()) {
+        // spooled batches come back once the backlog is through
+        if (backlog.Empty() && !conn->Pending() && !Replay(endpoint))
+            break;
+
+        // compressed data of the last batch goes out first, which stays
+        // in the backlog until it has
+        bool flushing = conn->Pending();
+
+        // a connection closed since took the compressed data with it, so
+        // the batch goes again whole
+        if (!flushing && endpoint.unflushed > 0) {
+            endpoint.unflushed = 0;
+            backlog.Release();
+        }
+
+        ssize_t ret = flushing ? conn->Flush() : conn->Send(backlog.Front(), backlog.FrontLen());
+        if (ret < 0)
+            return Failed(endpoint);
+
+        if (!flushing && ret > 0 && conn->Pending()) {
+            endpoint.unflushed = ret;
+            backlog.Claim();
+            continue;
+        }
+
+        if (flushing && !conn->Pending() && endpoint.unflushed > 0) {
+            endpoint.sent_bytes += endpoint.unflushed;
+            backlog.Consume(endpoint.unflushed);
+            endpoint.unflushed = 0;
+            continue;
+        }
+
+        if (ret > 0) {
+            if (!flushing) {
+                endpoint.sent_bytes += ret;
+                backlog.Consume(ret);
+            }
+
+            continue;
+        }
+
+        if (timeout == 0)
+            return true;
+
+        if (!conn->Wait(timeout))
+            return true;
+    }
+
+    return true;
+}
+
+bool TCP::DrainWindow(Endpoint & endpoint, int timeout) {
+    // send framed batches through the window, refilling it from the
+    // backlog as acknowledgements make room
+    Connection * conn = endpoint.conn;
+    Backlog & backlog = endpoint.backlog;
+    Window & window = endpoint.window;
+
+    // buffers go round between the window and the backlog
+    std::string & data = drained;
+    size_t records;
+    Trace * trace;
+
+    while (conn->Connected()) {
+        if (!Receive(endpoint))
+            return Failed(endpoint);
+
+        while ((!backlog.Empty() || Replay(endpoint)) && window.Fits(backlog.FrontLen()) && backlog.Pop(data, records, trace))
+            window.Push(data, records, trace);
+
+        // compressed data of the last batch goes out first
+        bool flushing = conn->Pending();
+
+        if (!flushing && !window.Unsent()) {
+            // everything is out, wait a while for acknowledgements when
+            // batches are waiting for room
+            if (timeout == 0 || backlog.Empty() || !conn->WaitReadable(timeout < 0 ? 1000 : timeout))
+                return true;
+
+            continue;
+        }
+
+        ssize_t ret = flushing ? conn->Flush() : conn->Send(window.Front(), window.FrontLen());
+        if (ret < 0)
+            return Failed(endpoint);
+
+        if (ret > 0) {
+            if (!flushing) {
+                endpoint.sent_bytes += ret;
+                window.Consume(ret);
+            }
+
+            continue;
+        }
+
+        if (timeout == 0)
+            return true;
+
+        if (!conn->Wait(timeout))
+            return true;
+    }
+
+    return true;
+}
+
+bool TCP::Receive(Endpoint & endpoint) {
+    // take in what the collector sent, acknowledgements freeing the window
+    if (!acks)
+        return endpoint.conn->ReadPending();
+
+    received.clear();
+
+    if (!endpoint.conn->ReadPending(&received))
+        return false;
+
+    endpoint.acked_records += endpoint.window.Received(received.data(), received.size());
+
+    return true;
+}
+
+bool TCP::Queue(Endpoint & endpoint, const char * msg, size_t len, size_t records, bool started, Trace * trace) {
+    Backlog & backlog = endpoint.backlog;
+
+    // spill to disk while down or full, staying behind what is spooled,
+    // which is where traces end
+    if (!started && endpoint.spool && (!endpoint.conn->Connected() || !endpoint.spool->Empty() || !backlog.Fits(len))) {
+        if (trace)
+            Tracer::Finish(trace);
+
+        return Spill(endpoint, msg, len, records);
+    }
+
+    // a partially sent batch must be finished to keep the stream intact
+    if (!started) {
+        if (backlog_policy == BLOCK) {
+            // wait for the collector to make room
+            while (!backlog.Fits(len) && endpoint.conn->Connected() && !Killed()) {
+                if (!Drain(endpoint, 1000)) {
+                    if (trace)
+                        Tracer::Finish(trace);
+
+                    return false;
+                }
+            }
+        }
+
+        // drop to make room, falling back to dropping the oldest when unable to block
+        while (!backlog.Fits(len)) {
+            size_t dropped;
+            if (backlog_policy == DROP_NEWEST || !backlog.PopOldest(dropped)) {
+                if (trace)
+                    Tracer::Finish(trace);
+
+                Dropped(endpoint, records);
+                return true;
+            }
+
+            Dropped(endpoint, dropped);
+        }
+    }
+
+    backlog.Push(msg, len, records, started, trace);
+
+    return true;
+}
+
+bool TCP::Idle(const Endpoint & endpoint) const {
+    // whether new batches can go out ahead of nothing else
+    return endpoint.backlog.Empty() && (!endpoint.spool || endpoint.spool->Empty());
+}
+
+bool TCP::Chained() const {
+    // in order over the connection the batch before went out on, with
+    // nothing ahead that a reconnect, failover or the spool would send
+    // differently
+    if (pipeline || multiplex || endpoints.size() != 1)
+        return false;
+
+    const Endpoint & endpoint = endpoints.front();
+    const Connection * conn = endpoint.conn;
+
+    return conn->Connected() && conn->Connects() == chained_connects && Idle(endpoint) && endpoint.window.Empty() && !conn->Pending();
+}
+
+void TCP::Resync(Endpoint & endpoint) {
+    // a new connection first gets the coding state records sent again on
+    // it refer back to
+    if (codings.empty() || !endpoint.conn)
+        return;
+
+    ODesc state;
+    encoder.binary->State(&state);
+
+    std::string preamble = header;
+    preamble.append((const char *)state.Bytes(), state.Len());
+
+    endpoint.conn->SetPreamble(preamble);
 }
 
-bool TCP::DoLoad(bool is_retry) {
-    // error value
-    int ret;
-    long lret;
+bool TCP::Spill(Endpoint & endpoint, const char * msg, size_t len, size_t records) {
+    size_t dropped;
+    std::string resynced;
+
+    // spooled batches are replayed on whatever connection there is then
+    if (!codings.empty() && Binary::Continues(msg, len)) {
+        ODesc state;
+        encoder.binary->State(&state);
 
-    // get address info
-    struct addrinfo * addr;
-    struct addrinfo hints;
+        resynced.assign((const char *)state.Bytes(), state.Len());
+        resynced.append(msg, len);
 
-    memset(&hints, 0, sizeof(hints));
+        msg = resynced.data();
+        len = resynced.size();
+    }
+
+    if (!endpoint.spool->Append(msg, len, records, backlog_policy == DROP_NEWEST, dropped)) {
+        // without room on disk the batch is lost
+        Warning(endpoint.spool->LastError().c_str());
+        Dropped(endpoint, records);
+        return true;
+    }
+
+    endpoint.spooled_records += records;
+    Dropped(endpoint, dropped);
 
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_ADDRCONFIG;
+    // only what piles up while down is replayed at spool_rate, batches
+    // spooled to stay behind it go as fast as the collector takes them
+    if (!endpoint.conn->Connected())
+        endpoint.replay_limited += len;
 
-    ret = getaddrinfo(host.c_str(), std::to_string(tcpport).c_str(), &hints, &addr);
-    if (ret > 0) {
-        Error(Fmt("Error resolving %s: %s", host.c_str(), strerror(errno)));
+    return true;
+}
 
-        // clean up
-        freeaddrinfo(addr);
+bool TCP::Replay(Endpoint & endpoint) {
+    // move the oldest spooled batch into the empty backlog
+    Spool * spool = endpoint.spool;
+    if (!spool || spool->Empty())
         return false;
+
+    // drops from the front may have taken some of the limited bytes
+    endpoint.replay_limited = std::min(endpoint.replay_limited, spool->Bytes());
+
+    if (spool_rate > 0 && endpoint.replay_limited > 0) {
+        // allow up to a second's worth to build up
+        double now = Now();
+        endpoint.replay_budget = std::min(endpoint.replay_budget + (now - endpoint.replay_time) * spool_rate, (double)spool_rate);
+        endpoint.replay_time = now;
+
+        if (endpoint.replay_budget <= 0)
+            return false;
     }
 
-    sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-    if (sock < 0) {
-        Error(Fmt("Error opening socket: %s", strerror(errno)));
+    const char * data;
+    size_t len;
+    size_t records;
 
-        // clean up
-        freeaddrinfo(addr);
+    if (!spool->Front(data, len, records))
         return false;
-    }
 
-    ret = connect(sock, addr->ai_addr, addr->ai_addrlen);
-    if (ret < 0) {
-        char addrstr[INET6_ADDRSTRLEN];
-        inet_ntop(addr->ai_family, addr->ai_addr->sa_family == AF_INET ? &(((struct sockaddr_in *)addr->ai_addr)->sin_addr) : (struct in_addr *)&(((struct sockaddr_in6 *)addr->ai_addr)->sin6_addr), addrstr, sizeof(addrstr));
-        if (retry) {
-            if (!is_retry)
-                Warning(Fmt("Error connecting to %s: %s", addrstr, strerror(errno)));
-        }
-        else {
-            Error(Fmt("Error connecting to %s: %s", addrstr, strerror(errno)));
-        }
+    endpoint.backlog.Push(data, len, records);
+    endpoint.replay_budget -= len;
+    endpoint.replay_limited -= std::min((uint64_t)len, endpoint.replay_limited);
+    spool->Pop();
 
-        // clean up and return success if retrying
-        freeaddrinfo(addr);
-        close(sock);
-        sock = -1;
-        return retry;
-    }
+    return true;
+}
 
-    // clean up
-    freeaddrinfo(addr);
+bool TCP::Hold(Endpoint & endpoint, size_t offset, size_t len, size_t records, bool started, Trace * trace) {
+    // copy part of the batch out of its chunks into the backlog
+    chunks.Copy(offset, len, held);
+    return Queue(endpoint, held.data(), held.size(), records, started, trace);
+}
 
-    if (tls) {
-        if (!ssl_init) {
-            // add tls
-            SSL_load_error_strings();
-            SSL_library_init();
-            OpenSSL_add_all_algorithms();
+Trace * TCP::TakeTrace() {
+    Trace * trace = pending_trace;
+    pending_trace = nullptr;
+    return trace;
+}
 
-            ssl_init = true;
+bool TCP::Send(Endpoint & endpoint) {
+    // send the batch in chunks, with record boundaries in record_ends
+    size_t len = chunks.Size();
+    size_t records = pending_records;
+
+    endpoint.sent_batches++;
+
+    if (endpoint.destination) {
+        Destination * destination = endpoint.destination;
+
+        if (!destination->Fits(len, priority)) {
+            if (backlog_policy == BLOCK) {
+                // wait for the sender thread to make room, giving up after
+                // a second when finishing so a stuck destination cannot
+                // hold up shutdown
+                for (int waited = 0; !destination->WaitFits(len, priority, 100) && !Killed(); waited += 100) {
+                    if (finishing && waited >= 1000)
+                        break;
+                }
+
+                if (!destination->Fits(len, priority)) {
+                    Dropped(endpoint, records);
+                    return true;
+                }
+            }
+            else if (backlog_policy == DROP_NEWEST) {
+                Dropped(endpoint, records);
+                return true;
+            }
         }
 
-        // create context for tls
-        ctx = SSL_CTX_new(SSLv23_client_method());
-        if (ctx == nullptr) {
-            Error(Fmt("Error setting up TLS context: %s", ERR_reason_error_string(ERR_get_error())));
+        // the oldest batches of the lowest lanes are dropped by the sender
+        // when over capacity
+        Batch * batch = destination->Take();
+        chunks.Copy(0, len, batch->data);
+        batch->record_ends.assign(record_ends.begin(), record_ends.end());
+        batch->droppable = backlog_policy == DROP_OLDEST;
+        batch->lane = priority;
+        batch->whole = !codings.empty();
+        batch->trace = TakeTrace();
 
-            // clean up
-            close(sock);
-            sock = -1;
-            return false;
-        }
+        destination->Push(batch);
+        endpoint.sent_bytes += len;
 
-        if (cert.empty()) {
-            // load default paths in context
-            ret = SSL_CTX_set_default_verify_paths(ctx);
-            if (ret <= 0) {
-                Error(Fmt("Error loading default certificate paths: %s", ERR_reason_error_string(ERR_get_error())));
+        return true;
+    }
 
-                // clean up
-                SSL_CTX_free(ctx);
-                close(sock);
-                sock = -1;
-                return false;
+    Connection * conn = endpoint.conn;
+
+    if (transport == Connection::TRANSPORT_UDP) {
+        // datagrams go out whole or not at all, so nothing is held
+        size_t offset = 0;
+
+        while (conn->Connected() && offset < len) {
+            ssize_t ret = conn->SendRecords(chunks, record_ends, offset);
+            if (ret < 0) {
+                if (!Failed(endpoint))
+                    return false;
+
+                break;
             }
-        }
-        else {
-            // add certificate to context
-            ret = SSL_CTX_load_verify_locations(ctx, cert.c_str(), NULL);
-            if (ret <= 0) {
-                Error(Fmt("Error using TLS certificate: %s", ERR_reason_error_string(ERR_get_error())));
-
-                // clean up
-                SSL_CTX_free(ctx);
-                close(sock);
-                sock = -1;
-                return false;
+
+            if (ret == 0) {
+                if (nonblocking)
+                    break;
+
+                conn->Wait(1000);
+                continue;
             }
+
+            offset += ret;
         }
 
-        // setup tls connection
-        ssl = SSL_new(ctx);
-        if (ssl == nullptr) {
-            Error(Fmt("Error setting up TLS structure: %s", ERR_reason_error_string(ERR_get_error())));
+        endpoint.sent_bytes += offset;
 
-            // clean up
-            SSL_CTX_free(ctx);
-            close(sock);
-            sock = -1;
-            return false;
-        }
+        if (offset == len && pending_trace)
+            pending_trace->written = Now();
 
-        // set tls hostname
-        ret = SSL_set_tlsext_host_name(ssl, host.c_str());
-        if (ret != 1) {
-            Error(Fmt("Error setting TLS descriptor: %s", ERR_reason_error_string(SSL_get_error(ssl, ret))));
+        Dropped(endpoint, pending_records - RecordsBefore(offset) + conn->TakeOversized());
+
+        return true;
+    }
 
-            // clean up
-            SSL_free(ssl);
-            SSL_CTX_free(ctx);
-            close(sock);
-            sock = -1;
+    if (!conn->Connected()) {
+        if (!retry && endpoints.size() == 1)
             return false;
-        }
 
-        // set underlying file descriptor
-        ret = SSL_set_fd(ssl, sock);
-        if (ret != 1) {
-            Error(Fmt("Error setting TLS descriptor: %s", ERR_reason_error_string(SSL_get_error(ssl, ret))));
+        // hold records until a heartbeat has reconnected
+        return Hold(endpoint, 0, len, records, false, TakeTrace());
+    }
 
-            // clean up
-            SSL_free(ssl);
-            SSL_CTX_free(ctx);
-            close(sock);
-            sock = -1;
+    if (acks) {
+        // batches are framed and kept until acknowledged
+        if (!Hold(endpoint, 0, len, records, false, TakeTrace()))
             return false;
-        }
 
-        // do handshake
-        ret = SSL_connect(ssl);
-        if (ret != 1) {
-            Error(Fmt("Error completing TLS handshake: %s", ERR_reason_error_string(SSL_get_error(ssl, ret))));
+        return Drain(endpoint, nonblocking ? 0 : -1);
+    }
+
+    if (nonblocking) {
+        // compressed batches go through the backlog, where they are kept
+        // until their compressed data is out
+        if (!compression.empty()) {
+            if (!Hold(endpoint, 0, len, records, false, TakeTrace()))
+                return false;
+
+            return Drain(endpoint, 0);
+        }
 
-            // clean up
-            SSL_free(ssl);
-            SSL_CTX_free(ctx);
-            close(sock);
-            sock = -1;
+        // keep order behind anything already waiting
+        if (!Drain(endpoint, 0))
             return false;
+
+        size_t offset = 0;
+
+        while (Idle(endpoint) && conn->Connected() && offset < len) {
+            ssize_t ret = conn->Send(chunks, offset);
+            if (ret < 0) {
+                if (!Failed(endpoint))
+                    return false;
+
+                break;
+            }
+
+            if (ret == 0)
+                break;
+
+            offset += ret;
         }
 
-        // get peer certificate
-        X509 * peer = SSL_get_peer_certificate(ssl);
-        if (peer == nullptr) {
-            Error(Fmt("Error getting TLS certificate"));
+        endpoint.sent_bytes += offset;
 
-            // clean up
-            SSL_shutdown(ssl);
-            SSL_free(ssl);
-            SSL_CTX_free(ctx);
-            close(sock);
-            sock = -1;
-            return false;
+        // queue what the socket did not take, finishing a cut record first
+        size_t sent = RecordsBefore(offset);
+        if (sent < pending_records && offset > 0 && !codings.empty()) {
+            // coded records refer back to the start of their batch, so the
+            // rest can only follow it on this connection
+            if (!Hold(endpoint, offset, len - offset, pending_records - sent, true, TakeTrace()))
+                return false;
+
+            sent = pending_records;
         }
+        else if (sent < pending_records && offset > (sent > 0 ? record_ends[sent - 1] : 0)) {
+            // the trace goes with whatever ends the batch
+            if (!Hold(endpoint, offset, record_ends[sent] - offset, 1, true, sent + 1 == pending_records ? TakeTrace() : nullptr))
+                return false;
 
-        // verify peer certificate
-        lret = SSL_get_verify_result(ssl);
-        if (lret != X509_V_OK) {
-            Error(Fmt("Error verifying TLS certificate: %s", X509_verify_cert_error_string(lret)));
+            offset = record_ends[sent++];
+        }
 
-            // clean up
-            X509_free(peer);
-            SSL_shutdown(ssl);
-            SSL_free(ssl);
-            SSL_CTX_free(ctx);
-            close(sock);
-            sock = -1;
+        if (sent < pending_records && !Hold(endpoint, offset, len - offset, pending_records - sent, false, TakeTrace()))
             return false;
-        }
 
-        // clean up
-        X509_free(peer);
+        // a trace left behind means it all went out
+        if (pending_trace)
+            pending_trace->written = Now();
     }
+    else {
+        // anything held while disconnected goes first
+        if (!Drain(endpoint, -1))
+            return false;
 
-    if (!key.empty()) {
-        if (tls) {
-            // write key
-            ret = SSL_write(ssl, (key + "\n").c_str(), key.size() + 1);
-            if (ret < 0) {
-                Error(Fmt("Error sending TLS data: %s", ERR_reason_error_string(ERR_get_error())));
-
-                // clean up
-                SSL_shutdown(ssl);
-                SSL_free(ssl);
-                SSL_CTX_free(ctx);
-                close(sock);
-                sock = -1;
+        size_t offset = 0;
+
+        if (!Idle(endpoint) || !conn->SendAll(chunks, offset)) {
+            if (Idle(endpoint) && !Failed(endpoint))
                 return false;
-            }
-        }
-        else {
-            // write key
-            ret = send(sock, key.c_str(), key.size(), 0);
-            if (ret < 0) {
-                Error(Fmt("Error sending data: %s", strerror(errno)));
 
-                // clean up
-                close(sock);
-                sock = -1;
+            // hold from the first record the old connection cut short, or
+            // the whole batch when coded records refer back to its start
+            size_t sent = codings.empty() ? RecordsBefore(offset) : 0;
+            offset = sent > 0 ? record_ends[sent - 1] : 0;
+
+            if (!Hold(endpoint, offset, len - offset, pending_records - sent, false, TakeTrace()))
                 return false;
-            }
         }
+        else if (pending_trace) {
+            pending_trace->written = Now();
+        }
+
+        endpoint.sent_bytes += offset;
     }
 
     return true;
 }
 
-bool TCP::DoUnload() {
-    if (tls) {
-        // stop tls
-        SSL_shutdown(ssl);
-        SSL_free(ssl);
+bool TCP::Flush() {
+    // with formatter threads, everything gathered so far is formatted
+    // and sent in order
+    if (pipeline) {
+        Submit();
+        return Collect(0);
+    }
+
+    return SendPending(pending_time);
+}
 
-        // free context
-        SSL_CTX_free(ctx);
+void TCP::Submit() {
+    if (job) {
+        pipeline->Submit(job);
+        job = nullptr;
     }
+}
+
+bool TCP::Collect(size_t in_flight) {
+    // send formatted jobs in the order they were submitted, waiting until
+    // at most in_flight are left
+    while (Job * done = pipeline->Next(pipeline->InFlight() > in_flight)) {
+        chunks.Swap(done->chunks);
+        record_ends.swap(done->record_ends);
+        pending_records = done->records.size();
+
+        // formatting is timed from the write, so it includes waiting for
+        // the job to fill and for a formatter thread
+        for (double start : done->traced) {
+            stats->trace_format.Record(done->formatted - start);
+            traced.push_back(std::make_pair(start, done->formatted));
+        }
+
+        double since = done->time;
+        pipeline->Release(done);
 
-    // close socket
-    close(sock);
-    sock = -1;
+        if (!SendPending(since))
+            return false;
+    }
 
     return true;
 }
 
-bool TCP::DoInit(const WriterInfo & info, int num_fields, const threading::Field * const * fields) {
-    // get configuration value
-    std::string cfg_host = GetConfigValue(info, "host");
-    std::string cfg_tcpport = GetConfigValue(info, "tcpport");
-    std::string cfg_retry = GetConfigValue(info, "retry");
-    std::string cfg_tls = GetConfigValue(info, "tls");
-    std::string cfg_cert = GetConfigValue(info, "cert");
-    std::string cfg_key = GetConfigValue(info, "key");
+bool TCP::SendPending(double since) {
+    if (pending_records == 0)
+        return true;
 
-    // fill in non-empty values
-    if (!cfg_host.empty())
-        host = cfg_host;
-    if (!cfg_tcpport.empty())
-        tcpport = stoi(cfg_tcpport);
-    if (!cfg_retry.empty())
-        retry = cfg_retry == "T";
-    if (!cfg_tls.empty())
-        tls = cfg_tls == "T";
-    if (!cfg_cert.empty())
-        cert = cfg_cert;
-    if (!cfg_key.empty())
-        key = cfg_key;
+    double start = Now();
 
-    // prepare json formatter
-    formatter = new threading::formatter::JSON(this, threading::formatter::JSON::TS_EPOCH);
+    // the batch carries a trace for its traced records to the connection
+    if (!traced.empty()) {
+        for (const std::pair<double, double> & record : traced)
+            stats->trace_batch.Record(start - record.second);
 
-    return DoLoad();
-}
+        pending_trace = tracer->Start(traced.front().first, start);
+        traced.clear();
+    }
 
-bool TCP::DoFinish(double network_time) {
-    int ret = DoUnload();
+    bool ret = Send(Pick());
+    double end = Now();
+
+    // a trace not taken along with the batch is done, written out or not
+    if (pending_trace)
+        Tracer::Finish(TakeTrace());
 
-    // free json formatter
-    delete formatter;
+    stats->flush_latency.Record(end - start);
+    batcher.Sent(end, written_records, pending_records, chunks.Size(), start - since, end - start);
+
+    chunks.Clear();
+    record_ends.clear();
+    pending_records = 0;
 
     return ret;
 }
 
+void TCP::InitEncoder(Encoder & encoder, threading::formatter::JSON::TimeFormat json_timestamps, int num_fields, const threading::Field * const * fields) {
+    switch (format) {
+    case FORMAT_JSON:
+        encoder.formatter = new threading::formatter::JSON(this, json_timestamps);
+        break;
+
+    case FORMAT_JSON_FAST: {
+        threading::formatter::JSON * json = new threading::formatter::JSON(this, json_timestamps);
+        encoder.formatter = json;
+        encoder.fast_json = new FastJSON(json, json_timestamps, multiplex ? path_tag : "{", num_fields, fields);
+        break;
+    }
+
+    case FORMAT_TSV: {
+        threading::formatter::Ascii::SeparatorInfo separators(TSV_SEPARATOR, TSV_SET_SEPARATOR, TSV_UNSET_FIELD, TSV_EMPTY_FIELD);
+        encoder.formatter = new threading::formatter::Ascii(this, separators);
+
+        encoder.record.EnableEscaping();
+        encoder.record.AddEscapeSequence(TSV_SEPARATOR);
+        break;
+    }
+
+    case FORMAT_BINARY:
+        // formatter threads encode records of the writer's stream
+        encoder.binary = this->encoder.binary ? new Binary(this->encoder.binary->Stream()) : new Binary();
+        encoder.binary->SetCodings(codings, dictionary_size);
+        break;
+    }
+}
+
+void TCP::FreeEncoder(Encoder & encoder) {
+    delete encoder.fast_json;
+    delete encoder.formatter;
+    delete encoder.binary;
+
+    encoder.fast_json = nullptr;
+    encoder.formatter = nullptr;
+    encoder.binary = nullptr;
+}
+
+void TCP::Encode(Encoder & encoder, int num_fields, const threading::Field * const * fields, threading::Value ** vals, Chunks & out) const {
+    ODesc & record = encoder.record;
+
+    if (format == FORMAT_BINARY) {
+        // length prefixed records need no separator
+        record.Clear();
+        encoder.binary->Record(&record, num_fields, vals);
+
+        out.Append((const char *)record.Bytes(), record.Len());
+    }
+    else if (format == FORMAT_JSON_FAST) {
+        // the path tag is part of how records open
+        const std::string & json = encoder.fast_json->Describe(vals);
+
+        out.Append(json.data(), json.size());
+        out.Append("\n", 1);
+    }
+    else if (multiplex) {
+        // splice the path tag in front of the record's fields
+        record.Clear();
+        encoder.formatter->Describe(&record, num_fields, fields, vals);
+
+        out.Append(path_tag.data(), path_tag.size());
+        if (record.Len() > 2)
+            out.Append(",", 1);
+        out.Append((const char *)record.Bytes() + 1, record.Len() - 1);
+        out.Append("\n", 1);
+    }
+    else {
+        record.Clear();
+        encoder.formatter->Describe(&record, num_fields, fields, vals);
+
+        out.Append((const char *)record.Bytes(), record.Len());
+        out.Append("\n", 1);
+    }
+}
+
 bool TCP::DoWrite(int num_fields, const threading::Field * const * fields, threading::Value ** vals) {
-    int ret;
+    if (!multiplex && !retry && !AnyUp())
+        return false;
 
-    if (sock < 0) {
-        if (retry) {
-            DoLoad(true);
+    double start = Now();
 
-            if (sock < 0)
-                return true;
+    // skipped records are not formatted at all
+    switch (sampler.Check(vals, start)) {
+    case Sampler::KEEP:
+        break;
+
+    case Sampler::SAMPLED:
+        sampled_records++;
+        return true;
+
+    case Sampler::LIMITED:
+        limited_records++;
+        return true;
+    }
+
+    bool trace = tracer->Sample();
+
+    if (pipeline) {
+        // formatter threads take the projected values over, leaving the
+        // backend to free the rest
+        if (!job) {
+            job = pipeline->Take(sent_num_fields);
+            job->time = start;
+            pending_time = start;
         }
-        else {
-            return false;
+
+        threading::Value ** moved = (threading::Value **)job->arena.Allocate(sizeof(threading::Value *) * sent_num_fields);
+
+        for (int i = 0; i < sent_num_fields; i++) {
+            int index = projection.empty() ? i : projection[i];
+
+            moved[i] = vals[index];
+            vals[index] = nullptr;
         }
-    }
 
-    buffer.Clear();
+        job->records.push_back(moved);
+        written_records++;
 
-    formatter->Describe(&buffer, num_fields, fields, vals);
+        if (trace)
+            job->traced.push_back(start);
 
-    buffer.AddRaw("\n", 1);
+        stats->write_latency.Record(Now() - start);
 
-    const char * msg = (const char *)buffer.Bytes();
-    size_t len = buffer.Len();
+        size_t records = job->records.size();
 
-    if (tls) {
-        ret = SSL_write(ssl, msg, len);
-        if (ret < 0) {
-            if (retry) {
-                DoUnload();
-                DoLoad();
-            }
-            else {
-                Error(Fmt("Error sending TLS data: %s", ERR_reason_error_string(ERR_get_error())));
-                return false;
-            }
+        if (records >= std::max(format_batch, (size_t)1) || (buffer_records > 0 && records >= buffer_records) || !buffered || (batcher.Enabled() && (records >= batcher.Records() || start - pending_time >= MaxDelay()))) {
+            Submit();
+
+            // a few jobs per thread keep them busy without holding many
+            // records back
+            return Collect(2 * format_threads);
         }
+
+        return true;
     }
-    else {
-        ret = send(sock, msg, len, 0);
-        if (ret < 0) {
-            if (retry) {
-                DoUnload();
-                DoLoad();
-            }
-            else {
-                Error(Fmt("Error sending data: %s", strerror(errno)));
-                return false;
-            }
+
+    if (!projection.empty()) {
+        for (size_t i = 0; i < projection.size(); i++)
+            projected_vals[i] = vals[projection[i]];
+
+        num_fields = projection.size();
+        fields = projected_fields.data();
+        vals = projected_vals.data();
+    }
+
+    if (pending_records == 0) {
+        pending_time = start;
+
+        // coded records carry on from the batch before only when it is
+        // sure to arrive first
+        if (!codings.empty()) {
+            if (Chained())
+                encoder.binary->Continue();
+            else
+                encoder.binary->Reset();
+
+            chained_connects = endpoints.front().conn && Up(endpoints.front()) ? endpoints.front().conn->Connects() : 0;
         }
     }
 
+    Encode(encoder, num_fields, fields, vals, chunks);
+
+    record_ends.push_back(chunks.Size());
+    pending_records++;
+    written_records++;
+
+    if (trace) {
+        double formatted = Now();
+        stats->trace_format.Record(formatted - start);
+        traced.push_back(std::make_pair(start, formatted));
+    }
+
+    stats->write_latency.Record(Now() - start);
+
+    // adapted batches are also cut when late, not only on heartbeats
+    if (BufferFull() || (batcher.Enabled() && start - pending_time >= MaxDelay()))
+        return Flush();
+
     return true;
 }
 
 bool TCP::DoSetBuf(bool enabled) {
+    buffered = enabled;
+
+    // send what is pending when switching to unbuffered
+    if (!buffered)
+        return Flush();
+
     return true;
 }
 
 bool TCP::DoFlush(double network_time) {
-    return true;
+    return Flush();
 }
 
 bool TCP::DoRotate(const char * rotated_path, double open, double close, bool terminating) {
-    // No log rotation needed
+    // nothing to rotate on the collector, but spool segments start anew
+    for (Endpoint & endpoint : endpoints) {
+        if (endpoint.spool)
+            endpoint.spool->Rotate();
+    }
+
     return FinishedRotation();
 }
 
+bool TCP::Reconfigure(const std::map<std::string, std::string> & changes) {
+    std::string cfg_host = Changed(changes, "host");
+    std::string cfg_tcpport = Changed(changes, "tcpport");
+    std::string cfg_hosts = Changed(changes, "hosts");
+    std::string cfg_connect_timeout = Changed(changes, "connect_timeout");
+    std::string cfg_reconnect_min = Changed(changes, "reconnect_min");
+    std::string cfg_reconnect_max = Changed(changes, "reconnect_max");
+    std::string cfg_dns_ttl = Changed(changes, "dns_ttl");
+    std::string cfg_send_buffer = Changed(changes, "send_buffer");
+    std::string cfg_nagle = Changed(changes, "nagle");
+    std::string cfg_keepalive = Changed(changes, "keepalive");
+    std::string cfg_user_timeout = Changed(changes, "user_timeout");
+    std::string cfg_congestion_control = Changed(changes, "congestion_control");
+    std::string cfg_buffer_size = Changed(changes, "buffer_size");
+    std::string cfg_buffer_records = Changed(changes, "buffer_records");
+    std::string cfg_buffer_latency = Changed(changes, "buffer_latency");
+    std::string cfg_backlog_size = Changed(changes, "backlog_size");
+    std::string cfg_target_latency = Changed(changes, "target_latency");
+    std::string cfg_sample_rate = Changed(changes, "sample_rate");
+    std::string cfg_max_records_per_sec = Changed(changes, "max_records_per_sec");
+    std::string cfg_trace_every = Changed(changes, "trace_every");
+
+    // everything is checked before anything is applied, keeping the old
+    // settings when something does not fit
+    std::vector<std::pair<std::string, int>> targets;
+    Connection::Nagle new_nagle = nagle;
+    int new_tcpport = tcpport;
+
+    try {
+        std::string new_host = cfg_host.empty() ? host : cfg_host;
+        std::string new_hosts = cfg_hosts.empty() ? hosts : cfg_hosts;
+
+        if (!cfg_tcpport.empty())
+            new_tcpport = stoi(cfg_tcpport);
+
+        if (new_hosts.empty()) {
+            targets.push_back(std::make_pair(new_host, new_tcpport));
+        }
+        else if (!ParseHosts(new_hosts, new_tcpport, targets) || targets.empty()) {
+            Warning(Fmt("Not reconfiguring, invalid hosts: %s", new_hosts.c_str()));
+            return true;
+        }
+
+        if ((transport == Connection::TRANSPORT_UNIX || transport == Connection::TRANSPORT_SEQPACKET) && !new_hosts.empty()) {
+            Warning("Not reconfiguring, hosts cannot be used with unix sockets");
+            return true;
+        }
+
+        // backlogs and spools stay with their endpoints
+        if (targets.size() != endpoints.size()) {
+            Warning(Fmt("Not reconfiguring, %zu hosts given for %zu endpoints", targets.size(), endpoints.size()));
+            return true;
+        }
+
+        if (!cfg_nagle.empty() && !ParseNagle(cfg_nagle, new_nagle)) {
+            Warning(Fmt("Not reconfiguring, unknown nagle mode: %s", cfg_nagle.c_str()));
+            return true;
+        }
+
+        if (transport != Connection::TRANSPORT_TCP && (!cfg_nagle.empty() || !cfg_keepalive.empty() || !cfg_user_timeout.empty() || !cfg_congestion_control.empty())) {
+            Warning("Not reconfiguring, nagle, keepalive, user timeout and congestion control only apply to tcp");
+            return true;
+        }
+
+        if (!cfg_sample_rate.empty() && (stod(cfg_sample_rate) < 0 || stod(cfg_sample_rate) > 1)) {
+            Warning(Fmt("Not reconfiguring, invalid sample rate: %s", cfg_sample_rate.c_str()));
+            return true;
+        }
+
+        if (!cfg_target_latency.empty() && adaptive_batching && stod(cfg_target_latency) <= 0) {
+            Warning("Not reconfiguring, target latency must be positive for adaptive batching");
+            return true;
+        }
+
+        // the rest only has to parse, sizes and counts as they are applied
+        for (const std::string * value : {&cfg_connect_timeout, &cfg_reconnect_min, &cfg_reconnect_max, &cfg_dns_ttl, &cfg_keepalive, &cfg_user_timeout, &cfg_buffer_latency}) {
+            if (!value->empty())
+                stod(*value);
+        }
+
+        for (const std::string * value : {&cfg_send_buffer, &cfg_buffer_size, &cfg_buffer_records, &cfg_backlog_size, &cfg_max_records_per_sec, &cfg_trace_every}) {
+            if (!value->empty())
+                ParseSize(*value);
+        }
+    }
+    catch (const std::exception &) {
+        Warning("Not reconfiguring, invalid number given");
+        return true;
+    }
+
+    // the batch in flight goes out as configured before, to the old
+    // address as well
+    if (!Flush())
+        return false;
+
+    if (!cfg_host.empty())
+        host = cfg_host;
+    if (!cfg_hosts.empty())
+        hosts = cfg_hosts;
+    tcpport = new_tcpport;
+
+    size_t old_backlog_size = backlog_size;
+    nagle = new_nagle;
+
+    if (!cfg_connect_timeout.empty())
+        connect_timeout = stod(cfg_connect_timeout);
+    if (!cfg_reconnect_min.empty())
+        reconnect_min = stod(cfg_reconnect_min);
+    if (!cfg_reconnect_max.empty())
+        reconnect_max = stod(cfg_reconnect_max);
+    if (!cfg_dns_ttl.empty())
+        dns_ttl = stod(cfg_dns_ttl);
+    if (!cfg_send_buffer.empty())
+        send_buffer = ParseSize(cfg_send_buffer);
+    if (!cfg_keepalive.empty())
+        keepalive = stod(cfg_keepalive);
+    if (!cfg_user_timeout.empty())
+        user_timeout = stod(cfg_user_timeout);
+    if (!cfg_congestion_control.empty())
+        congestion_control = cfg_congestion_control;
+    if (!cfg_buffer_size.empty())
+        buffer_size = ParseSize(cfg_buffer_size);
+    if (!cfg_buffer_records.empty())
+        buffer_records = ParseSize(cfg_buffer_records);
+    if (!cfg_buffer_latency.empty())
+        buffer_latency = stod(cfg_buffer_latency);
+    if (!cfg_backlog_size.empty())
+        backlog_size = ParseSize(cfg_backlog_size);
+    if (!cfg_target_latency.empty())
+        target_latency = stod(cfg_target_latency);
+    if (!cfg_sample_rate.empty())
+        sample_rate = stod(cfg_sample_rate);
+    if (!cfg_max_records_per_sec.empty())
+        max_records_per_sec = ParseSize(cfg_max_records_per_sec);
+    if (!cfg_trace_every.empty())
+        trace_every = ParseSize(cfg_trace_every);
+
+    if (!cfg_sample_rate.empty())
+        sampler.SetRate(sample_rate, sampler.Field());
+    if (!cfg_max_records_per_sec.empty())
+        sampler.SetLimit(max_records_per_sec);
+    if (!cfg_trace_every.empty())
+        tracer->SetEvery(trace_every);
+
+    // adapting starts over with a new target
+    if (adaptive_batching && (!cfg_target_latency.empty() || !cfg_buffer_records.empty()))
+        batcher.SetTarget(target_latency, buffer_records > 0 ? buffer_records : Batcher::MAX_RECORDS);
+
+    // new sockets for a new address or socket options, while timeouts
+    // apply to the next connect
+    bool sockets = !cfg_send_buffer.empty() || !cfg_nagle.empty() || !cfg_keepalive.empty() || !cfg_user_timeout.empty() || !cfg_congestion_control.empty();
+
+    for (size_t i = 0; i < endpoints.size(); i++) {
+        Endpoint & endpoint = endpoints[i];
+
+        endpoint.backlog.SetCapacity(backlog_size);
+
+        if (endpoint.destination) {
+            // a shared connection keeps the options of the writer that
+            // opened it, so only another address means another one
+            Destination * destination = endpoint.destination;
+            if (destination->Host() == targets[i].first && destination->Port() == targets[i].second) {
+                if (backlog_size != old_backlog_size)
+                    destination->Resize(old_backlog_size, backlog_size);
+
+                continue;
+            }
+
+            // the old destination still sends what it holds
+            endpoint.destination = Destination::Acquire(ConnectionOptions(targets[i], endpoint.preamble, std::string()), backlog_size, priority_connections ? priority : -1, priority_scheduling);
+            endpoint.destination->AddPreamble(endpoint.preamble, priority);
+            endpoint.error_generation = endpoint.destination->ErrorGeneration();
+
+            destination->RemovePreamble(endpoint.preamble);
+            Destination::Release(destination, old_backlog_size);
+
+            if (!sender_cpus.empty()) {
+                int err = endpoint.destination->Pin(sender_cpus);
+                if (err != 0)
+                    Warning(Fmt("Error pinning sender thread to cpus: %s", strerror(err)));
+            }
+
+            continue;
+        }
+
+        Connection * conn = endpoint.conn;
+        const Connection::Options & current = conn->GetOptions();
+        bool moved = current.host != targets[i].first || current.tcpport != targets[i].second;
+
+        Connection::Options options = ConnectionOptions(targets[i], current.preamble, current.ack_session);
+
+        if (!moved && !sockets) {
+            conn->SetOptions(options);
+            continue;
+        }
+
+        if (conn->Connected()) {
+            // finish what is half sent, while unacknowledged batches go
+            // again over the new connection
+            Drain(endpoint, 1000);
+            conn->Close();
+
+            endpoint.unflushed = 0;
+            endpoint.backlog.Release();
+            Dropped(endpoint, endpoint.backlog.DiscardPartial());
+            endpoint.window.Rewind();
+        }
+
+        conn->SetOptions(options);
+
+        // heartbeats reconnect when retrying, as after a failure
+        if (!retry && endpoints.size() == 1) {
+            Resync(endpoint);
+
+            if (!DoLoad(endpoint))
+                return false;
+
+            ReportOffload(endpoint);
+        }
+    }
+
+    return true;
+}
+
 bool TCP::DoHeartbeat(double network_time, double current_time) {
+    // settings changed at run time since the last heartbeat
+    std::map<std::string, std::string> changes;
+    reload_generation = Reload::Take(stream_path, reload_generation, changes);
+
+    if (!changes.empty() && !Reconfigure(changes))
+        return false;
+
+    // a stream going quiet shrinks its batches, and small batches go out
+    // without waiting for earlier data to be acknowledged
+    if (batcher.Enabled()) {
+        batcher.Update(Now(), written_records);
+
+        bool nodelay = batcher.Records() * batcher.RecordSize() < Chunks::CHUNK_SIZE;
+
+        for (Endpoint & endpoint : endpoints) {
+            if (endpoint.conn)
+                endpoint.conn->SetNoDelay(nodelay);
+        }
+    }
+
+    // send buffered records that have waited too long
+    if (pending_records > 0 && Now() - pending_time >= MaxDelay() && !Flush())
+        return false;
+
+    // and with formatter threads, what they have formatted by now
+    if (pipeline) {
+        if (job && Now() - pending_time >= MaxDelay())
+            Submit();
+
+        if (!Collect(pipeline->InFlight()))
+            return false;
+    }
+
+    for (Endpoint & endpoint : endpoints) {
+        if (endpoint.conn) {
+            Connection * conn = endpoint.conn;
+
+            // notice closed connections, acknowledgements and tls session tickets
+            if (conn->Connected() && !Receive(endpoint) && !Failed(endpoint))
+                return false;
+
+            // reconnect in steps that never wait on the network
+            if (!conn->Connected() && (retry || endpoints.size() > 1)) {
+                Resync(endpoint);
+
+                Connection::State state = conn->Reconnect();
+
+                if (state == Connection::CONNECTED)
+                    endpoint.reconnects++;
+
+                if (state == Connection::FAILED && conn->Failures() == 1)
+                    Warning(conn->LastError().c_str());
+            }
+
+            // work through the backlog, or hand it over while down
+            if (conn->Connected()) {
+                if (!Drain(endpoint, nonblocking ? 0 : -1))
+                    return false;
+            }
+            else if (!Failover(endpoint)) {
+                return false;
+            }
+        }
+
+        if (endpoint.destination) {
+            Destination * destination = endpoint.destination;
+
+            Dropped(endpoint, destination->TakeDropped());
+
+            uint64_t generation = destination->ErrorGeneration();
+            if (generation != endpoint.error_generation) {
+                endpoint.error_generation = generation;
+
+                if (!retry && endpoints.size() == 1) {
+                    Error(destination->LastError().c_str());
+                    return false;
+                }
+
+                // only one of the writers sharing the connection reports it
+                if (destination->ClaimError(generation))
+                    Warning(destination->LastError().c_str());
+            }
+        }
+    }
+
+    for (Endpoint & endpoint : endpoints) {
+        ReportOffload(endpoint);
+        ReportTuning(endpoint);
+    }
+
+    Publish();
+
+    if (dropped_records > reported_drops) {
+        Warning(Fmt("Dropped %" PRIu64 " records (%" PRIu64 " total)", dropped_records - reported_drops, dropped_records));
+        reported_drops = dropped_records;
+    }
+
     return true;
 }
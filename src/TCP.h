@@ -5,15 +5,29 @@
 #pragma once
 
 #include <string>
-
-#include <openssl/ssl.h>
-#include <openssl/err.h>
+#include <vector>
 
 #include "logging/WriterBackend.h"
 #include "threading/formatters/JSON.h"
 #include "threading/formatters/Ascii.h"
 #include "Desc.h"
 
+#include "Affinity.h"
+#include "Backlog.h"
+#include "Batcher.h"
+#include "Binary.h"
+#include "Chunks.h"
+#include "Connection.h"
+#include "FastJSON.h"
+#include "Multiplexer.h"
+#include "Pipeline.h"
+#include "Reload.h"
+#include "Sampler.h"
+#include "Spool.h"
+#include "Stats.h"
+#include "Tracer.h"
+#include "Window.h"
+
 #include "tcpwriter.bif.h"
 
 namespace logging {
@@ -39,24 +53,236 @@ protected:
     virtual bool DoHeartbeat(double network_time, double current_time);
 
 private:
-    bool DoLoad(bool is_retry = false);
-    bool DoUnload();
+    // a collector and whatever is waiting to be sent to it
+    struct Endpoint {
+        Connection * conn;
+        Destination * destination;
+        uint64_t error_generation;
+
+        Backlog backlog;
+        uint64_t sent_bytes;
+
+        // bytes of the backlog's front entry taken by the compressor, kept
+        // there until their compressed data is out
+        size_t unflushed;
+
+        uint64_t sent_batches;
+        uint64_t dropped_records;
+        uint64_t reconnects;
+
+        // preamble registered with a shared destination
+        std::string preamble;
+
+        // whether tls offload was reported for the current connection
+        bool offload_reported;
+
+        // batches kept on disk, replayed at up to spool_rate bytes/s as
+        // far as they were spooled while down
+        Spool * spool;
+        uint64_t spooled_records;
+        double replay_budget;
+        double replay_time;
+        uint64_t replay_limited;
+
+        // batches sent but not yet acknowledged by the collector
+        Window window;
+        uint64_t acked_records;
+    };
+
+    // what formats records, for the writer thread and every formatter
+    // thread
+    struct Encoder {
+        Encoder() : formatter(nullptr), fast_json(nullptr), binary(nullptr) {}
+
+        threading::Formatter * formatter;
+        FastJSON * fast_json;
+        Binary * binary;
+        ODesc record;
+    };
+
+    void InitEncoder(Encoder & encoder, threading::formatter::JSON::TimeFormat json_timestamps, int num_fields, const threading::Field * const * fields);
+    void FreeEncoder(Encoder & encoder);
+    void Encode(Encoder & encoder, int num_fields, const threading::Field * const * fields, threading::Value ** vals, Chunks & out) const;
+
+    bool Setup(const WriterInfo & info, int num_fields, const threading::Field * const * fields);
+    void Teardown();
+    bool DoLoad(Endpoint & endpoint);
+    Connection::Options ConnectionOptions(const std::pair<std::string, int> & target, const std::string & preamble, const std::string & ack_session) const;
+    bool Reconfigure(const std::map<std::string, std::string> & changes);
+    bool Flush();
+    bool SendPending(double since);
+    void Submit();
+    bool Collect(size_t in_flight);
+    bool BufferFull() const;
+    double MaxDelay() const;
+    size_t RecordsBefore(size_t offset) const;
+    bool Up(const Endpoint & endpoint) const;
+    bool AnyUp() const;
+    Endpoint & Pick();
+    bool Send(Endpoint & endpoint);
+    bool Hold(Endpoint & endpoint, size_t offset, size_t len, size_t records, bool started, Trace * trace = nullptr);
+    bool Queue(Endpoint & endpoint, const char * msg, size_t len, size_t records, bool started, Trace * trace = nullptr);
+    Trace * TakeTrace();
+    bool Idle(const Endpoint & endpoint) const;
+    bool Chained() const;
+    void Resync(Endpoint & endpoint);
+    bool Spill(Endpoint & endpoint, const char * msg, size_t len, size_t records);
+    bool Replay(Endpoint & endpoint);
+    bool Drain(Endpoint & endpoint, int timeout);
+    bool DrainWindow(Endpoint & endpoint, int timeout);
+    bool Receive(Endpoint & endpoint);
+    bool Failed(Endpoint & endpoint);
+    bool Failover(Endpoint & endpoint);
+    void Dropped(Endpoint & endpoint, size_t records);
+    void ReportOffload(Endpoint & endpoint);
+    void ReportTuning(Endpoint & endpoint);
+    void Publish();
     std::string GetConfigValue(const WriterInfo & info, const std::string name) const;
 
-    bool ssl_init;
-    int sock;
-    SSL_CTX * ctx;
-    SSL * ssl;
+    std::vector<Endpoint> endpoints;
+    size_t next_endpoint;
+
+    Encoder encoder;
+    Chunks chunks;
+    std::string held;
+    std::string drained;
+    std::string received;
+    std::string path_tag;
+    std::vector<size_t> record_ends;
+    bool buffered;
+
+    // what describes the records, sent at the start of every connection
+    std::string header;
+
+    // the connection the last coded batch started on
+    uint64_t chained_connects;
+
+    // set by DoFinish, bounding how long a blocking writer waits
+    bool finishing;
+    size_t pending_records;
+    double pending_time;
 
-    threading::formatter::JSON * formatter;
-    ODesc buffer;
+    uint64_t dropped_records;
+    uint64_t reported_drops;
+    uint64_t written_records;
+    Stats * stats;
+
+    // the path records are sent under, shared by the shards of a stream
+    std::string stream_path;
+
+    // settings changed at run time, as taken on the last heartbeat
+    uint64_t reload_generation;
+    std::map<std::string, std::string> reloaded;
+
+    // the records traced in the pending batch, as when they were written
+    // and formatted, and the trace the batch carries while it is sent
+    Tracer * tracer;
+    std::vector<std::pair<double, double>> traced;
+    Trace * pending_trace;
+
+    // records skipped before formatting
+    Sampler sampler;
+    uint64_t sampled_records;
+    uint64_t limited_records;
+
+    // batch sizes tuned to the target latency
+    Batcher batcher;
+
+    // indices of the fields sent, empty to send all of them
+    std::vector<int> projection;
+    std::vector<const threading::Field *> projected_fields;
+    std::vector<threading::Value *> projected_vals;
+
+    // the fields formatted, after projection
+    int sent_num_fields;
+    const threading::Field * const * sent_fields;
+
+    // formatter threads, and the job gathering records for them
+    Pipeline * pipeline;
+    std::vector<Encoder *> encoders;
+    Job * job;
 
     std::string host;
     int tcpport;
+    std::string hosts;
     bool retry;
     bool tls;
     std::string cert;
     std::string key;
+    size_t buffer_size;
+    size_t buffer_records;
+    double buffer_latency;
+    bool nonblocking;
+    size_t backlog_size;
+
+    enum BacklogPolicy {
+        DROP_OLDEST,
+        DROP_NEWEST,
+        BLOCK,
+    };
+
+    BacklogPolicy backlog_policy;
+    bool multiplex;
+
+    enum Balance {
+        ROUND_ROBIN,
+        LEAST_BACKLOG,
+    };
+
+    Balance balance;
+    double connect_timeout;
+    double reconnect_min;
+    double reconnect_max;
+    double dns_ttl;
+    std::string compression;
+    int compression_level;
+
+    enum Format {
+        FORMAT_JSON,
+        FORMAT_JSON_FAST,
+        FORMAT_TSV,
+        FORMAT_BINARY,
+    };
+
+    Format format;
+    bool ktls;
+    std::string spool_dir;
+    size_t spool_segment_size;
+    size_t spool_max_segments;
+    size_t spool_rate;
+    bool acks;
+    size_t ack_window;
+    double sample_rate;
+    std::string sample_field;
+    size_t max_records_per_sec;
+    std::string include_fields;
+    std::string exclude_fields;
+    size_t format_threads;
+    size_t format_batch;
+    Connection::Transport transport;
+    size_t datagram_size;
+    bool adaptive_batching;
+    double target_latency;
+
+    // lane of this writer's batches on a shared connection, 0 highest
+    int priority;
+    Destination::Scheduling priority_scheduling;
+    bool priority_connections;
+    size_t send_buffer;
+    Connection::Nagle nagle;
+    double keepalive;
+    double user_timeout;
+    std::string congestion_control;
+    std::vector<int> sender_cpus;
+    std::vector<int> format_cpus;
+    bool io_uring;
+    std::string dictionary_fields;
+    size_t dictionary_size;
+    std::string delta_fields;
+    uint64_t trace_every;
+
+    // how binary fields are coded, empty when all are plain
+    std::vector<Binary::Coding> codings;
 };
 
 }
@@ -0,0 +1,99 @@
+// See the file "COPYING" for copyright.
+//
+// TLS contexts shared by all connections trusting the same certificate
+
+#include <openssl/err.h>
+
+#include "Connection.h"
+#include "TLSContext.h"
+
+using namespace logging;
+using namespace writer;
+
+std::once_flag TLSContext::init_flag;
+std::mutex TLSContext::contexts_lock;
+std::map<std::string, TLSContext::Entry> TLSContext::contexts;
+
+void TLSContext::Init() {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    // add tls
+    SSL_load_error_strings();
+    SSL_library_init();
+    OpenSSL_add_all_algorithms();
+#else
+    OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
+#endif
+}
+
+const char * TLSContext::LastError() {
+    const char * reason = ERR_reason_error_string(ERR_get_error());
+    return reason ? reason : "unknown error";
+}
+
+SSL_CTX * TLSContext::Acquire(const std::string & cert, std::string & error) {
+    std::call_once(init_flag, Init);
+
+    std::lock_guard<std::mutex> guard(contexts_lock);
+
+    std::map<std::string, Entry>::iterator it = contexts.find(cert);
+    if (it != contexts.end()) {
+        it->second.users++;
+        return it->second.ctx;
+    }
+
+    // create context for tls
+    SSL_CTX * ctx = SSL_CTX_new(SSLv23_client_method());
+    if (ctx == nullptr) {
+        error = std::string("Error setting up TLS context: ") + LastError();
+        return nullptr;
+    }
+
+    int ret;
+
+    if (cert.empty()) {
+        // load default paths in context
+        ret = SSL_CTX_set_default_verify_paths(ctx);
+        if (ret <= 0) {
+            error = std::string("Error loading default certificate paths: ") + LastError();
+
+            // clean up
+            SSL_CTX_free(ctx);
+            return nullptr;
+        }
+    }
+    else {
+        // add certificate to context
+        ret = SSL_CTX_load_verify_locations(ctx, cert.c_str(), NULL);
+        if (ret <= 0) {
+            error = std::string("Error using TLS certificate: ") + LastError();
+
+            // clean up
+            SSL_CTX_free(ctx);
+            return nullptr;
+        }
+    }
+
+    // hand new sessions to their connection for resumption on reconnect
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, Connection::NewSession);
+
+    contexts[cert] = Entry{ctx, 1};
+
+    return ctx;
+}
+
+void TLSContext::Release(SSL_CTX * ctx) {
+    std::lock_guard<std::mutex> guard(contexts_lock);
+
+    for (std::map<std::string, Entry>::iterator it = contexts.begin(); it != contexts.end(); ++it) {
+        if (it->second.ctx != ctx)
+            continue;
+
+        if (--it->second.users == 0) {
+            SSL_CTX_free(ctx);
+            contexts.erase(it);
+        }
+
+        return;
+    }
+}
@@ -0,0 +1,41 @@
+// See the file "COPYING" for copyright.
+//
+// TLS contexts shared by all connections trusting the same certificate
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <openssl/ssl.h>
+
+namespace logging {
+namespace writer {
+
+class TLSContext {
+
+public:
+    // shared context trusting cert, or the default paths when empty
+    static SSL_CTX * Acquire(const std::string & cert, std::string & error);
+    static void Release(SSL_CTX * ctx);
+
+    // reason for the oldest queued openssl error
+    static const char * LastError();
+
+private:
+    // global openssl setup, done once per process
+    static void Init();
+
+    struct Entry {
+        SSL_CTX * ctx;
+        int users;
+    };
+
+    static std::once_flag init_flag;
+    static std::mutex contexts_lock;
+    static std::map<std::string, Entry> contexts;
+};
+
+}
+}
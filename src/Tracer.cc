@@ -0,0 +1,77 @@
+// See the file "COPYING" for copyright.
+//
+// Sampled tracing of records on their way from DoWrite to the collector
+
+#include <chrono>
+
+#include "Tracer.h"
+
+using namespace logging;
+using namespace writer;
+
+double Tracer::Now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Tracer::Tracer() : every(0), count(0), traced(0), lost(0), refs(1), finished(SLOTS) {
+    spare.reserve(SLOTS);
+
+    for (Trace & slot : slots)
+        spare.push_back(&slot);
+}
+
+Tracer::~Tracer() {}
+
+void Tracer::SetEvery(uint64_t every) {
+    this->every = every;
+    count = 0;
+}
+
+Trace * Tracer::Start(double start, double enqueued) {
+    if (spare.empty()) {
+        lost++;
+        return nullptr;
+    }
+
+    Trace * trace = spare.back();
+    spare.pop_back();
+
+    *trace = Trace{this, start, enqueued, 0, 0};
+    refs.fetch_add(1, std::memory_order_relaxed);
+
+    return trace;
+}
+
+void Tracer::Finish(Trace * trace) {
+    // the queue stays until the trace's reference is given up, and has
+    // room for every slot
+    Tracer * tracer = trace->tracer;
+
+    tracer->finished.Push(trace);
+    tracer->Release();
+}
+
+void Tracer::Collect(Stats * stats) {
+    Trace * trace;
+
+    while (finished.Pop(trace)) {
+        if (trace->written == 0) {
+            lost++;
+        }
+        else {
+            stats->trace_send.Record(trace->written - trace->enqueued);
+
+            if (trace->acked > 0)
+                stats->trace_ack.Record(trace->acked - trace->written);
+
+            stats->trace_total.Record((trace->acked > 0 ? trace->acked : trace->written) - trace->start);
+        }
+
+        spare.push_back(trace);
+    }
+}
+
+void Tracer::Release() {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+}
@@ -0,0 +1,107 @@
+// See the file "COPYING" for copyright.
+//
+// Sampled tracing of records on their way from DoWrite to the collector
+//
+// One in every n records is timestamped as the writer gets it and once it
+// is formatted. Its batch then carries a Trace, stamped when the batch is
+// handed to a connection, when the socket took all of it and, with acks,
+// when the collector acknowledged it. Whoever is done with the batch, the
+// writer or the sender thread of a shared connection, hands the trace back
+// through a lock-free queue, and the writer adds what came back to its
+// histograms on heartbeats. Traces keep their tracer alive, so batches may
+// outlive the writer that sent them.
+//
+// Traces come from a fixed number of slots allocated with the tracer and
+// go back through a ring of the same size, so tracing allocates nothing
+// per batch. A batch traced while every slot is out goes without, and
+// counts as lost.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "Queue.h"
+#include "Stats.h"
+
+namespace logging {
+namespace writer {
+
+class Tracer;
+
+struct Trace {
+    Tracer * tracer;
+
+    // when the first traced record of the batch was written, the batch
+    // was handed to a connection, the socket took all of it and the
+    // collector acknowledged it, 0 for stages not reached
+    double start;
+    double enqueued;
+    double written;
+    double acked;
+};
+
+class Tracer {
+
+public:
+    // traces out at most, a power of two
+    static const size_t SLOTS = 256;
+
+    // the monotonic clock traces are stamped with
+    static double Now();
+
+    Tracer();
+
+    // trace one in every records, 0 for none
+    void SetEvery(uint64_t every);
+
+    // whether to trace the record being written
+    bool Sample() {
+        if (every == 0 || ++count < every)
+            return false;
+
+        count = 0;
+        traced++;
+        return true;
+    }
+
+    // a trace for a batch handed to a connection at enqueued, nullptr
+    // when all are out
+    Trace * Start(double start, double enqueued);
+
+    // hand a trace back, from any thread, whether or not it got anywhere
+    static void Finish(Trace * trace);
+
+    // add the traces handed back so far to the histograms of stats
+    void Collect(Stats * stats);
+
+    // records traced, and batches dropped before reaching the socket
+    uint64_t Traced() const { return traced; }
+    uint64_t Lost() const { return lost; }
+
+    // give up the writer's reference, the last trace back deleting the
+    // tracer
+    void Release();
+
+private:
+    ~Tracer();
+
+    Tracer(const Tracer &) = delete;
+    Tracer & operator=(const Tracer &) = delete;
+
+    uint64_t every;
+    uint64_t count;
+    uint64_t traced;
+    uint64_t lost;
+
+    std::atomic<int> refs;
+
+    // slots for traces, those the writer can take and those handed back
+    Trace slots[SLOTS];
+    std::vector<Trace *> spare;
+    BoundedMPSCQueue<Trace *> finished;
+};
+
+}
+}
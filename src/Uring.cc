@@ -0,0 +1,294 @@
+// See the file "COPYING" for copyright.
+//
+// Minimal io_uring ring for sending batches
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "Uring.h"
+
+using namespace logging;
+using namespace writer;
+
+#ifndef HAVE_IO_URING
+
+Uring * Uring::ForThread(std::string & error) {
+    error = "built without io_uring";
+    return nullptr;
+}
+
+Uring::~Uring() {}
+
+ssize_t Uring::Send(int /* sock */, const struct iovec * /* iov */, int /* count */) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#else
+
+Uring * Uring::ForThread(std::string & error) {
+    // set up on first use, remembering a failure so it is not retried
+    thread_local std::unique_ptr<Uring> ring;
+    thread_local bool tried = false;
+    thread_local std::string failure;
+
+    if (!tried) {
+        tried = true;
+        ring.reset(new Uring());
+
+        if (!ring->Init(failure))
+            ring.reset();
+    }
+
+    // a broken ring is kept for the connections still holding it
+    if (ring && ring->Broken()) {
+        error = "io_uring failed earlier on this thread";
+        return nullptr;
+    }
+
+    if (!ring)
+        error = failure;
+
+    return ring.get();
+}
+
+Uring::Uring() : fd(-1), zerocopy(false), broken(false), sq_ring(MAP_FAILED), sq_ring_size(0), cq_ring(MAP_FAILED), cq_ring_size(0), sqes((io_uring_sqe *)MAP_FAILED), sqes_size(0), sq_head(nullptr), sq_tail(nullptr), sq_mask(nullptr), sq_array(nullptr), cq_head(nullptr), cq_tail(nullptr), cq_mask(nullptr), cqes(nullptr) {}
+
+Uring::~Uring() {
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+
+    if (sq_ring != MAP_FAILED)
+        munmap(sq_ring, sq_ring_size);
+
+    if (fd >= 0)
+        close(fd);
+}
+
+bool Uring::Init(std::string & error) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    fd = syscall(__NR_io_uring_setup, ENTRIES, &params);
+    if (fd < 0) {
+        error = std::string("Error setting up io_uring: ") + strerror(errno);
+        return false;
+    }
+
+    // ask which operations this kernel knows
+    std::vector<uint64_t> space((sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)) / sizeof(uint64_t) + 1);
+    struct io_uring_probe * probe = (struct io_uring_probe *)space.data();
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        error = std::string("Error probing io_uring: ") + strerror(errno);
+        return false;
+    }
+
+    auto supported = [probe](int op) {
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    };
+
+    if (!supported(IORING_OP_SEND)) {
+        error = "io_uring cannot send on this kernel";
+        return false;
+    }
+
+    zerocopy = supported(IORING_OP_SEND_ZC);
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // newer kernels map both rings at once
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        error = std::string("Error mapping io_uring: ") + strerror(errno);
+        return false;
+    }
+
+    cq_ring = single ? sq_ring : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+        error = std::string("Error mapping io_uring: ") + strerror(errno);
+        return false;
+    }
+
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        error = std::string("Error mapping io_uring: ") + strerror(errno);
+        return false;
+    }
+
+    char * sq = (char *)sq_ring;
+    char * cq = (char *)cq_ring;
+
+    sq_head = (unsigned *)(sq + params.sq_off.head);
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + params.sq_off.array);
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+int Uring::Enter(unsigned submit, unsigned wait) {
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+
+    return ret;
+}
+
+bool Uring::Reap(io_uring_cqe & cqe) {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+
+    cqe = cqes[head & *cq_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void Uring::Complete(ssize_t * results, int & expected) {
+    io_uring_cqe cqe;
+
+    while (Reap(cqe)) {
+        if (!(cqe.flags & IORING_CQE_F_NOTIF))
+            results[cqe.user_data] = cqe.res;
+
+        if (cqe.flags & IORING_CQE_F_MORE)
+            expected++;
+
+        expected--;
+    }
+}
+
+ssize_t Uring::Send(int sock, const struct iovec * iov, int count) {
+    count = std::min(count, (int)ENTRIES);
+
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += iov[i].iov_len;
+
+    bool copyless = zerocopy && total >= ZEROCOPY_SIZE;
+
+    // one send per vector, each started only once the one before is
+    // complete, so the stream keeps its order
+    unsigned tail = *sq_tail;
+
+    for (int i = 0; i < count; i++) {
+        unsigned index = (tail + i) & *sq_mask;
+        io_uring_sqe * sqe = &sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = copyless ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+        sqe->fd = sock;
+        sqe->addr = (uint64_t)(uintptr_t)iov[i].iov_base;
+        sqe->len = iov[i].iov_len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = i;
+
+        if (i + 1 < count)
+            sqe->flags = IOSQE_IO_LINK;
+
+        sq_array[index] = index;
+    }
+
+    __atomic_store_n(sq_tail, tail + count, __ATOMIC_RELEASE);
+
+    // results, and for zero-copy sends the notifications that the kernel
+    // is done with the data, which may be reused once this returns
+    ssize_t results[ENTRIES];
+    std::fill(results, results + count, -ECANCELED);
+
+    unsigned submit = count;
+    int expected = count;
+    int failure = 0;
+
+    while (expected > 0) {
+        int ret = Enter(submit, 1);
+
+        if (ret < 0) {
+            failure = errno;
+            break;
+        }
+
+        submit -= std::min((unsigned)ret, submit);
+        Complete(results, expected);
+    }
+
+    if (failure) {
+        // the kernel may still be reading the vectors of the sends it
+        // took, so those are waited for; the ones it did not take are
+        // taken back, which is safe as it only reads the tail on entering
+        broken = true;
+
+        __atomic_store_n(sq_tail, tail + count - submit, __ATOMIC_RELEASE);
+        expected -= submit;
+        count -= submit;
+
+        Complete(results, expected);
+
+        while (expected > 0) {
+            // completions run as task work on the way out of any system
+            // call, when entering to wait fails too
+            if (Enter(0, 1) < 0) {
+                struct timespec pause = {0, 1000000};
+                nanosleep(&pause, nullptr);
+            }
+
+            Complete(results, expected);
+        }
+
+        if (count == 0 || results[0] == -ECANCELED) {
+            errno = failure;
+            return -1;
+        }
+    }
+
+    // a failed or short send cancels the ones linked after it
+    ssize_t sent = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (results[i] < 0) {
+            if (sent > 0)
+                break;
+
+            errno = -results[i];
+            return -1;
+        }
+
+        sent += results[i];
+
+        if ((size_t)results[i] < iov[i].iov_len)
+            break;
+    }
+
+    return sent;
+}
+
+#endif
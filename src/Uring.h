@@ -0,0 +1,81 @@
+// See the file "COPYING" for copyright.
+//
+// Minimal io_uring ring for sending batches
+//
+// Every thread that sends gets one ring, shared by all its connections.
+// A batch goes out as a chain of linked sends, one per chunk, submitted
+// with a single system call; large batches use zero-copy sends and wait
+// for the kernel to let go of the chunks. Only the kernel interface from
+// linux/io_uring.h is used, and callers fall back to plain sends when the
+// ring or the operations are not available, or once the ring fails.
+// Send always waits for every send it submitted, so the vectors can be
+// reused as soon as it returns.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace logging {
+namespace writer {
+
+class Uring {
+
+public:
+    // batches from this size on are sent without copying
+    static const size_t ZEROCOPY_SIZE = 65536;
+
+    // the calling thread's ring, or nullptr with error set when the
+    // kernel lacks io_uring or sending on it
+    static Uring * ForThread(std::string & error);
+
+    ~Uring();
+
+    // send count vectors over sock as linked sends, returning the bytes
+    // sent before the first short send or -1 with errno set
+    ssize_t Send(int sock, const struct iovec * iov, int count);
+
+    // whether entering the ring failed, leaving it unusable
+    bool Broken() const { return broken; }
+
+private:
+    // entries in the submission queue, and so vectors per call
+    static const unsigned ENTRIES = 64;
+
+    Uring();
+
+    bool Init(std::string & error);
+    int Enter(unsigned submit, unsigned wait);
+    bool Reap(io_uring_cqe & cqe);
+    void Complete(ssize_t * results, int & expected);
+
+    int fd;
+    bool zerocopy;
+    bool broken;
+
+    void * sq_ring;
+    size_t sq_ring_size;
+    void * cq_ring;
+    size_t cq_ring_size;
+    io_uring_sqe * sqes;
+    size_t sqes_size;
+
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    io_uring_cqe * cqes;
+};
+
+}
+}
@@ -0,0 +1,144 @@
+// See the file "COPYING" for copyright.
+//
+// Window of framed batches the collector has not acknowledged yet
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+
+#include "Window.h"
+
+using namespace logging;
+using namespace writer;
+
+Window::Window() : next(0), offset(0), bytes(0), records(0), capacity(0), sequence(0) {}
+
+Window::~Window() {
+    for (Frame & frame : frames) {
+        if (frame.trace)
+            Tracer::Finish(frame.trace);
+    }
+}
+
+void Window::SetCapacity(size_t capacity) {
+    this->capacity = capacity;
+}
+
+bool Window::Fits(size_t len) const {
+    return frames.empty() || bytes + len <= capacity;
+}
+
+void Window::Push(std::string & data, size_t records, Trace * trace) {
+    // sequence numbers start at 1, 0 frames the preamble
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "#batch %" PRIu64 " %zu %zu\n", ++sequence, records, data.size());
+
+    data.insert(0, header, header_len);
+
+    bytes += data.size();
+    this->records += records;
+
+    frames.push_back(Frame{sequence, std::string(), (size_t)header_len, records, trace});
+    frames.back().data.swap(data);
+
+    pool.Take(data);
+}
+
+bool Window::Pop(std::string & data, size_t & records, Trace *& trace) {
+    if (frames.empty())
+        return false;
+
+    Frame & frame = frames.front();
+
+    bytes -= frame.data.size();
+    this->records -= frame.records;
+
+    frame.data.erase(0, frame.header);
+    data.swap(frame.data);
+    records = frame.records;
+    trace = frame.trace;
+
+    pool.Give(frame.data);
+    frames.pop_front();
+
+    if (next > 0) {
+        next--;
+    }
+    else {
+        offset = 0;
+    }
+
+    return true;
+}
+
+const char * Window::Front() const {
+    return frames[next].data.data() + offset;
+}
+
+size_t Window::FrontLen() const {
+    return frames[next].data.size() - offset;
+}
+
+void Window::Consume(size_t len) {
+    offset += len;
+
+    if (offset == frames[next].data.size()) {
+        // a batch sent again after a reconnect keeps its first write
+        Trace * trace = frames[next].trace;
+        if (trace && trace->written == 0)
+            trace->written = Tracer::Now();
+
+        next++;
+        offset = 0;
+    }
+}
+
+size_t Window::Ack(uint64_t sequence) {
+    // acknowledgements are cumulative and only cover frames sent in full
+    size_t acked = 0;
+
+    while (next > 0 && frames.front().sequence <= sequence) {
+        acked += frames.front().records;
+
+        if (frames.front().trace) {
+            frames.front().trace->acked = Tracer::Now();
+            Tracer::Finish(frames.front().trace);
+        }
+
+        bytes -= frames.front().data.size();
+        records -= frames.front().records;
+
+        pool.Give(frames.front().data);
+        frames.pop_front();
+        next--;
+    }
+
+    return acked;
+}
+
+size_t Window::Received(const char * data, size_t len) {
+    size_t acked = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != '\n') {
+            // anything longer than an ack line is not one
+            if (line.size() < 64)
+                line += data[i];
+
+            continue;
+        }
+
+        if (line.compare(0, 5, "#ack ") == 0)
+            acked += Ack(strtoull(line.c_str() + 5, nullptr, 10));
+
+        line.clear();
+    }
+
+    return acked;
+}
+
+void Window::Rewind() {
+    next = 0;
+    offset = 0;
+    line.clear();
+}
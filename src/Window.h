@@ -0,0 +1,85 @@
+// See the file "COPYING" for copyright.
+//
+// Window of framed batches the collector has not acknowledged yet
+//
+// With acknowledgements every batch goes out as a "#batch <sequence>
+// <records> <length>" line followed by its data. The collector sends back
+// "#ack <sequence>" lines for everything up to that sequence number, and
+// what remains in the window is sent again after a reconnect.
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#include "Arena.h"
+#include "Tracer.h"
+
+namespace logging {
+namespace writer {
+
+class Window {
+
+public:
+    Window();
+    ~Window();
+
+    void SetCapacity(size_t capacity);
+
+    // whether a batch of len bytes can be added, an empty window takes
+    // any batch
+    bool Fits(size_t len) const;
+
+    // frame a batch with the next sequence number, taking its data and
+    // leaving data with a buffer from an acknowledged batch, with the
+    // trace of the batch finished once acknowledged
+    void Push(std::string & data, size_t records, Trace * trace);
+
+    // take the oldest batch without its frame, swapping its buffer with
+    // the one data had, along with its trace
+    bool Pop(std::string & data, size_t & records, Trace *& trace);
+
+    // unsent data of the first frame not completely sent
+    bool Unsent() const { return next < frames.size(); }
+    const char * Front() const;
+    size_t FrontLen() const;
+    void Consume(size_t len);
+
+    // handle data from the collector, returning the number of records
+    // acknowledged by it
+    size_t Received(const char * data, size_t len);
+
+    // send every frame again, as on a new connection
+    void Rewind();
+
+    bool Empty() const { return frames.empty(); }
+    size_t Size() const { return bytes; }
+    size_t Records() const { return records; }
+
+private:
+    struct Frame {
+        uint64_t sequence;
+        std::string data;
+        size_t header;
+        size_t records;
+        Trace * trace;
+    };
+
+    size_t Ack(uint64_t sequence);
+
+    std::deque<Frame> frames;
+    BufferPool pool;
+    size_t next;
+    size_t offset;
+    size_t bytes;
+    size_t records;
+    size_t capacity;
+    uint64_t sequence;
+
+    // start of a line from the collector
+    std::string line;
+};
+
+}
+}